@@ -0,0 +1,266 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Aho-Corasick engine for regexes that are just literals, like foo|bar|baz
+//
+// With thousands of branches the NFA gets a state for every char, and the JIT
+// code has a compare for each one. None of that is needed for plain literals:
+// they go in a trie, and each node gets a failure link to the node for the
+// longest suffix of its string that's also in the trie. An unanchored search
+// follows the failure links after a mismatch instead of backing up in the
+// string, so it reads every char once no matter how many literals there are.
+//
+// The trie is stored in breadth first order, so the children of a node are
+// next to each other and sorted by their char. The root has a full table of
+// children since every mismatch ends up back at it.
+//
+// Include it after parser.cpp since it uses the lexer.
+
+#include "mem_arena.h"
+#include "utils.h"
+
+struct aho_corasick {
+    uint32_t NumNodes;
+    // Node 0 is the root. The children of node i are nodes FirstChild[i] up to
+    // FirstChild[i + 1], so it has NumNodes + 1 entries.
+    uint32_t *FirstChild;
+    uint8_t *Char; // On the edge into each node
+    // The node for the longest proper suffix of each node's string that's in
+    // the trie, 0 if there isn't one
+    uint32_t *Fail;
+    bool *IsLiteral; // A literal ends at the node
+    // A literal ends at the node or any node on its chain of failure links
+    bool *HasMatch;
+    uint32_t RootNext[256]; // The root's child for each char, or 0
+    // Match anywhere in the string, see AhoCorasickMatch
+    bool Unanchored;
+};
+
+/**
+ * Check if the regex is only literals separated by |, with no other special
+ * chars unless they're escaped.
+ *
+ * Returns the number of literals, or 0 if it isn't one or any of the literals
+ * are empty (so it would match the empty string).
+ */
+uint32_t RegexCountLiterals(const char *Regex) {
+    uint32_t NumLiterals = 1;
+    uint32_t Length = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        if (Token.Escaped) {
+            Length += 1;
+            continue;
+        }
+        if (LexIsRepetition(Token)) {
+            return 0;
+        }
+        switch (*Token.Str) {
+        case '|': {
+            if (Length == 0) {
+                return 0;
+            }
+            NumLiterals += 1;
+            Length = 0;
+        } break;
+        case '.':
+        case '[':
+        case '*':
+        case '+':
+        case '?':
+        case '(':
+        case ')': {
+            return 0;
+        } break;
+        default: {
+            Length += 1;
+        } break;
+        }
+    }
+    return (Length == 0) ? 0 : NumLiterals;
+}
+
+// Find the child of a node other than the root for the char, or 0 if there
+// isn't one
+inline uint32_t AhoCorasickChild(aho_corasick *AC, uint32_t Node, uint8_t Char) {
+    uint32_t Low = AC->FirstChild[Node];
+    uint32_t High = AC->FirstChild[Node + 1];
+    while (Low < High) {
+        uint32_t Mid = Low + (High - Low) / 2;
+        if (AC->Char[Mid] == Char) {
+            return Mid;
+        } else if (AC->Char[Mid] < Char) {
+            Low = Mid + 1;
+        } else {
+            High = Mid;
+        }
+    }
+    return 0;
+}
+
+// The node an unanchored search goes to after reading Char at Node
+inline uint32_t AhoCorasickStep(aho_corasick *AC, uint32_t Node, uint8_t Char) {
+    for (;;) {
+        if (Node == 0) {
+            return AC->RootNext[Char];
+        }
+        uint32_t Child = AhoCorasickChild(AC, Node, Char);
+        if (Child) {
+            return Child;
+        }
+        Node = AC->Fail[Node];
+    }
+}
+
+/**
+ * Build the automaton for a regex that RegexCountLiterals said is only
+ * literals.
+ *
+ * Everything is allocated in Arena with one Alloc, so the pointers stay good
+ * as long as nothing else is allocated in it. If Unanchored, it matches if any
+ * of the literals are anywhere in the string.
+ *
+ * NumNodes will be 0 if there was an error allocating.
+ */
+aho_corasick AhoCorasickInit(const char *Regex, mem_arena *Arena, bool Unanchored = false) {
+    aho_corasick Result = {};
+    Result.Unanchored = Unanchored;
+
+    // Every char could make a new node
+    uint32_t MaxNodes = 1;
+    for (const char *Curr = Regex; *Curr; ++Curr) {
+        MaxNodes += 1;
+    }
+
+    // While inserting, the children of a node are a linked list sorted by
+    // their char. Then they're copied into breadth first order.
+    const size_t Size = MaxNodes * (5*sizeof(uint32_t) + 2*sizeof(uint8_t) + 3*sizeof(bool)) +
+                        sizeof(uint32_t);
+    uint8_t *Memory = (uint8_t *)Alloc(Arena, Size);
+    if (!Memory) {
+        return Result;
+    }
+    uint32_t *Child = (uint32_t *)Memory; // First child in the list, 0 if none
+    uint32_t *Sibling = Child + MaxNodes; // Next in the parent's list, 0 at the end
+    uint32_t *Queue = Sibling + MaxNodes; // The nodes in breadth first order
+    Result.Fail = Queue + MaxNodes;
+    Result.FirstChild = Result.Fail + MaxNodes;
+    uint8_t *ListChar = (uint8_t *)(Result.FirstChild + MaxNodes + 1);
+    Result.Char = ListChar + MaxNodes;
+    bool *ListIsLiteral = (bool *)(Result.Char + MaxNodes);
+    Result.IsLiteral = ListIsLiteral + MaxNodes;
+    Result.HasMatch = Result.IsLiteral + MaxNodes;
+    Assert((uint8_t *)(Result.HasMatch + MaxNodes) <= Memory + Size);
+    // The arena may have been used before, so don't rely on it being zeroed
+    for (size_t i = 0; i < Size; ++i) {
+        Memory[i] = 0;
+    }
+    uint32_t RootChild[256] = {};
+
+    // Insert each literal
+    uint32_t NumNodes = 1;
+    uint32_t Node = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        if (!Token.Escaped && *Token.Str == '|') {
+            ListIsLiteral[Node] = true;
+            Node = 0;
+            continue;
+        }
+        const uint8_t Char = (uint8_t)*Token.Str;
+        if (Node == 0) {
+            if (!RootChild[Char]) {
+                ListChar[NumNodes] = Char;
+                RootChild[Char] = NumNodes++;
+            }
+            Node = RootChild[Char];
+            continue;
+        }
+        uint32_t Prev = 0;
+        uint32_t Curr = Child[Node];
+        while (Curr && ListChar[Curr] < Char) {
+            Prev = Curr;
+            Curr = Sibling[Curr];
+        }
+        if (!Curr || ListChar[Curr] != Char) {
+            ListChar[NumNodes] = Char;
+            Sibling[NumNodes] = Curr;
+            if (Prev) {
+                Sibling[Prev] = NumNodes;
+            } else {
+                Child[Node] = NumNodes;
+            }
+            Curr = NumNodes++;
+        }
+        Node = Curr;
+    }
+    ListIsLiteral[Node] = true;
+    Result.NumNodes = NumNodes;
+
+    // Number the nodes in breadth first order. Queue[i] is the list node for
+    // node i, and its children go on the end of the queue together.
+    uint32_t QueueEnd = 1;
+    for (uint32_t Next = 0; Next < NumNodes; ++Next) {
+        const uint32_t ListNode = Queue[Next];
+        Result.FirstChild[Next] = QueueEnd;
+        Result.Char[Next] = ListChar[ListNode];
+        Result.IsLiteral[Next] = ListIsLiteral[ListNode];
+        if (Next == 0) {
+            for (uint32_t Char = 0; Char < 256; ++Char) {
+                if (RootChild[Char]) {
+                    Result.RootNext[Char] = QueueEnd;
+                    Queue[QueueEnd++] = RootChild[Char];
+                }
+            }
+            continue;
+        }
+        for (uint32_t Curr = Child[ListNode]; Curr; Curr = Sibling[Curr]) {
+            Queue[QueueEnd++] = Curr;
+        }
+    }
+    Assert(QueueEnd == NumNodes);
+    Result.FirstChild[NumNodes] = NumNodes;
+
+    // The failure links only go to shorter strings, which are earlier in
+    // breadth first order, so they're already done
+    for (uint32_t Parent = 0; Parent < NumNodes; ++Parent) {
+        for (uint32_t Node = Result.FirstChild[Parent];
+             Node < Result.FirstChild[Parent + 1];
+             ++Node)
+        {
+            if (Parent != 0) {
+                Result.Fail[Node] = AhoCorasickStep(&Result, Result.Fail[Parent], Result.Char[Node]);
+            }
+            Result.HasMatch[Node] = Result.IsLiteral[Node] || Result.HasMatch[Result.Fail[Node]];
+        }
+    }
+    return Result;
+}
+
+// Returns true if the entire null terminated string is one of the literals, or
+// it contains one if Unanchored
+bool AhoCorasickMatch(aho_corasick *AC, const char *Str) {
+    uint32_t Node = 0;
+    if (AC->Unanchored) {
+        for (; *Str; ++Str) {
+            Node = AhoCorasickStep(AC, Node, (uint8_t)*Str);
+            if (AC->HasMatch[Node]) {
+                return true;
+            }
+        }
+        return false;
+    }
+    for (; *Str; ++Str) {
+        if (Node == 0) {
+            Node = AC->RootNext[(uint8_t)*Str];
+        } else {
+            Node = AhoCorasickChild(AC, Node, (uint8_t)*Str);
+        }
+        if (Node == 0) {
+            return false; // Not a prefix of any literal
+        }
+    }
+    return AC->IsLiteral[Node];
+}
@@ -0,0 +1,191 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Subset construction helpers shared by the DFA based engines.
+//
+// A DFA state is a set of NFA states, stored as a bitset with one bit per NFA
+// state (the same layout the JIT code uses for ActiveStates). Each set is
+// always closed under epsilon arcs, see NFAEpsilonClosures.
+#ifndef DFA_H_
+
+#include "nfa.h"
+#include "nfa_passes.h"
+#include "mem_arena.h"
+
+// Compute the set of NFA states active after consuming Char from the From set.
+//
+// Closures comes from NFAEpsilonClosures, so the result is already closed
+// under epsilon arcs. From and To must not overlap.
+void NFAStepStates(nfa *NFA, const uint32_t *Closures,
+                   const uint32_t *From, char Char, uint32_t *To) {
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        To[i] = 0;
+    }
+
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        if (LabelMatches(ArcList->Label, Char)) {
+            for (size_t TransitionIdx = 0;
+                 TransitionIdx < ArcList->NumTransitions;
+                 ++TransitionIdx)
+            {
+                nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                if (!StateSetHas(From, Arc->From)) {
+                    continue;
+                }
+                const uint32_t *Closure = &Closures[Arc->To * NumStateDwords];
+                for (size_t i = 0; i < NumStateDwords; ++i) {
+                    To[i] |= Closure[i];
+                }
+            }
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+}
+
+// FNV-1a over the dwords of a state set
+inline uint32_t StateSetHash(const uint32_t *Set, uint32_t NumStateDwords) {
+    uint32_t Hash = 2166136261u;
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        Hash ^= Set[i];
+        Hash *= 16777619u;
+    }
+    return Hash;
+}
+
+inline bool StateSetEqual(const uint32_t *A, const uint32_t *B, uint32_t NumStateDwords) {
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        if (A[i] != B[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline bool StateSetIsEmpty(const uint32_t *Set, uint32_t NumStateDwords) {
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        if (Set[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * A fully determinized NFA
+ *
+ *  - States are numbered from 0 and the start state is always 0.
+ *  - Byte 0 is the end of NUL terminated strings, but it's a normal char in
+ *    counted ones so Next has an entry for it too.
+ *  - Dead states have no active NFA states. Nothing can match after reaching
+ *    one so the code generators treat transitions to them as a reject.
+ */
+struct dfa {
+    uint32_t NumStates;
+    // Next state for each state and input byte: Next[State * 256 + Byte]
+    uint32_t *Next;
+    bool *Accept;
+    bool *Dead;
+};
+
+/**
+ * Determinize the NFA ahead of time with the subset construction.
+ *
+ * Gives up if the DFA would have more than MaxStates states, since the DFA can
+ * be exponentially larger than the NFA. In that case NumStates is 0.
+ *
+ * If Unanchored, the start state's closure is added back after every char so a
+ * match can begin anywhere. If StopAtAccept, accept states only go to
+ * themselves, for when the search is over once one is reached.
+ *
+ * Everything is allocated in Arena, which should be scratch space.
+ */
+dfa NFAToDFA(nfa *NFA, mem_arena *Arena, uint32_t MaxStates,
+             bool Unanchored, bool StopAtAccept) {
+    dfa Result = {};
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    const uint32_t *Closures = NFAEpsilonClosures(NFA, Arena);
+    if (!Closures) {
+        return Result;
+    }
+    const size_t ClosuresOffset = (uint8_t *)Closures - Arena->Base;
+
+    // Do one allocation and split it up so the arena can't move under us
+    const size_t SetsSize = MaxStates * NumStateDwords * sizeof(uint32_t);
+    const size_t HashesSize = MaxStates * sizeof(uint32_t);
+    const size_t NextSize = MaxStates * 256 * sizeof(uint32_t);
+    const size_t StepSize = NumStateDwords * sizeof(uint32_t);
+    uint8_t *Memory = (uint8_t *)Alloc(Arena, SetsSize + HashesSize + NextSize +
+                                              StepSize + 2 * MaxStates);
+    if (!Memory) {
+        return Result;
+    }
+    Closures = (uint32_t *)(Arena->Base + ClosuresOffset);
+    uint32_t *Sets = (uint32_t *)Memory;
+    uint32_t *Hashes = (uint32_t *)(Memory + SetsSize);
+    uint32_t *Next = (uint32_t *)(Memory + SetsSize + HashesSize);
+    uint32_t *Step = (uint32_t *)(Memory + SetsSize + HashesSize + NextSize);
+    bool *Accept = (bool *)(Memory + SetsSize + HashesSize + NextSize + StepSize);
+    bool *Dead = Accept + MaxStates;
+
+    // Add the start state, then process states in the order they're found
+    // (which adds more states) until all of them have their transitions
+    uint32_t NumStates = 1;
+    const uint32_t *StartClosure = &Closures[NFA->StartState * NumStateDwords];
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        Sets[i] = StartClosure[i];
+    }
+    Hashes[0] = StateSetHash(Sets, NumStateDwords);
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        uint32_t *StateSet = &Sets[State * NumStateDwords];
+        Accept[State] = StateSetHas(StateSet, NFA_ACCEPTSTATE);
+        Dead[State] = StateSetIsEmpty(StateSet, NumStateDwords);
+
+        if (StopAtAccept && Accept[State]) {
+            for (uint32_t Byte = 0; Byte < 256; ++Byte) {
+                Next[State * 256 + Byte] = State;
+            }
+            continue;
+        }
+        for (uint32_t Byte = 0; Byte < 256; ++Byte) {
+            NFAStepStates(NFA, Closures, StateSet, (char)Byte, Step);
+            if (Unanchored) {
+                for (size_t i = 0; i < NumStateDwords; ++i) {
+                    Step[i] |= StartClosure[i];
+                }
+            }
+            const uint32_t Hash = StateSetHash(Step, NumStateDwords);
+
+            uint32_t Found = 0;
+            for (; Found < NumStates; ++Found) {
+                if (Hashes[Found] == Hash &&
+                    StateSetEqual(&Sets[Found * NumStateDwords], Step, NumStateDwords))
+                {
+                    break;
+                }
+            }
+            if (Found == NumStates) {
+                if (NumStates == MaxStates) {
+                    return Result; // Too big
+                }
+                uint32_t *NewSet = &Sets[NumStates * NumStateDwords];
+                for (size_t i = 0; i < NumStateDwords; ++i) {
+                    NewSet[i] = Step[i];
+                }
+                Hashes[NumStates] = Hash;
+                NumStates += 1;
+            }
+            Next[State * 256 + Byte] = Found;
+        }
+    }
+
+    Result.NumStates = NumStates;
+    Result.Next = Next;
+    Result.Accept = Accept;
+    Result.Dead = Dead;
+    return Result;
+}
+
+#define DFA_H_
+#endif
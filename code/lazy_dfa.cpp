@@ -0,0 +1,238 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Lazy DFA execution engine
+//
+// Instead of simulating every NFA state on every character like the JIT code
+// does, this builds DFA states (sets of NFA states, see dfa.h) only when the
+// input actually reaches them and caches them along with the transitions
+// between them. Once the few state sets a pattern visits are in the cache,
+// each character costs a single table lookup.
+//
+// The cache lives in its own mem_arena which is never allowed to grow past
+// MemoryCap bytes. When a new state doesn't fit we flush the whole cache and
+// keep going from the state set we were in.
+
+#include "dfa.h"
+#include "mem_arena.h"
+
+#define LAZY_DFA_DEFAULT_MEMORY_CAP (1024 * 1024)
+
+// One cached DFA state.
+//
+// States are referred to by their byte offset from the cache arena base
+// because the arena can move when it expands. Offset 0 is the hash table so
+// it is never a state and we use it to mean "not computed yet".
+struct lazy_dfa_state {
+    // Offset of the state reached by consuming each byte value
+    uint32_t Next[256];
+    uint32_t Hash;
+    bool Accept;
+    // No NFA states are active, no input can ever match from here
+    bool Dead;
+    // The NFA state set. We allocate extra space at the end of the struct for
+    // this array (NumStateDwords long)
+    uint32_t States[1];
+};
+
+struct lazy_dfa {
+    nfa *NFA;
+    uint32_t *Closures;
+    uint32_t NumStateDwords;
+    // Match anywhere in the string, see LazyDFAMatch
+    bool Unanchored;
+    // Scratch space used to compute the state set for a new transition
+    uint32_t *StepStates;
+
+    // The cache starts with an open addressing hash table (NumHashSlots state
+    // offsets) followed by the states
+    mem_arena Cache;
+    size_t MemoryCap;
+    size_t StateSize;
+    uint32_t NumHashSlots;
+
+    uint32_t StartState; // 0 when not cached
+    size_t NumCachedStates;
+    size_t NumFlushes;
+};
+
+inline lazy_dfa_state *LazyDFAGetState(lazy_dfa *DFA, uint32_t Offset) {
+    return (lazy_dfa_state *)(DFA->Cache.Base + Offset);
+}
+
+inline uint32_t *LazyDFAHashTable(lazy_dfa *DFA) {
+    return (uint32_t *)DFA->Cache.Base;
+}
+
+// Throw away every cached state. The hash table stays allocated.
+void LazyDFAFlush(lazy_dfa *DFA) {
+    uint32_t *HashTable = LazyDFAHashTable(DFA);
+    for (size_t Slot = 0; Slot < DFA->NumHashSlots; ++Slot) {
+        HashTable[Slot] = 0;
+    }
+    DFA->Cache.Used = DFA->NumHashSlots * sizeof(uint32_t);
+    DFA->StartState = 0;
+    DFA->NumCachedStates = 0;
+    DFA->NumFlushes += 1;
+}
+
+/**
+ * Set up a lazy DFA for the NFA. Nothing is determinized until it's needed.
+ *
+ * The epsilon closures and scratch space are allocated in Arena, which must
+ * outlive the lazy_dfa (along with the NFA). It can't be the NFA's arena,
+ * since it can move when it grows. The state cache is allocated separately,
+ * all MemoryCap bytes of it up front, so matching never has to allocate and
+ * can't fail. MemoryCap must have room for at least two states (each one is a
+ * bit over 1KB) after the hash table.
+ *
+ * If Unanchored, the start state is added back after every char so a match can
+ * begin anywhere in the string.
+ *
+ * The Cache.Base pointer will be NULL if there was an error allocating or
+ * MemoryCap is too small, or if the NFA has counters, which only the JIT code
+ * can run (see RegexToNFA's NoCounters).
+ */
+lazy_dfa LazyDFAInit(nfa *NFA, mem_arena *Arena, size_t MemoryCap,
+                     bool Unanchored = false) {
+    lazy_dfa Result = {};
+    Result.NFA = NFA;
+    Result.Unanchored = Unanchored;
+    Result.NumStateDwords = NFANumStateDwords(NFA);
+    Result.Closures = NFAEpsilonClosures(NFA, Arena);
+    const size_t ClosuresOffset = (uint8_t *)Result.Closures - Arena->Base;
+    Result.StepStates = (uint32_t *)Alloc(Arena, Result.NumStateDwords * sizeof(uint32_t));
+    if (Result.Closures) { // The arena may have moved
+        Result.Closures = (uint32_t *)(Arena->Base + ClosuresOffset);
+    }
+    Result.MemoryCap = MemoryCap;
+    Result.StateSize = sizeof(lazy_dfa_state) + (Result.NumStateDwords - 1) * sizeof(uint32_t);
+    if (!Result.Closures || !Result.StepStates || NFA->NumCounters > 0) {
+        return Result;
+    }
+
+    // Size the hash table so it stays at most half full when the cache is full
+    const size_t MaxStates = MemoryCap / Result.StateSize;
+    Result.NumHashSlots = 1;
+    while (Result.NumHashSlots < 2 * MaxStates) {
+        Result.NumHashSlots *= 2;
+    }
+    const size_t HashTableSize = Result.NumHashSlots * sizeof(uint32_t);
+    // We need room for the state we're in and the next one
+    if (HashTableSize + 2 * Result.StateSize > MemoryCap) {
+        return Result;
+    }
+
+    Result.Cache = ArenaInit();
+    if (!Result.Cache.Base) {
+        return Result;
+    }
+    if (!Alloc(&Result.Cache, MemoryCap)) {
+        ArenaFree(&Result.Cache);
+        return Result;
+    }
+    LazyDFAFlush(&Result); // Leaves only the hash table used
+    Result.NumFlushes = 0;
+    return Result;
+}
+
+void LazyDFAFree(lazy_dfa *DFA) {
+    ArenaFree(&DFA->Cache);
+    *DFA = {};
+}
+
+// Get the offset of the cached state for the NFA state set, adding it to the
+// cache if it isn't there. Adding a state can flush the cache.
+//
+// States must not point into the cache.
+uint32_t LazyDFAFindOrAdd(lazy_dfa *DFA, const uint32_t *States) {
+    const uint32_t Hash = StateSetHash(States, DFA->NumStateDwords);
+    const uint32_t SlotMask = DFA->NumHashSlots - 1;
+
+    uint32_t Slot = Hash & SlotMask;
+    for (;;) {
+        uint32_t Offset = LazyDFAHashTable(DFA)[Slot];
+        if (!Offset) {
+            break;
+        }
+        lazy_dfa_state *State = LazyDFAGetState(DFA, Offset);
+        if (State->Hash == Hash &&
+            StateSetEqual(State->States, States, DFA->NumStateDwords))
+        {
+            return Offset;
+        }
+        Slot = (Slot + 1) & SlotMask;
+    }
+
+    // Not cached, make a new state
+    if (DFA->Cache.Used + DFA->StateSize > DFA->MemoryCap) {
+        LazyDFAFlush(DFA);
+        Slot = Hash & SlotMask; // The table is empty now
+    }
+    // Already committed by LazyDFAInit, so it can't fail or move the arena
+    const uint32_t Offset = (uint32_t)DFA->Cache.Used;
+    lazy_dfa_state *State = (lazy_dfa_state *)Alloc(&DFA->Cache, DFA->StateSize);
+    for (size_t Byte = 0; Byte < ArrayLength(State->Next); ++Byte) {
+        State->Next[Byte] = 0;
+    }
+    State->Hash = Hash;
+    State->Accept = StateSetHas(States, NFA_ACCEPTSTATE);
+    State->Dead = StateSetIsEmpty(States, DFA->NumStateDwords);
+    for (size_t i = 0; i < DFA->NumStateDwords; ++i) {
+        State->States[i] = States[i];
+    }
+    LazyDFAHashTable(DFA)[Slot] = Offset;
+    DFA->NumCachedStates += 1;
+    return Offset;
+}
+
+uint32_t LazyDFAStartState(lazy_dfa *DFA) {
+    if (!DFA->StartState) {
+        const uint32_t *StartClosure =
+            &DFA->Closures[DFA->NFA->StartState * DFA->NumStateDwords];
+        DFA->StartState = LazyDFAFindOrAdd(DFA, StartClosure);
+    }
+    return DFA->StartState;
+}
+
+// Compute (and cache) the transition out of the state on Char
+uint32_t LazyDFANextState(lazy_dfa *DFA, uint32_t Offset, char Char) {
+    NFAStepStates(DFA->NFA, DFA->Closures, LazyDFAGetState(DFA, Offset)->States,
+                  Char, DFA->StepStates);
+    if (DFA->Unanchored) {
+        const uint32_t *StartClosure =
+            &DFA->Closures[DFA->NFA->StartState * DFA->NumStateDwords];
+        for (size_t i = 0; i < DFA->NumStateDwords; ++i) {
+            DFA->StepStates[i] |= StartClosure[i];
+        }
+    }
+
+    const size_t NumFlushes = DFA->NumFlushes;
+    uint32_t Next = LazyDFAFindOrAdd(DFA, DFA->StepStates);
+    // If the cache was flushed, the state we came from is gone
+    if (DFA->NumFlushes == NumFlushes) {
+        LazyDFAGetState(DFA, Offset)->Next[(uint8_t)Char] = Next;
+    }
+    return Next;
+}
+
+// Returns true if the entire null terminated string is in the language, or
+// any substring of it if the DFA is Unanchored
+bool LazyDFAMatch(lazy_dfa *DFA, const char *Str) {
+    uint32_t Curr = LazyDFAStartState(DFA);
+    for (; *Str; ++Str) {
+        lazy_dfa_state *State = LazyDFAGetState(DFA, Curr);
+        if (State->Dead) {
+            return false;
+        }
+        if (DFA->Unanchored && State->Accept) {
+            return true;
+        }
+        uint32_t Next = State->Next[(uint8_t)*Str];
+        if (!Next) {
+            Next = LazyDFANextState(DFA, Curr, *Str);
+        }
+        Curr = Next;
+    }
+    return LazyDFAGetState(DFA, Curr)->Accept;
+}
@@ -18,11 +18,15 @@ bool LexHasNext(lexer_state *State) {
 
 #define ESCAPE_CHAR '\\'
 
+inline bool IsDigit(char Char) {
+    return Char >= '0' && Char <= '9';
+}
+
 token LexNext(lexer_state *State) {
     token Result = {};
     Result.Str = State->Pos;
 
-    // TODO: add {m}, {m, n}, character classes
+    // TODO: add character classes
 
     switch (*State->Pos) {
         default:
@@ -47,6 +51,28 @@ token LexNext(lexer_state *State) {
             State->Pos = Str + 1;
             Assert(*Str == ']');
         } break;
+        case '{': {
+            // {m}, {m,}, or {m,n} repeats the last thing, see LexRepetition.
+            // Anything else is just a { char.
+            const char *Str = State->Pos + 1;
+            if (IsDigit(*Str)) {
+                while (IsDigit(*Str)) {
+                    ++Str;
+                }
+                if (*Str == ',') {
+                    ++Str;
+                    while (IsDigit(*Str)) {
+                        ++Str;
+                    }
+                }
+            }
+            if (Str != State->Pos + 1 && *Str == '}') {
+                Result.Length = (int32_t)(1 + Str - State->Pos);
+            } else {
+                Result.Length = 1;
+            }
+            State->Pos += Result.Length;
+        } break;
         case ESCAPE_CHAR: {
             Result.Length = 1;
             Result.Escaped = true;
@@ -65,6 +91,54 @@ token LexNext(lexer_state *State) {
     return Result;
 }
 
+// The biggest m or n allowed in {m,n}
+#define LEX_MAX_REPETITION 1000
+#define LEX_UNBOUNDED_REPETITION ((uint32_t) -1)
+
+// How many times a {m,n} token repeats the thing before it. Max is
+// LEX_UNBOUNDED_REPETITION for {m,}.
+struct repetition {
+    uint32_t Min;
+    uint32_t Max;
+};
+
+inline bool LexIsRepetition(token Token) {
+    return !Token.Escaped && *Token.Str == '{' && Token.Length > 1;
+}
+
+// Read a count. It stops growing past LEX_MAX_REPETITION, so a long number
+// can't overflow and is still too big for LexRepetitionIsValid.
+uint32_t LexNumber(const char **Str) {
+    uint32_t Result = 0;
+    while (IsDigit(**Str)) {
+        if (Result <= LEX_MAX_REPETITION) {
+            Result = Result * 10 + (uint32_t)(**Str - '0');
+        }
+        *Str += 1;
+    }
+    return Result;
+}
+
+// Read the counts from a token where LexIsRepetition is true. They aren't
+// checked, see LexRepetitionIsValid.
+repetition LexRepetition(token Token) {
+    repetition Result = {};
+    const char *Str = Token.Str + 1;
+    Result.Min = Result.Max = LexNumber(&Str);
+    if (*Str == ',') {
+        Str += 1;
+        Result.Max = (*Str == '}') ? LEX_UNBOUNDED_REPETITION : LexNumber(&Str);
+    }
+    return Result;
+}
+
+// The counts have to be at most LEX_MAX_REPETITION, and m <= n
+inline bool LexRepetitionIsValid(repetition Rep) {
+    bool Result = (Rep.Min <= LEX_MAX_REPETITION && Rep.Min <= Rep.Max);
+    Result &= (Rep.Max <= LEX_MAX_REPETITION || Rep.Max == LEX_UNBOUNDED_REPETITION);
+    return Result;
+}
+
 #include "nfa.h"
 
 bool LexHasNextCharSetLabel(lexer_state *State) {
@@ -0,0 +1,115 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Search engine for a regex that's a single literal, like foo
+//
+// There's nothing for an NFA to do, so this skips compiling entirely.
+// Anchored matching just compares the string. Unanchored matching uses
+// Boyer-Moore-Horspool: line the literal up with the string, compare it from
+// the end, and then shift it so the char of the string under its last char
+// lines up with the last place that char is earlier in the literal. A char
+// that isn't in the literal skips the whole length at once, so most chars of
+// the string are never read at all with a long literal.
+//
+// Include it after parser.cpp since it uses the lexer. RegexCountLiterals in
+// aho_corasick.cpp checks if a regex is a literal.
+
+#include "mem_arena.h"
+#include "utils.h"
+
+struct literal_search {
+    uint32_t Length;
+    const uint8_t *Bytes; // The literal without the escapes
+    // How far to shift the literal when the char under its last char has each
+    // byte value
+    uint32_t Shift[256];
+    // Match anywhere in the string, see LiteralSearchMatch
+    bool Unanchored;
+};
+
+/**
+ * Set up the search for a regex that RegexCountLiterals said is one literal.
+ *
+ * The literal is copied into Arena. If Unanchored, it matches if the literal
+ * is anywhere in the string.
+ *
+ * Length will be 0 if there was an error allocating.
+ */
+literal_search LiteralSearchInit(const char *Regex, mem_arena *Arena, bool Unanchored = false) {
+    literal_search Result = {};
+    Result.Unanchored = Unanchored;
+
+    size_t MaxLength = 0;
+    for (const char *Curr = Regex; *Curr; ++Curr) {
+        MaxLength += 1;
+    }
+    uint8_t *Bytes = (uint8_t *)Alloc(Arena, MaxLength);
+    if (!Bytes) {
+        return Result;
+    }
+    uint32_t Length = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        Assert(Token.Escaped || *Token.Str != '|');
+        Bytes[Length++] = (uint8_t)*Token.Str;
+    }
+    Result.Length = Length;
+    Result.Bytes = Bytes;
+
+    for (size_t Byte = 0; Byte < ArrayLength(Result.Shift); ++Byte) {
+        Result.Shift[Byte] = Length;
+    }
+    // Not the last char, or a match would shift by 0
+    for (uint32_t i = 0; i + 1 < Length; ++i) {
+        Result.Shift[Bytes[i]] = Length - 1 - i;
+    }
+    return Result;
+}
+
+// Returns true if the Len bytes at Ptr are the literal, or contain it if
+// Unanchored
+bool LiteralSearchMatchCounted(literal_search *LS, const uint8_t *Ptr, size_t Len) {
+    if (!LS->Unanchored) {
+        if (Len != LS->Length) {
+            return false;
+        }
+        for (uint32_t i = 0; i < LS->Length; ++i) {
+            if (Ptr[i] != LS->Bytes[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    const uint32_t Last = LS->Length - 1;
+    for (size_t Pos = 0; Pos + LS->Length <= Len; Pos += LS->Shift[Ptr[Pos + Last]]) {
+        uint32_t i = Last;
+        while (Ptr[Pos + i] == LS->Bytes[i]) {
+            if (i == 0) {
+                return true;
+            }
+            i -= 1;
+        }
+    }
+    return false;
+}
+
+// Returns true if the entire null terminated string is the literal, or it
+// contains the literal if Unanchored
+bool LiteralSearchMatch(literal_search *LS, const char *Str) {
+    if (!LS->Unanchored) { // Stops at the NUL since the literal has none
+        for (uint32_t i = 0; i < LS->Length; ++i) {
+            if ((uint8_t)Str[i] != LS->Bytes[i]) {
+                return false;
+            }
+        }
+        return Str[LS->Length] == '\0';
+    }
+    // The shifts need to know where the end is
+    size_t Len = 0;
+    while (Str[Len]) {
+        Len += 1;
+    }
+    return LiteralSearchMatchCounted(LS, (const uint8_t *)Str, Len);
+}
@@ -14,6 +14,11 @@
 
 #include "parser.cpp"
 #include "x86_codegen.cpp"
+#include "x86_dfa_codegen.cpp"
+#include "x86_lanes_codegen.cpp"
+#include "lazy_dfa.cpp"
+#include "aho_corasick.cpp"
+#include "literal_search.cpp"
 #include "printers.cpp"
 
 #include "utils.h"
@@ -30,19 +35,281 @@ bool RunCode(uint8_t *Code, size_t CodeWritten, char *WordPtr) {
     return (IsMatch != 0);
 }
 
-int CompileAndMatch(bool Verbose, char *Regex, char *Word) {
+int PrintMatchResult(bool Verbose, char *Word, bool IsMatch) {
+    if (Verbose) {
+        Print("\n-------------------- Result -------------------\n\n");
+        Print("Search Word: %s\n", Word);
+    }
+    if (IsMatch) {
+        Print("Match\n");
+        return 0;
+    }else{
+        Print("No Match\n");
+        return 1;
+    }
+}
+
+// Match with the lazy DFA engine instead of compiling code
+int LazyDFAMatchAndPrint(bool Verbose, nfa *NFA, mem_arena *Arena, char *Word,
+                         bool Unanchored) {
+    lazy_dfa DFA = LazyDFAInit(NFA, Arena, LAZY_DFA_DEFAULT_MEMORY_CAP, Unanchored);
+    if (!DFA.Cache.Base) {
+        Print("Error: Couldn't allocate the lazy DFA cache\n");
+        return 1;
+    }
+    bool IsMatch = LazyDFAMatch(&DFA, Word);
+
+    if (Verbose) {
+        Print("\n------------------- Lazy DFA ------------------\n\n");
+        PrintArena("Cache", &DFA.Cache);
+        Print("Cached States: %u\n", DFA.NumCachedStates);
+        Print("Cache Flushes: %u\n", DFA.NumFlushes);
+    }
+    LazyDFAFree(&DFA);
+    return PrintMatchResult(Verbose, Word, IsMatch);
+}
+
+// Match with the Aho-Corasick engine, for a regex that's only literals
+int AhoCorasickMatchAndPrint(bool Verbose, char *Regex, char *Word, bool Unanchored) {
+    mem_arena Arena = ArenaInit();
+    aho_corasick AC = AhoCorasickInit(Regex, &Arena, Unanchored);
+    if (AC.NumNodes == 0) {
+        return 1;
+    }
+    bool IsMatch = AhoCorasickMatch(&AC, Word);
+
+    if (Verbose) {
+        Print("\n----------------- Aho-Corasick ----------------\n\n");
+        PrintArena("Arena", &Arena);
+        Print("Literals: %u\n", RegexCountLiterals(Regex));
+        Print("Trie Nodes: %u\n", AC.NumNodes);
+    }
+    ArenaFree(&Arena);
+    return PrintMatchResult(Verbose, Word, IsMatch);
+}
+
+// Match with Boyer-Moore-Horspool, for a regex that's a single literal
+int LiteralSearchMatchAndPrint(bool Verbose, char *Regex, char *Word, bool Unanchored) {
+    mem_arena Arena = ArenaInit();
+    literal_search LS = LiteralSearchInit(Regex, &Arena, Unanchored);
+    if (LS.Length == 0) {
+        return 1;
+    }
+    bool IsMatch = LiteralSearchMatch(&LS, Word);
+
+    if (Verbose) {
+        Print("\n---------------- Literal Search ---------------\n\n");
+        Print("Literal Length: %u\n", LS.Length);
+    }
+    ArenaFree(&Arena);
+    return PrintMatchResult(Verbose, Word, IsMatch);
+}
+
+// Run every stage of the compiler without printing anything and load the code.
+// Uses the end of ArenaA and ArenaB as scratch space.
+void *CompileNFA(nfa *NFA, bool UseDFA, codegen_options Options,
+                 mem_arena *ArenaA, mem_arena *ArenaB) {
+    GeneratedInstructions Generated = {};
+    if (Options.Batch) {
+        Generated = GenerateLanesInstructions(NFA, ArenaB, Options);
+    }
+    if (UseDFA && Generated.Count == 0) {
+        Generated = GenerateDFAInstructions(NFA, ArenaB, Options);
+    }
+    if (Generated.Count == 0) {
+        Generated = GenerateInstructions(NFA, ArenaB, Options);
+    }
+    opcode_unpacked *UnpackedOpcodes = (opcode_unpacked*)Alloc(ArenaA,
+            sizeof(opcode_unpacked) * Generated.Count);
+    AssembleInstructions(Generated.Instructions, Generated.Count, UnpackedOpcodes);
+    uint8_t *Code = (uint8_t*)Alloc(ArenaB, MAX_OPCODE_LEN * Generated.Count);
+    size_t CodeWritten = PackCode(UnpackedOpcodes, Generated.Count, Code);
+    return LoadCode(Code, CodeWritten);
+}
+
+// Print where the leftmost longest match is, see FindMatchOffsets
+int FindOffsetsAndPrint(bool UseDFA, char *Regex, char *Word) {
+    mem_arena ArenaA = ArenaInit();
+    mem_arena ArenaB = ArenaInit();
+
+    codegen_options FindEndOptions = {};
+    FindEndOptions.ReturnOffset = true;
+    const char *Error = 0;
+    nfa *NFA = RegexToNFA(Regex, &ArenaA, &Error);
+    if (!NFA) {
+        Print("Error: %s\n", Error);
+        return 1;
+    }
+    dfreOffset FindEnd = (dfreOffset)CompileNFA(NFA, UseDFA, FindEndOptions, &ArenaA, &ArenaB);
+
+    codegen_options FindStartOptions = FindEndOptions;
+    FindStartOptions.Unanchored = true;
+    FindStartOptions.Reverse = true;
+    NFAReverse(NFA);
+    dfreOffset FindStart = (dfreOffset)CompileNFA(NFA, UseDFA, FindStartOptions, &ArenaA, &ArenaB);
+
+    match_offsets Match = {};
+    if (FindMatchOffsets(FindStart, FindEnd, Word, &Match)) {
+        Print("Match at %u to %u\n", Match.Start, Match.End);
+        return 0;
+    }
+    Print("No Match\n");
+    return 1;
+}
+
+// Match all of the regexes at once and print which ones matched
+int MatchSetAndPrint(codegen_options Options, char **Regexes, size_t NumRegexes,
+                     char *Word) {
+    mem_arena ArenaA = ArenaInit();
+    mem_arena ArenaB = ArenaInit();
+    // Not in ArenaA, since it can move while making the NFA
+    mem_arena MatchedArena = ArenaInit();
+
+    uint32_t *Matched = (uint32_t *)Alloc(&MatchedArena, DivCeil(NumRegexes, 32) * sizeof(uint32_t));
+    const char *Error = 0;
+    nfa *NFA = RegexSetToNFA((const char **)Regexes, NumRegexes, &ArenaA, &Error);
+    if (!NFA) {
+        Print("Error: %s\n", Error);
+        return 1;
+    }
+    Options.MatchSet = true;
+    dfreMatchSet MatchSet = (dfreMatchSet)CompileNFA(NFA, false, Options, &ArenaA, &ArenaB);
+
+    if (!MatchSet(Matched, Word)) {
+        Print("No Match\n");
+        return 1;
+    }
+    for (size_t RegexIdx = 0; RegexIdx < NumRegexes; ++RegexIdx) {
+        if (StateSetHas(Matched, RegexIdx)) {
+            Print("Match %s\n", Regexes[RegexIdx]);
+        }
+    }
+    return 0;
+}
+
+// Match a batch of strings in one call and print the ones that matched. Small
+// NFAs run 4 strings at a time in SIMD lanes, see GenerateLanesInstructions.
+int MatchBatchAndPrint(codegen_options Options, char *Regex, char **Words,
+                       size_t NumWords) {
+    mem_arena ArenaA = ArenaInit();
+    mem_arena ArenaB = ArenaInit();
+    mem_arena BatchArena = ArenaInit();
+
+    // Pack the strings one after another, see dfreMatchBatch. One allocation
+    // since the arena can move when it grows.
+    size_t DataLength = 0;
+    for (size_t WordIdx = 0; WordIdx < NumWords; ++WordIdx) {
+        for (char *Curr = Words[WordIdx]; *Curr; ++Curr) {
+            DataLength += 1;
+        }
+    }
+    const size_t NumResultDwords = DivCeil(NumWords, 32);
+    uint32_t *Offsets = (uint32_t *)Alloc(&BatchArena,
+        (NumWords + 1 + NumResultDwords) * sizeof(uint32_t) + DataLength);
+    uint32_t *Results = Offsets + NumWords + 1;
+    uint8_t *Data = (uint8_t *)(Results + NumResultDwords);
+    uint32_t Length = 0;
+    for (size_t WordIdx = 0; WordIdx < NumWords; ++WordIdx) {
+        Offsets[WordIdx] = Length;
+        for (char *Curr = Words[WordIdx]; *Curr; ++Curr) {
+            Data[Length++] = (uint8_t)*Curr;
+        }
+    }
+    Offsets[NumWords] = Length;
+
+    Options.Batch = true;
+    const char *Error = 0;
+    nfa *NFA = RegexToNFA(Regex, &ArenaA, &Error);
+    if (!NFA) {
+        Print("Error: %s\n", Error);
+        return 1;
+    }
+    dfreMatchBatch MatchBatch = (dfreMatchBatch)CompileNFA(NFA, false, Options, &ArenaA, &ArenaB);
+
+    if (!MatchBatch(Results, Offsets, Data, NumWords)) {
+        Print("No Match\n");
+        return 1;
+    }
+    for (size_t WordIdx = 0; WordIdx < NumWords; ++WordIdx) {
+        if (StateSetHas(Results, WordIdx)) {
+            Print("Match %s\n", Words[WordIdx]);
+        }
+    }
+    return 0;
+}
+
+// Split the string into tokens for the regexes and print them
+int TokenizeAndPrint(char **Regexes, size_t NumRegexes, char *Word) {
+    mem_arena ArenaA = ArenaInit();
+    mem_arena ArenaB = ArenaInit();
+
+    codegen_options Options = {};
+    Options.ReturnToken = true;
+    Options.Counted = true;
+    const char *Error = 0;
+    nfa *NFA = RegexSetToNFA((const char **)Regexes, NumRegexes, &ArenaA, &Error);
+    if (!NFA) {
+        Print("Error: %s\n", Error);
+        return 1;
+    }
+    dfreScan Scan = (dfreScan)CompileNFA(NFA, false, Options, &ArenaA, &ArenaB);
+
+    char *End;
+    for (End = Word; *End != '\0'; ++End) {}
+    const uint8_t *Ptr = (const uint8_t *)Word;
+    size_t Len = End - Word;
+    while (Len > 0) {
+        uint32_t Token = 0;
+        uint32_t TokenLen = Scan(&Token, Ptr, Len);
+        if (TokenLen == DFRE_NO_MATCH || TokenLen == 0) {
+            Print("No token at offset %u\n", (uint32_t)(Ptr - (const uint8_t *)Word));
+            return 1;
+        }
+        Print("%s: ", Regexes[Token]);
+        for (uint32_t i = 0; i < TokenLen; ++i) {
+            Print("%c", Ptr[i]);
+        }
+        Print("\n");
+        Ptr += TokenLen;
+        Len -= TokenLen;
+    }
+    return 0;
+}
+
+int CompileAndMatch(bool Verbose, bool UseLazyDFA, bool UseDFA, bool UseGlushkov,
+                    codegen_options Options, char *Regex, char *Word) {
     if (Verbose) {
         Print("-------------------- Regex --------------------\n\n");
         PrintRegex(Regex);
         Print("\n"); // Goes here because NFA is conditionally the first section
     }
 
+    // Skip the NFA entirely when it's just a list of literals, since the NFA
+    // and its code get huge with thousands of them, or when it's just one
+    // literal since there's nothing for the NFA to do. Only when matching, so
+    // the code can still be printed, and only for the default engine, since
+    // -l, -d and -g ask for a specific one.
+    const bool DefaultEngine = !UseLazyDFA && !UseDFA && !UseGlushkov;
+    const uint32_t NumLiterals = (Word && DefaultEngine) ? RegexCountLiterals(Regex) : 0;
+    if (NumLiterals == 1) {
+        return LiteralSearchMatchAndPrint(Verbose, Regex, Word, Options.Unanchored);
+    } else if (NumLiterals > 1) {
+        return AhoCorasickMatchAndPrint(Verbose, Regex, Word, Options.Unanchored);
+    }
+
     // Allocate storage for and then run each stage of the compiler in order
     mem_arena ArenaA = ArenaInit();
     mem_arena ArenaB = ArenaInit();
 
-    // Convert regex to NFA
-    nfa *NFA = RegexToNFA(Regex, &ArenaA);
+    // Convert regex to NFA. The lazy DFA can't run counters, so it gets the
+    // repetitions written out.
+    const char *Error = 0;
+    nfa *NFA = UseGlushkov ? RegexToGlushkovNFA(Regex, &ArenaA, &Error)
+                           : RegexToNFA(Regex, &ArenaA, &Error, UseLazyDFA);
+    if (!NFA) {
+        Print("Error: %s\n", Error);
+        return 1;
+    }
 
     if (!Word || Verbose) {
         Print("--------------------- NFA ---------------------\n\n");
@@ -52,11 +319,29 @@ int CompileAndMatch(bool Verbose, char *Regex, char *Word) {
         PrintNFA(NFA);
     }
 
+    if (UseLazyDFA) {
+        if (!Word) {
+            return 0;
+        }
+        return LazyDFAMatchAndPrint(Verbose, NFA, &ArenaB, Word, Options.Unanchored);
+    }
+
     // Note: this is all x86-specific after this point
     // TODO: ARM support
 
     // Convert the NFA into an intermediate code representation
-    GeneratedInstructions Generated = GenerateInstructions(NFA, &ArenaB);
+    GeneratedInstructions Generated = {};
+    if (UseDFA) {
+        Generated = GenerateDFAInstructions(NFA, &ArenaB, Options);
+        if (Generated.Count == 0 && Verbose && NFA->NumCounters > 0) {
+            Print("\nThe DFA can't count repetitions, using the NFA code\n");
+        } else if (Generated.Count == 0 && Verbose) {
+            Print("\nDFA has more than %u states, using the NFA code\n", DFA_MAX_JIT_STATES);
+        }
+    }
+    if (Generated.Count == 0) {
+        Generated = GenerateInstructions(NFA, &ArenaB, Options);
+    }
     size_t InstructionsGenerated = Generated.Count;
     instruction *Instructions = Generated.Instructions;
 
@@ -100,35 +385,77 @@ int CompileAndMatch(bool Verbose, char *Regex, char *Word) {
 
     if (Word) {
         bool IsMatch = RunCode(Code, CodeWritten, Word);
-
-        if (Verbose) {
-            Print("\n-------------------- Result -------------------\n\n");
-            Print("Search Word: %s\n", Word);
-        }
-        if (IsMatch) {
-            Print("Match\n");
-            return 0;
-        }else{
-            Print("No Match\n");
-            return 1;
-        }
+        return PrintMatchResult(Verbose, Word, IsMatch);
     }
     return 0;
 }
 
 extern "C"
 int main(int argc, char *argv[]) {
-    if (argc < 2) { // program name and the required regex
-        Print("Usage: %s (-v) [regex] (optional search string)\n", argv[0]);
-        return 1;
-    }
-
     // TODO: Real flag parser (this is pretty hacky)
+    char *ProgramName = argv[0];
     bool Verbose = false;
-    if (argv[1][0] == '-' && argv[1][1] == 'v' && argv[1][2] == '\0') {
-        Verbose = true;
+    bool UseLazyDFA = false;
+    bool UseDFA = false;
+    bool UseGlushkov = false;
+    codegen_options Options = {};
+    bool FindOffsets = false;
+    bool MatchSet = false;
+    bool Tokenize = false;
+    bool Batch = false;
+    while (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0' && argv[1][2] == '\0') {
+        if (argv[1][1] == 'v') {
+            Verbose = true;
+        } else if (argv[1][1] == 'l') {
+            UseLazyDFA = true;
+        } else if (argv[1][1] == 'd') {
+            UseDFA = true;
+        } else if (argv[1][1] == 'g') {
+            UseGlushkov = true;
+        } else if (argv[1][1] == 'u') {
+            Options.Unanchored = true;
+        } else if (argv[1][1] == 'o') {
+            FindOffsets = true;
+        } else if (argv[1][1] == 's') {
+            MatchSet = true;
+        } else if (argv[1][1] == 't') {
+            Tokenize = true;
+        } else if (argv[1][1] == 'b') {
+            Batch = true;
+        } else {
+            break;
+        }
         argv += 1;
-        argc += 1;
+        argc -= 1;
+    }
+
+    if (Tokenize && argc > 2) {
+        return TokenizeAndPrint(&argv[2], argc - 2, argv[1]);
+    }
+    if (MatchSet && argc > 2) {
+        return MatchSetAndPrint(Options, &argv[2], argc - 2, argv[1]);
+    }
+    if (Batch && argc > 2) {
+        return MatchBatchAndPrint(Options, argv[1], &argv[2], argc - 2);
+    }
+    if (argc < 2) { // program name and the required regex
+        Print("Usage: %s (-v) (-l) (-d) (-g) (-u) (-o) [regex] (optional search string)\n"
+              "       %s -s (-u) [search string] [regex]...\n"
+              "       %s -t [search string] [regex]...\n"
+              "       %s -b (-u) [regex] [search string]...\n"
+              "  -v  Verbose, print every stage of the compiler\n"
+              "  -l  Match with the lazy DFA engine instead of compiling code\n"
+              "  -d  Compile the determinized NFA (falls back for big DFAs)\n"
+              "  -g  Build the NFA with a state per char and no epsilon arcs (Glushkov)\n"
+              "  -u  Unanchored, match if any part of the search string matches\n"
+              "  -o  Print the offsets of the leftmost longest match (always unanchored)\n"
+              "  -s  Match a set of regexes in one pass and print the ones that matched\n"
+              "  -t  Split the search string into tokens, the longest match of any regex\n"
+              "      (the first one listed wins ties)\n"
+              "  -b  Match a batch of search strings in one call and print the ones\n"
+              "      that matched (4 at a time in SIMD lanes for small regexes)\n",
+              ProgramName, ProgramName, ProgramName, ProgramName);
+        return 1;
     }
 
     char *Word = 0;
@@ -136,5 +463,8 @@ int main(int argc, char *argv[]) {
         Word = argv[2];
     }
 
-    return CompileAndMatch(Verbose, argv[1], Word);
+    if (FindOffsets && Word) {
+        return FindOffsetsAndPrint(UseDFA, argv[1], Word);
+    }
+    return CompileAndMatch(Verbose, UseLazyDFA, UseDFA, UseGlushkov, Options, argv[1], Word);
 }
@@ -70,6 +70,32 @@ struct nfa_arc_list {
     nfa_transition Transitions[NFA_TRANSITIONS_PER_LIST_CHUNK];
 };
 
+// The most counters an NFA can have, see nfa_counter
+#define NFA_MAX_COUNTERS 32
+
+/**
+ * A state that counts the chars of a repetition X{m,n}, where X is a char,
+ * dot, or char set, instead of having a copy of X for each one.
+ *
+ * The counter state has arcs into it with the labels of X from one other
+ * state (the entry), the same arcs from itself (a loop), one epsilon arc out
+ * of it (the exit), and no other arcs. Like X+, any number of chars of X from
+ * the entry end up in the counter state, but it counts them and only follows
+ * the exit when the count is from Min to Max.
+ *
+ * There are only two kinds (see NFAAddCounters in parser.cpp):
+ *  - Min == Max, exactly that many chars
+ *  - Min == 1, from 1 up to Max chars
+ *
+ * A pass that doesn't know about counters sees X+, which matches every string
+ * the counter does and more, so what it finds about every match still holds.
+ */
+struct nfa_counter {
+    uint32_t State;
+    uint32_t Min;
+    uint32_t Max;
+};
+
 /**
  * A representation of an NFA (non-deterministic finite automata) state machine.
  * If unfamiliar, please search online for an image of the usual circles and
@@ -111,6 +137,14 @@ struct nfa_arc_list {
 struct nfa {
     size_t NumStates;
     size_t StartState;
+    // States 0 up to this are accept states. More than 1 only for an NFA made
+    // with RegexSetToNFA, where each one is for a different regex.
+    size_t NumAcceptStates;
+
+    // See nfa_counter. The code generators that can't run them return no
+    // instructions for an NFA with counters.
+    size_t NumCounters;
+    nfa_counter Counters[NFA_MAX_COUNTERS];
 
     size_t NumArcListsAllocated;
     size_t NumArcLists;
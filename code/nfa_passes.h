@@ -0,0 +1,1233 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Analysis and transformation passes that run on a finished NFA (after
+// RegexToNFA) and before any of the code generators.
+#ifndef NFA_PASSES_H_
+
+#include "nfa.h"
+#include "mem_arena.h"
+#include "utils.h"
+
+// Number of dwords needed for a bitset with one bit per NFA state
+inline uint32_t NFANumStateDwords(nfa *NFA) {
+    return DivCeil(NFA->NumStates, 32);
+}
+
+inline bool StateSetHas(const uint32_t *Set, uint32_t State) {
+    return (Set[State / 32] & (1 << (State % 32))) != 0;
+}
+
+inline void StateSetAdd(uint32_t *Set, uint32_t State) {
+    Set[State / 32] |= 1 << (State % 32);
+}
+
+// The index of the counter for the state in NFA->Counters, or NFA_NULLSTATE
+// if it isn't a counter state
+inline uint32_t NFACounterIdx(nfa *NFA, uint32_t State) {
+    for (uint32_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        if (NFA->Counters[CounterIdx].State == State) {
+            return CounterIdx;
+        }
+    }
+    return NFA_NULLSTATE;
+}
+
+// The one state with arcs into a counter state, other than itself
+uint32_t NFACounterEntry(nfa *NFA, uint32_t Counter) {
+    uint32_t Entry = NFA_NULLSTATE;
+    nfa_arc_list *ArcList = NFANextArcList(NFAFirstArcList(NFA)); // Skip epsilon
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0; TransitionIdx < ArcList->NumTransitions; ++TransitionIdx) {
+            nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+            if (Arc->To == Counter && Arc->From != Counter) {
+                Entry = Arc->From;
+            }
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    Assert(Entry != NFA_NULLSTATE);
+    return Entry;
+}
+
+// Check if the character would be consumed by an arc with this label
+//
+// Note: RANGE compares chars as signed, which is what the JIT code does with
+// its JL and JG jumps.
+inline bool LabelMatches(nfa_label Label, char Char) {
+    switch (Label.Type) {
+    case MATCH:
+        return Char == Label.A;
+    case DOT:
+        return true;
+    case RANGE:
+        return Char >= Label.A && Char <= Label.B;
+    case EPSILON:
+        return false;
+    }
+    return false;
+}
+
+/**
+ * Split the byte values into equivalence classes: two bytes are in the same
+ * class if every arc label in the NFA either consumes both or neither of them.
+ * So the code for a character only depends on its class.
+ *
+ * Writes the class of every byte value into ByteClass. Classes are numbered
+ * from 0 in order of the first byte in each class. Byte 0 (the end of the
+ * string) always gets class 0 by itself.
+ *
+ * Returns the number of classes.
+ */
+uint32_t NFAByteClasses(nfa *NFA, uint8_t *ByteClass) {
+    // Start with everything but 0 in class 1, then split every class by
+    // whether its bytes are consumed by each label
+    for (size_t Byte = 0; Byte < 256; ++Byte) {
+        ByteClass[Byte] = (Byte == 0) ? 0 : 1;
+    }
+    uint32_t NumClasses = 2;
+
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        if (ArcList->Label.Type == EPSILON || ArcList->Label.Type == DOT) {
+            ArcList = NFANextArcList(ArcList);
+            continue; // They don't split anything
+        }
+
+        // The class for the bytes in the label that were in each old class
+        uint16_t SplitClass[256];
+        for (size_t Class = 0; Class < NumClasses; ++Class) {
+            SplitClass[Class] = (uint16_t)-1;
+        }
+        uint16_t NewClass[256];
+        uint32_t NumSplitClasses = NumClasses;
+        for (size_t Byte = 1; Byte < 256; ++Byte) {
+            uint8_t Class = ByteClass[Byte];
+            if (!LabelMatches(ArcList->Label, (char)Byte)) {
+                NewClass[Byte] = Class;
+                continue;
+            }
+            if (SplitClass[Class] == (uint16_t)-1) {
+                SplitClass[Class] = (uint16_t)NumSplitClasses++;
+            }
+            NewClass[Byte] = SplitClass[Class];
+        }
+        NewClass[0] = 0;
+
+        // Renumber so the ids are dense again (a class can be entirely inside
+        // the label, which leaves its old id unused)
+        uint16_t Renumber[512];
+        for (size_t Class = 0; Class < NumSplitClasses; ++Class) {
+            Renumber[Class] = (uint16_t)-1;
+        }
+        NumClasses = 0;
+        for (size_t Byte = 0; Byte < 256; ++Byte) {
+            if (Renumber[NewClass[Byte]] == (uint16_t)-1) {
+                Renumber[NewClass[Byte]] = (uint16_t)NumClasses++;
+            }
+            ByteClass[Byte] = (uint8_t)Renumber[NewClass[Byte]];
+        }
+
+        ArcList = NFANextArcList(ArcList);
+    }
+
+    return NumClasses;
+}
+
+/**
+ * Compute the epsilon closure of every state in the NFA.
+ *
+ * The closure of a state is the set of states that are active whenever that
+ * state is active, by following any number of epsilon arcs. It always contains
+ * the state itself.
+ *
+ * The result is NumStates bitsets of NFANumStateDwords(NFA) dwords each. The
+ * closure of State starts at Result[State * NFANumStateDwords(NFA)].
+ *
+ * Since the closures are known at compile time the code generators can OR in
+ * the whole closure of a state when activating it, so there is never any need
+ * to follow epsilon arcs while matching.
+ *
+ * Returns NULL if there was an error allocating.
+ */
+uint32_t *NFAEpsilonClosures(nfa *NFA, mem_arena *Arena) {
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    const size_t NumDwords = NFA->NumStates * NumStateDwords;
+    uint32_t *Closures = (uint32_t *)Alloc(Arena, NumDwords * sizeof(uint32_t));
+    if (!Closures) {
+        return Closures;
+    }
+    // The arena may have been used before, so don't rely on it being zeroed
+    for (size_t i = 0; i < NumDwords; ++i) {
+        Closures[i] = 0;
+    }
+    for (uint32_t State = 0; State < NFA->NumStates; ++State) {
+        StateSetAdd(&Closures[State * NumStateDwords], State);
+    }
+
+    // Epsilon arcs, garunteed to be the first arc list
+    nfa_arc_list *EpsilonArcs = NFAFirstArcList(NFA);
+    Assert(EpsilonArcs->Label.Type == EPSILON);
+
+    // Merge the closure of the To state into the From state until nothing
+    // changes. Epsilon cycles (from * and + loops) just stop changing.
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (size_t TransitionIdx = 0;
+             TransitionIdx < EpsilonArcs->NumTransitions;
+             ++TransitionIdx)
+        {
+            nfa_transition *Arc = &EpsilonArcs->Transitions[TransitionIdx];
+            uint32_t *FromClosure = &Closures[Arc->From * NumStateDwords];
+            uint32_t *ToClosure = &Closures[Arc->To * NumStateDwords];
+            for (size_t i = 0; i < NumStateDwords; ++i) {
+                uint32_t Merged = FromClosure[i] | ToClosure[i];
+                if (Merged != FromClosure[i]) {
+                    FromClosure[i] = Merged;
+                    Changed = true;
+                }
+            }
+        }
+    }
+
+    return Closures;
+}
+
+/**
+ * Find the states that matter when they're active: the accept states and the
+ * states with arcs that consume a char. The others only have epsilon arcs out
+ * of them, and their closures are already folded into the closures of the
+ * states that lead to them, so nothing happens because they're active.
+ *
+ * Live is a bitset of NFANumStateDwords(NFA) dwords.
+ */
+void NFALiveStates(nfa *NFA, uint32_t *Live) {
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    for (uint32_t i = 0; i < NumStateDwords; ++i) {
+        Live[i] = 0;
+    }
+    for (uint32_t State = 0; State < NFA->NumAcceptStates; ++State) {
+        StateSetAdd(Live, State);
+    }
+    nfa_arc_list *ArcList = NFANextArcList(NFAFirstArcList(NFA)); // Skip epsilon
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0; TransitionIdx < ArcList->NumTransitions; ++TransitionIdx) {
+            StateSetAdd(Live, ArcList->Transitions[TransitionIdx].From);
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+}
+
+// The longest literal NFARequiredLiteral finds, so it fits in an xmm register
+#define NFA_MAX_LITERAL 16
+
+// A string that's part of every string the NFA matches, see NFARequiredLiteral
+struct nfa_literal {
+    uint32_t Length; // 0 if there isn't one
+    // Every match starts with it instead of just containing it
+    bool IsPrefix;
+    char Bytes[NFA_MAX_LITERAL];
+};
+
+inline bool StateSetHasAccept(nfa *NFA, const uint32_t *Set) {
+    for (uint32_t State = 0; State < NFA->NumAcceptStates; ++State) {
+        if (StateSetHas(Set, State)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Follow the chars out of the set of states for as long as there's only one
+// char that can come next, and write them to Bytes. Set ends up as the states
+// active after them.
+//
+// Stops at an accept state, at NUL, and after NFA_MAX_LITERAL chars. Step is
+// space for one more state set.
+uint32_t NFAForcedChars(nfa *NFA, const uint32_t *Closures, uint32_t *Set,
+                        uint32_t *Step, char *Bytes) {
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    uint32_t Length = 0;
+    while (Length < NFA_MAX_LITERAL && !StateSetHasAccept(NFA, Set)) {
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            Step[i] = 0;
+        }
+        bool Found = false;
+        char Char = 0;
+        nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+        for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (ArcList->Label.Type == EPSILON) {
+                ArcList = NFANextArcList(ArcList);
+                continue; // Already in the closures
+            }
+            for (size_t TransitionIdx = 0;
+                 TransitionIdx < ArcList->NumTransitions;
+                 ++TransitionIdx)
+            {
+                nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                if (!StateSetHas(Set, Arc->From)) {
+                    continue;
+                }
+                if (ArcList->Label.Type != MATCH || ArcList->Label.A == 0 ||
+                    (Found && ArcList->Label.A != Char))
+                {
+                    return Length; // More than one char can come next
+                }
+                Found = true;
+                Char = ArcList->Label.A;
+                const uint32_t *Closure = &Closures[Arc->To * NumStateDwords];
+                for (size_t i = 0; i < NumStateDwords; ++i) {
+                    Step[i] |= Closure[i];
+                }
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+        if (!Found) {
+            break; // Nothing can come next
+        }
+        Bytes[Length++] = Char;
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            Set[i] = Step[i];
+        }
+    }
+    return Length;
+}
+
+// Check if the label consumes any char that isn't in Literal
+inline bool LabelMatchesOtherThan(nfa_label Label, const char *Literal, uint32_t Length) {
+    uint32_t InLabel = 0;
+    for (uint32_t i = 0; i < Length; ++i) {
+        bool Repeated = false;
+        for (uint32_t j = 0; j < i; ++j) {
+            Repeated = Repeated || (Literal[j] == Literal[i]);
+        }
+        if (!Repeated && LabelMatches(Label, Literal[i])) {
+            InLabel += 1;
+        }
+    }
+    switch (Label.Type) {
+    case MATCH:
+        return InLabel == 0;
+    case DOT:
+        return true;
+    case RANGE:
+        return (int32_t)InLabel < (int32_t)Label.B - (int32_t)Label.A + 1;
+    case EPSILON:
+        return false;
+    }
+    return false;
+}
+
+/**
+ * Check if every string the NFA matches contains Literal.
+ *
+ * Runs the NFA on every input at once, keeping a separate state set for how
+ * much of Literal the input read so far ends with (the KMP automaton for
+ * Literal). An input that reads all of it contains it, so those are dropped.
+ * If an accept state is still reachable, some match doesn't contain Literal.
+ *
+ * Reach is space for Length state sets.
+ */
+bool NFAAlwaysContains(nfa *NFA, const uint32_t *Closures, const char *Literal,
+                       uint32_t Length, uint32_t *Reach) {
+    Assert(Length > 0 && Length <= NFA_MAX_LITERAL);
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+
+    // Fail[j] is the longest proper prefix of Literal that ends Literal[0..j]
+    uint32_t Fail[NFA_MAX_LITERAL];
+    Fail[0] = 0;
+    for (uint32_t j = 1, Matched = 0; j < Length; ++j) {
+        while (Matched > 0 && Literal[j] != Literal[Matched]) {
+            Matched = Fail[Matched - 1];
+        }
+        if (Literal[j] == Literal[Matched]) {
+            Matched += 1;
+        }
+        Fail[j] = Matched;
+    }
+
+    // Reach[Matched] is the states that can be active when the input ends with
+    // Literal[0..Matched)
+    for (size_t i = 0; i < Length * NumStateDwords; ++i) {
+        Reach[i] = 0;
+    }
+    const uint32_t *StartClosure = &Closures[NFA->StartState * NumStateDwords];
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        Reach[i] = StartClosure[i];
+    }
+    bool Dirty[NFA_MAX_LITERAL] = {};
+    Dirty[0] = true;
+
+    bool Changed = true;
+    while (Changed) {
+        Changed = false;
+        for (uint32_t Matched = 0; Matched < Length; ++Matched) {
+            if (!Dirty[Matched]) {
+                continue;
+            }
+            Dirty[Matched] = false;
+            const uint32_t *From = &Reach[Matched * NumStateDwords];
+            if (StateSetHasAccept(NFA, From)) {
+                return false;
+            }
+
+            nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+            for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+                if (ArcList->Label.Type == EPSILON) {
+                    ArcList = NFANextArcList(ArcList);
+                    continue; // Already in the closures
+                }
+
+                // How much of Literal the input ends with after each char the
+                // label consumes. Any char not in Literal goes back to 0.
+                uint32_t Next[NFA_MAX_LITERAL + 1];
+                uint32_t NumNext = 0;
+                if (LabelMatchesOtherThan(ArcList->Label, Literal, Length)) {
+                    Next[NumNext++] = 0;
+                }
+                for (uint32_t i = 0; i < Length; ++i) {
+                    if (!LabelMatches(ArcList->Label, Literal[i])) {
+                        continue;
+                    }
+                    uint32_t After = Matched;
+                    while (After > 0 && Literal[After] != Literal[i]) {
+                        After = Fail[After - 1];
+                    }
+                    if (Literal[After] == Literal[i]) {
+                        After += 1;
+                    }
+                    bool Seen = (After == Length); // Contains Literal, drop it
+                    for (uint32_t n = 0; n < NumNext; ++n) {
+                        Seen = Seen || (Next[n] == After);
+                    }
+                    if (!Seen) {
+                        Next[NumNext++] = After;
+                    }
+                }
+
+                for (size_t TransitionIdx = 0;
+                     TransitionIdx < ArcList->NumTransitions;
+                     ++TransitionIdx)
+                {
+                    nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                    if (!StateSetHas(From, Arc->From)) {
+                        continue;
+                    }
+                    const uint32_t *Closure = &Closures[Arc->To * NumStateDwords];
+                    for (uint32_t n = 0; n < NumNext; ++n) {
+                        uint32_t *To = &Reach[Next[n] * NumStateDwords];
+                        for (size_t i = 0; i < NumStateDwords; ++i) {
+                            if ((To[i] | Closure[i]) != To[i]) {
+                                To[i] |= Closure[i];
+                                Dirty[Next[n]] = true;
+                                Changed = true;
+                            }
+                        }
+                    }
+                }
+                ArcList = NFANextArcList(ArcList);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Find a literal string that every match of the NFA contains, like the
+ * timeout in error: .*timeout, so the code generators can search for it
+ * before running the NFA at all.
+ *
+ * The candidates are the chars forced to come next after each state. The one
+ * from the start state is a prefix of every match. For the rest we check with
+ * NFAAlwaysContains and use the longest that's always there.
+ *
+ * Returns a Length of 0 if there isn't one, including when the empty string
+ * matches. Everything is allocated in Arena, which should be scratch space.
+ */
+nfa_literal NFARequiredLiteral(nfa *NFA, mem_arena *Arena) {
+    nfa_literal Result = {};
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    const uint32_t *Closures = NFAEpsilonClosures(NFA, Arena);
+    if (!Closures) {
+        return Result;
+    }
+    const size_t ClosuresOffset = (uint8_t *)Closures - Arena->Base;
+    uint32_t *Set = (uint32_t *)Alloc(Arena, (NFA_MAX_LITERAL + 2) * NumStateDwords * sizeof(uint32_t));
+    if (!Set) {
+        return Result;
+    }
+    Closures = (uint32_t *)(Arena->Base + ClosuresOffset);
+    uint32_t *Step = Set + NumStateDwords;
+    uint32_t *Reach = Step + NumStateDwords;
+
+    const uint32_t *StartClosure = &Closures[NFA->StartState * NumStateDwords];
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        Set[i] = StartClosure[i];
+    }
+    Result.Length = NFAForcedChars(NFA, Closures, Set, Step, Result.Bytes);
+    Result.IsPrefix = (Result.Length != 0);
+
+    for (uint32_t State = 0; State < NFA->NumStates; ++State) {
+        const uint32_t *Closure = &Closures[State * NumStateDwords];
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            Set[i] = Closure[i];
+        }
+        char Bytes[NFA_MAX_LITERAL];
+        uint32_t Length = NFAForcedChars(NFA, Closures, Set, Step, Bytes);
+        if (Length <= Result.Length ||
+            !NFAAlwaysContains(NFA, Closures, Bytes, Length, Reach))
+        {
+            continue;
+        }
+        Result.Length = Length;
+        Result.IsPrefix = false;
+        for (uint32_t i = 0; i < Length; ++i) {
+            Result.Bytes[i] = Bytes[i];
+        }
+    }
+    return Result;
+}
+
+// The longest prefixes NFAPrefixes finds
+#define NFA_MAX_PREFIX 3
+// The most prefixes NFAPrefixes finds. With more than this a search for any
+// of them would stop almost everywhere.
+#define NFA_MAX_PREFIXES 64
+
+// Strings that every match of the NFA starts with one of, see NFAPrefixes
+struct nfa_prefixes {
+    uint32_t Length; // Of every prefix, 0 if there aren't any
+    uint32_t Count;
+    char Bytes[NFA_MAX_PREFIXES][NFA_MAX_PREFIX];
+};
+
+/**
+ * Find a set of strings of the same length that every match of the NFA starts
+ * with one of, like foo, bar, and baz for foo|bar|bazooka, so the code
+ * generators can search for all of them at once before running the NFA.
+ *
+ * Extends every prefix by each char that can come next, keeping the states
+ * active after it, one char at a time up to NFA_MAX_PREFIX. It stops before a
+ * prefix could already be a whole match, or if there would be more than
+ * NFA_MAX_PREFIXES. The prefixes come out sorted by their unsigned bytes.
+ *
+ * Returns a Length of 0 if there aren't any, including when the empty string
+ * matches. Everything is allocated in Arena, which should be scratch space.
+ */
+nfa_prefixes NFAPrefixes(nfa *NFA, mem_arena *Arena) {
+    nfa_prefixes Result = {};
+    const uint32_t NumStateDwords = NFANumStateDwords(NFA);
+    const uint32_t *Closures = NFAEpsilonClosures(NFA, Arena);
+    if (!Closures) {
+        return Result;
+    }
+    const size_t ClosuresOffset = (uint8_t *)Closures - Arena->Base;
+    // The states active after each prefix, then after each one char longer
+    uint32_t *Sets = (uint32_t *)Alloc(Arena, 2 * NFA_MAX_PREFIXES * NumStateDwords * sizeof(uint32_t));
+    if (!Sets) {
+        return Result;
+    }
+    Closures = (uint32_t *)(Arena->Base + ClosuresOffset);
+    uint32_t *NextSets = Sets + NFA_MAX_PREFIXES * NumStateDwords;
+
+    const uint32_t *StartClosure = &Closures[NFA->StartState * NumStateDwords];
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        Sets[i] = StartClosure[i];
+    }
+    Result.Count = 1; // Just the empty string
+    while (Result.Length < NFA_MAX_PREFIX) {
+        char NextBytes[NFA_MAX_PREFIXES][NFA_MAX_PREFIX];
+        uint32_t NextCount = 0;
+        for (uint32_t Prefix = 0; Prefix < Result.Count; ++Prefix) {
+            const uint32_t *Set = &Sets[Prefix * NumStateDwords];
+            if (StateSetHasAccept(NFA, Set)) {
+                return Result;
+            }
+            for (uint32_t Byte = 0; Byte < 256; ++Byte) {
+                uint32_t *To = &NextSets[NextCount * NumStateDwords];
+                bool Found = false;
+                nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+                for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+                    if (!LabelMatches(ArcList->Label, (char)Byte)) {
+                        ArcList = NFANextArcList(ArcList);
+                        continue; // Also skips the epsilon arcs
+                    }
+                    for (size_t TransitionIdx = 0;
+                         TransitionIdx < ArcList->NumTransitions;
+                         ++TransitionIdx)
+                    {
+                        nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                        if (!StateSetHas(Set, Arc->From)) {
+                            continue;
+                        }
+                        if (!Found) {
+                            if (NextCount == NFA_MAX_PREFIXES) {
+                                return Result; // Too many
+                            }
+                            Found = true;
+                            for (size_t i = 0; i < NumStateDwords; ++i) {
+                                To[i] = 0;
+                            }
+                        }
+                        const uint32_t *Closure = &Closures[Arc->To * NumStateDwords];
+                        for (size_t i = 0; i < NumStateDwords; ++i) {
+                            To[i] |= Closure[i];
+                        }
+                    }
+                    ArcList = NFANextArcList(ArcList);
+                }
+                if (!Found) {
+                    continue; // Byte can't come next
+                }
+                for (uint32_t i = 0; i < Result.Length; ++i) {
+                    NextBytes[NextCount][i] = Result.Bytes[Prefix][i];
+                }
+                NextBytes[NextCount][Result.Length] = (char)Byte;
+                NextCount += 1;
+            }
+        }
+
+        // Every prefix was extended, use the longer ones
+        Result.Length += 1;
+        Result.Count = NextCount;
+        for (uint32_t Prefix = 0; Prefix < NextCount; ++Prefix) {
+            for (uint32_t i = 0; i < Result.Length; ++i) {
+                Result.Bytes[Prefix][i] = NextBytes[Prefix][i];
+            }
+        }
+        uint32_t *Swap = Sets;
+        Sets = NextSets;
+        NextSets = Swap;
+    }
+    return Result;
+}
+
+/**
+ * Turn the NFA around (in place) so it matches the reverse of every string it
+ * used to match. Running it from the end of a string back to the start finds
+ * where the matches of the original NFA begin.
+ *
+ * Every arc is flipped and the start and accept states trade places. Since
+ * the accept state is always NFA_ACCEPTSTATE, the state numbers of the old
+ * start state and the old accept state are swapped. The entry and exit of each
+ * counter state trade places too, so it's still a counter (see nfa_counter).
+ */
+void NFAReverse(nfa *NFA) {
+    const uint32_t OldStart = (uint32_t)NFA->StartState;
+    Assert(OldStart != NFA_ACCEPTSTATE);
+    Assert(NFA->NumAcceptStates == 1); // Not for RegexSetToNFA
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0;
+             TransitionIdx < ArcList->NumTransitions;
+             ++TransitionIdx)
+        {
+            nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+            uint32_t From = Arc->To;
+            uint32_t To = Arc->From;
+            if (From == NFA_ACCEPTSTATE) {
+                From = OldStart;
+            } else if (From == OldStart) {
+                From = NFA_ACCEPTSTATE;
+            }
+            if (To == NFA_ACCEPTSTATE) {
+                To = OldStart;
+            } else if (To == OldStart) {
+                To = NFA_ACCEPTSTATE;
+            }
+            Arc->From = From;
+            Arc->To = To;
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    // The old accept state is now numbered OldStart
+
+    // Flipped, a counter's entry arcs go out of it and its exit comes in, so
+    // make them go from the old exit into it and exit to the old entry
+    for (size_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        const uint32_t Counter = NFA->Counters[CounterIdx].State;
+        uint32_t OldEntry = NFA_NULLSTATE;
+        nfa_transition *Exit = 0;
+        ArcList = NFAFirstArcList(NFA);
+        for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            for (size_t TransitionIdx = 0;
+                 TransitionIdx < ArcList->NumTransitions;
+                 ++TransitionIdx)
+            {
+                nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                if (ArcListIdx == 0 && Arc->To == Counter) {
+                    Exit = Arc;
+                } else if (ArcListIdx != 0 && Arc->From == Counter && Arc->To != Counter) {
+                    Assert(OldEntry == NFA_NULLSTATE || OldEntry == Arc->To);
+                    OldEntry = Arc->To;
+                }
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+        Assert(Exit && OldEntry != NFA_NULLSTATE);
+        ArcList = NFANextArcList(NFAFirstArcList(NFA));
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            for (size_t TransitionIdx = 0;
+                 TransitionIdx < ArcList->NumTransitions;
+                 ++TransitionIdx)
+            {
+                nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+                if (Arc->From == Counter && Arc->To == OldEntry) {
+                    Arc->From = Exit->From;
+                    Arc->To = Counter;
+                }
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+        Exit->From = Counter;
+        Exit->To = OldEntry;
+    }
+    NFA->StartState = OldStart;
+}
+
+// An arc for NFAMinimize, which works on a flat array of them instead of the
+// arc lists. List is the index of the arc list with the arc's label.
+struct nfa_min_arc {
+    uint32_t List;
+    uint32_t From;
+    uint32_t To;
+};
+
+// Order arcs by one end (To if ByTo, otherwise From), then the label, then
+// the other end
+inline bool NFAMinArcLess(nfa_min_arc A, nfa_min_arc B, bool ByTo) {
+    const uint32_t AEnd = ByTo ? A.To : A.From;
+    const uint32_t BEnd = ByTo ? B.To : B.From;
+    if (AEnd != BEnd) {
+        return AEnd < BEnd;
+    }
+    if (A.List != B.List) {
+        return A.List < B.List;
+    }
+    return ByTo ? (A.From < B.From) : (A.To < B.To);
+}
+
+// Merge sort the arcs, using Temp which has room for NumArcs more
+void NFAMinSortArcs(nfa_min_arc *Arcs, uint32_t NumArcs, nfa_min_arc *Temp, bool ByTo) {
+    nfa_min_arc *Src = Arcs;
+    nfa_min_arc *Dest = Temp;
+    for (uint32_t Width = 1; Width < NumArcs; Width *= 2) {
+        for (uint32_t Lo = 0; Lo < NumArcs; Lo += 2 * Width) {
+            const uint32_t Mid = (Lo + Width < NumArcs) ? Lo + Width : NumArcs;
+            const uint32_t Hi = (Mid + Width < NumArcs) ? Mid + Width : NumArcs;
+            uint32_t A = Lo, B = Mid, Out = Lo;
+            while (A < Mid && B < Hi) {
+                Dest[Out++] = NFAMinArcLess(Src[B], Src[A], ByTo) ? Src[B++] : Src[A++];
+            }
+            while (A < Mid) {
+                Dest[Out++] = Src[A++];
+            }
+            while (B < Hi) {
+                Dest[Out++] = Src[B++];
+            }
+        }
+        nfa_min_arc *Swap = Src;
+        Src = Dest;
+        Dest = Swap;
+    }
+    if (Src != Arcs) {
+        for (uint32_t i = 0; i < NumArcs; ++i) {
+            Arcs[i] = Src[i];
+        }
+    }
+}
+
+// For arcs sorted by one end, the arcs with State at that end are
+// Arcs[First[State]] up to Arcs[First[State + 1]]
+void NFAMinIndexArcs(const nfa_min_arc *Arcs, uint32_t NumArcs, uint32_t NumStates,
+                     uint32_t *First, bool ByTo) {
+    uint32_t ArcIdx = 0;
+    for (uint32_t State = 0; State <= NumStates; ++State) {
+        First[State] = ArcIdx;
+        while (ArcIdx < NumArcs && (ByTo ? Arcs[ArcIdx].To : Arcs[ArcIdx].From) == State) {
+            ArcIdx += 1;
+        }
+    }
+}
+
+// Check if states A and B have the same arcs (out of them, or into them if
+// ByTo), indexed with NFAMinIndexArcs
+inline bool NFAMinSameArcs(const nfa_min_arc *Arcs, const uint32_t *First,
+                           uint32_t A, uint32_t B, bool ByTo) {
+    if (First[A + 1] - First[A] != First[B + 1] - First[B]) {
+        return false;
+    }
+    for (uint32_t i = 0; i < First[A + 1] - First[A]; ++i) {
+        const nfa_min_arc ArcA = Arcs[First[A] + i];
+        const nfa_min_arc ArcB = Arcs[First[B] + i];
+        if (ArcA.List != ArcB.List ||
+            (ByTo ? (ArcA.From != ArcB.From) : (ArcA.To != ArcB.To)))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+inline uint32_t NFAMinHashArcs(const nfa_min_arc *Arcs, const uint32_t *First,
+                               uint32_t State, bool ByTo) {
+    uint32_t Hash = 2166136261; // FNV-1a
+    for (uint32_t ArcIdx = First[State]; ArcIdx < First[State + 1]; ++ArcIdx) {
+        Hash = (Hash ^ Arcs[ArcIdx].List) * 16777619;
+        Hash = (Hash ^ (ByTo ? Arcs[ArcIdx].From : Arcs[ArcIdx].To)) * 16777619;
+    }
+    return Hash;
+}
+
+// Find the state State was merged into
+inline uint32_t NFAMinFind(uint32_t *Rep, uint32_t State) {
+    uint32_t Root = State;
+    while (Rep[Root] != Root) {
+        Root = Rep[Root];
+    }
+    while (Rep[State] != Root) {
+        const uint32_t Next = Rep[State];
+        Rep[State] = Root;
+        State = Next;
+    }
+    return Root;
+}
+
+// Merge each state with out arcs (or in arcs if ByTo) into the first state
+// with exactly the same ones. Skips the accept states, the states in Pinned,
+// and the start state if ByTo. Table has TableSize entries, a power of 2 more
+// than NumStates.
+bool NFAMinMergeSameArcs(const nfa_min_arc *Arcs, const uint32_t *First,
+                         uint32_t NumStates, uint32_t NumAcceptStates, uint32_t StartState,
+                         const uint32_t *Pinned, uint32_t *Rep, uint32_t *Table,
+                         uint32_t TableSize, bool ByTo) {
+    bool Changed = false;
+    for (uint32_t i = 0; i < TableSize; ++i) {
+        Table[i] = NFA_NULLSTATE;
+    }
+    for (uint32_t State = NumAcceptStates; State < NumStates; ++State) {
+        if (First[State] == First[State + 1] || (ByTo && State == StartState) ||
+            StateSetHas(Pinned, State))
+        {
+            continue;
+        }
+        uint32_t Slot = NFAMinHashArcs(Arcs, First, State, ByTo) & (TableSize - 1);
+        for (; Table[Slot] != NFA_NULLSTATE; Slot = (Slot + 1) & (TableSize - 1)) {
+            if (NFAMinSameArcs(Arcs, First, Table[Slot], State, ByTo)) {
+                break;
+            }
+        }
+        if (Table[Slot] == NFA_NULLSTATE) {
+            Table[Slot] = State;
+        } else {
+            Rep[State] = Table[Slot];
+            Changed = true;
+        }
+    }
+    return Changed;
+}
+
+/**
+ * Make the NFA smaller (in place) without changing what it matches. Every
+ * state is a bit the code generators have to keep track of, and the parser
+ * makes lots of states that don't need to be there, like the ones for parens.
+ *
+ * These steps are repeated until none of them changes anything:
+ *
+ *  1. Remove the states that can't be reached from the start state and the
+ *     states that can't reach an accept state, along with their arcs.
+ *  2. A state with only one arc out of it, an epsilon arc, does nothing but
+ *     activate the state it goes to, so the arcs into it go there instead.
+ *     Not if it goes to an accept state, so a state that consumes the last
+ *     char of a match stays separate from the accept state, the way
+ *     ShiftAndFinalStates in x86_codegen.cpp needs it.
+ *  3. A state with only one arc into it, an epsilon arc, is active exactly
+ *     when the state the arc is from is, so it's merged into that state.
+ *  4. States with the same arcs out of them lead to the same matches, so
+ *     they're merged.
+ *  5. States with the same arcs into them are always active at the same
+ *     time, so they're merged.
+ *
+ * The accept states are never merged or removed and they keep their numbers,
+ * so it works for an NFA from RegexSetToNFA. The other states keep their order and are numbered
+ * after the accept states, and arc lists left empty are removed (except for
+ * epsilon). Counter states (see nfa_counter) aren't merged with anything,
+ * since their arcs mean more than they seem to.
+ *
+ * Uses Scratch, and leaves it how it was.
+ */
+void NFAMinimize(nfa *NFA, mem_arena *Scratch) {
+    const uint32_t NumStates = (uint32_t)NFA->NumStates;
+    const uint32_t NumAcceptStates = (uint32_t)NFA->NumAcceptStates;
+    const uint32_t NumArcLists = (uint32_t)NFA->NumArcLists;
+    const size_t ScratchUsed = Scratch->Used;
+    uint32_t NumArcs = 0;
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (uint32_t ListIdx = 0; ListIdx < NumArcLists; ++ListIdx) {
+        NumArcs += (uint32_t)ArcList->NumTransitions;
+        ArcList = NFANextArcList(ArcList);
+    }
+    uint32_t TableSize = 1;
+    while (TableSize < 2 * NumStates) {
+        TableSize *= 2;
+    }
+    // One allocation, since the arena can move when it grows
+    const uint32_t NumStateDwords = DivCeil(NumStates, 32);
+    const size_t NumDwords = 5 * NumStates + 2 + NumArcLists + 1 + TableSize +
+        NumStateDwords;
+    uint32_t *Rep = (uint32_t *)Alloc(Scratch, NumDwords * sizeof(uint32_t) +
+        3 * NumArcs * sizeof(nfa_min_arc) + NumArcLists * sizeof(nfa_label));
+    if (!Rep) {
+        return;
+    }
+    // The arcs sorted by From, a copy sorted by To, and space to sort them
+    nfa_min_arc *Arcs = (nfa_min_arc *)(Rep + NumDwords);
+    nfa_min_arc *ArcsByTo = Arcs + NumArcs;
+    nfa_min_arc *Temp = ArcsByTo + NumArcs;
+    nfa_label *Labels = (nfa_label *)(Temp + NumArcs);
+    uint32_t *FirstOut = Rep + NumStates;
+    uint32_t *FirstIn = FirstOut + NumStates + 1;
+    uint32_t *Reached = FirstIn + NumStates + 1; // Bit 1 from the start, 2 to accept
+    uint32_t *Stack = Reached + NumStates;
+    uint32_t *ListFirst = Stack + NumStates;
+    uint32_t *Table = ListFirst + NumArcLists + 1;
+    uint32_t *Pinned = Table + TableSize;
+    for (uint32_t i = 0; i < NumStateDwords; ++i) {
+        Pinned[i] = 0;
+    }
+    for (size_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        StateSetAdd(Pinned, NFA->Counters[CounterIdx].State);
+    }
+
+    NumArcs = 0;
+    ArcList = NFAFirstArcList(NFA);
+    for (uint32_t ListIdx = 0; ListIdx < NumArcLists; ++ListIdx) {
+        Labels[ListIdx] = ArcList->Label;
+        for (size_t TransitionIdx = 0; TransitionIdx < ArcList->NumTransitions; ++TransitionIdx) {
+            nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+            Arcs[NumArcs++] = {ListIdx, Arc->From, Arc->To};
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    uint32_t StartState = (uint32_t)NFA->StartState;
+
+    // Go around the steps until all 5 in a row didn't change anything
+    uint32_t Step = 0;
+    for (uint32_t NumUnchanged = 0; NumUnchanged < 5; Step = (Step + 1) % 5) {
+        // Merging states makes duplicate arcs and epsilon arcs that go
+        // nowhere, so drop them and index the rest both ways
+        NFAMinSortArcs(Arcs, NumArcs, Temp, false);
+        uint32_t NumKept = 0;
+        for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+            const nfa_min_arc Arc = Arcs[ArcIdx];
+            if (Arc.List == 0 && Arc.From == Arc.To) {
+                continue;
+            }
+            if (NumKept > 0 && Arc.List == Arcs[NumKept - 1].List &&
+                Arc.From == Arcs[NumKept - 1].From && Arc.To == Arcs[NumKept - 1].To)
+            {
+                continue;
+            }
+            Arcs[NumKept++] = Arc;
+        }
+        NumArcs = NumKept;
+        for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+            ArcsByTo[ArcIdx] = Arcs[ArcIdx];
+        }
+        NFAMinSortArcs(ArcsByTo, NumArcs, Temp, true);
+        NFAMinIndexArcs(Arcs, NumArcs, NumStates, FirstOut, false);
+        NFAMinIndexArcs(ArcsByTo, NumArcs, NumStates, FirstIn, true);
+        for (uint32_t State = 0; State < NumStates; ++State) {
+            Rep[State] = State;
+        }
+
+        bool Changed = false;
+        switch (Step) {
+        case 0: { // Unreachable and dead states
+            for (uint32_t State = 0; State < NumStates; ++State) {
+                Reached[State] = 0;
+            }
+            uint32_t StackSize = 0;
+            Reached[StartState] = 1;
+            Stack[StackSize++] = StartState;
+            while (StackSize > 0) {
+                const uint32_t State = Stack[--StackSize];
+                for (uint32_t ArcIdx = FirstOut[State]; ArcIdx < FirstOut[State + 1]; ++ArcIdx) {
+                    const uint32_t To = Arcs[ArcIdx].To;
+                    if (!(Reached[To] & 1)) {
+                        Reached[To] |= 1;
+                        Stack[StackSize++] = To;
+                    }
+                }
+            }
+            for (uint32_t State = 0; State < NumAcceptStates; ++State) {
+                Reached[State] |= 2;
+                Stack[StackSize++] = State;
+            }
+            while (StackSize > 0) {
+                const uint32_t State = Stack[--StackSize];
+                for (uint32_t ArcIdx = FirstIn[State]; ArcIdx < FirstIn[State + 1]; ++ArcIdx) {
+                    const uint32_t From = ArcsByTo[ArcIdx].From;
+                    if (!(Reached[From] & 2)) {
+                        Reached[From] |= 2;
+                        Stack[StackSize++] = From;
+                    }
+                }
+            }
+            NumKept = 0;
+            for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+                if (Reached[Arcs[ArcIdx].From] == 3 && Reached[Arcs[ArcIdx].To] == 3) {
+                    Arcs[NumKept++] = Arcs[ArcIdx];
+                }
+            }
+            Changed = (NumKept != NumArcs);
+            NumArcs = NumKept;
+        } break;
+        case 1: // Only an epsilon arc out
+            for (uint32_t State = NumAcceptStates; State < NumStates; ++State) {
+                if (FirstOut[State + 1] - FirstOut[State] != 1 || Arcs[FirstOut[State]].List != 0) {
+                    continue;
+                }
+                const uint32_t Into = NFAMinFind(Rep, Arcs[FirstOut[State]].To);
+                if (Into != State && Into >= NumAcceptStates &&
+                    !StateSetHas(Pinned, State) && !StateSetHas(Pinned, Into))
+                {
+                    Rep[State] = Into;
+                    Changed = true;
+                }
+            }
+            break;
+        case 2: // Only an epsilon arc in
+            for (uint32_t State = NumAcceptStates; State < NumStates; ++State) {
+                if (State == StartState || FirstIn[State + 1] - FirstIn[State] != 1 ||
+                    ArcsByTo[FirstIn[State]].List != 0)
+                {
+                    continue;
+                }
+                const uint32_t Into = NFAMinFind(Rep, ArcsByTo[FirstIn[State]].From);
+                if (Into != State && !StateSetHas(Pinned, State) &&
+                    !StateSetHas(Pinned, Into))
+                {
+                    Rep[State] = Into;
+                    Changed = true;
+                }
+            }
+            break;
+        case 3: // Same arcs out
+            Changed = NFAMinMergeSameArcs(Arcs, FirstOut, NumStates, NumAcceptStates,
+                                          StartState, Pinned, Rep, Table, TableSize, false);
+            break;
+        case 4: // Same arcs in
+            Changed = NFAMinMergeSameArcs(ArcsByTo, FirstIn, NumStates, NumAcceptStates,
+                                          StartState, Pinned, Rep, Table, TableSize, true);
+            break;
+        }
+        if (Changed && Step != 0) {
+            for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+                Arcs[ArcIdx].From = NFAMinFind(Rep, Arcs[ArcIdx].From);
+                Arcs[ArcIdx].To = NFAMinFind(Rep, Arcs[ArcIdx].To);
+            }
+            StartState = NFAMinFind(Rep, StartState);
+        }
+        NumUnchanged = Changed ? 0 : NumUnchanged + 1;
+    }
+
+    // Number the states that are left in order, after the accept states
+    uint32_t *NewNumber = Stack;
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        Reached[State] = (State < NumAcceptStates || State == StartState);
+    }
+    for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+        Reached[Arcs[ArcIdx].From] = Reached[Arcs[ArcIdx].To] = 1;
+    }
+    uint32_t NextNumber = 0;
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        NewNumber[State] = Reached[State] ? NextNumber++ : NFA_NULLSTATE;
+    }
+
+    // Put the arcs back in the lists. No list got longer, so they fit in the
+    // space the lists already took up.
+    for (uint32_t ListIdx = 0; ListIdx <= NumArcLists; ++ListIdx) {
+        ListFirst[ListIdx] = 0;
+    }
+    for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+        ListFirst[Arcs[ArcIdx].List + 1] += 1;
+    }
+    for (uint32_t ListIdx = 0; ListIdx < NumArcLists; ++ListIdx) {
+        ListFirst[ListIdx + 1] += ListFirst[ListIdx];
+    }
+    for (uint32_t ArcIdx = 0; ArcIdx < NumArcs; ++ArcIdx) {
+        Temp[ListFirst[Arcs[ArcIdx].List]++] = Arcs[ArcIdx];
+    }
+    // ListFirst[ListIdx] is now where the next list starts
+    ArcList = NFAFirstArcList(NFA);
+    uint32_t NewNumArcLists = 0;
+    uint32_t ArcIdx = 0;
+    for (uint32_t ListIdx = 0; ListIdx < NumArcLists; ++ListIdx) {
+        const uint32_t ListEnd = ListFirst[ListIdx];
+        if (ArcIdx == ListEnd && ListIdx != 0) {
+            continue;
+        }
+        ArcList->Label = Labels[ListIdx];
+        ArcList->NumTransitions = 0;
+        for (; ArcIdx < ListEnd; ++ArcIdx) {
+            nfa_transition *Arc = &ArcList->Transitions[ArcList->NumTransitions++];
+            Arc->From = NewNumber[Temp[ArcIdx].From];
+            Arc->To = NewNumber[Temp[ArcIdx].To];
+        }
+        ArcList = NFANextArcList(ArcList);
+        NewNumArcLists += 1;
+    }
+    NFA->NumArcLists = NewNumArcLists;
+    NFA->NumStates = NextNumber;
+    NFA->StartState = NewNumber[StartState];
+
+    // Drop the counters that were removed
+    size_t NumCounters = 0;
+    for (size_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        nfa_counter Counter = NFA->Counters[CounterIdx];
+        Counter.State = NewNumber[Counter.State];
+        if (Counter.State != NFA_NULLSTATE) {
+            NFA->Counters[NumCounters++] = Counter;
+        }
+    }
+    NFA->NumCounters = NumCounters;
+    Scratch->Used = ScratchUsed;
+}
+
+/**
+ * Renumber the states (in place) so that as many arcs as possible that
+ * consume a char go from a state to the next one, To == From + 1.
+ *
+ * The parser numbers states in the order it makes them, so the states of a
+ * paren group or a loop end up far from the ones around them. Code generators
+ * can apply arcs like that to every state at once with a shift of the state
+ * bitset (see ShiftAndFinalStates in x86_codegen.cpp), and the states the
+ * same chars move between end up next to each other in the bitsets.
+ *
+ * The arcs are picked greedily in order of their From state, joining states
+ * into chains that are then numbered one after another. The accept states
+ * keep their numbers, so it works for an NFA from RegexSetToNFA. The arcs of
+ * counter states aren't shifted (see GenInstructionsCounter), so they're
+ * skipped.
+ *
+ * Uses Scratch, and leaves it how it was.
+ */
+void NFARenumberStates(nfa *NFA, mem_arena *Scratch) {
+    const uint32_t NumStates = (uint32_t)NFA->NumStates;
+    const uint32_t NumAcceptStates = (uint32_t)NFA->NumAcceptStates;
+    const size_t ScratchUsed = Scratch->Used;
+    nfa_arc_list *StartList = NFANextArcList(NFAFirstArcList(NFA)); // Skip epsilon
+    size_t NumTransitions = 0;
+    nfa_arc_list *ArcList = StartList;
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        NumTransitions += ArcList->NumTransitions;
+        ArcList = NFANextArcList(ArcList);
+    }
+    // Next and Prev in the chains, NFA_NULLSTATE at the ends. The states at
+    // both ends of a chain have the state at the other end in OtherEnd.
+    // The To states of the arcs from State are ArcTo[FirstArc[State]] up to
+    // ArcTo[FirstArc[State + 1]], in the order of the arc lists.
+    uint32_t *Next = (uint32_t *)Alloc(Scratch,
+        (5 * NumStates + 1 + NumTransitions) * sizeof(uint32_t));
+    if (!Next) {
+        return;
+    }
+    uint32_t *Prev = Next + NumStates;
+    uint32_t *OtherEnd = Prev + NumStates;
+    uint32_t *NewNumber = OtherEnd + NumStates;
+    uint32_t *FirstArc = NewNumber + NumStates;
+    uint32_t *ArcTo = FirstArc + NumStates + 1;
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        Next[State] = Prev[State] = NFA_NULLSTATE;
+        OtherEnd[State] = State;
+    }
+
+    // Count the arcs from each state, then add up the counts to get where
+    // each state's arcs start
+    for (uint32_t State = 0; State <= NumStates; ++State) {
+        FirstArc[State] = 0;
+    }
+    ArcList = StartList;
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0; TransitionIdx < ArcList->NumTransitions; ++TransitionIdx) {
+            FirstArc[ArcList->Transitions[TransitionIdx].From + 1] += 1;
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        FirstArc[State + 1] += FirstArc[State];
+    }
+    uint32_t *Fill = NewNumber; // Not numbered yet, so use it for the counts
+    for (uint32_t State = 0; State < NumStates; ++State) {
+        Fill[State] = FirstArc[State];
+    }
+    ArcList = StartList;
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0; TransitionIdx < ArcList->NumTransitions; ++TransitionIdx) {
+            nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+            ArcTo[Fill[Arc->From]++] = Arc->To;
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+
+    // Go through the states in order, linking each to the To state of the
+    // first of its arcs that still can be
+    for (uint32_t From = NumAcceptStates; From < NumStates; ++From) {
+        for (uint32_t ArcIdx = FirstArc[From]; ArcIdx < FirstArc[From + 1]; ++ArcIdx) {
+            const uint32_t To = ArcTo[ArcIdx];
+            // To has to start a chain that doesn't end at From, or it would
+            // be a cycle
+            if (To < NumAcceptStates || Prev[To] != NFA_NULLSTATE || OtherEnd[From] == To ||
+                NFACounterIdx(NFA, From) != NFA_NULLSTATE ||
+                NFACounterIdx(NFA, To) != NFA_NULLSTATE)
+            {
+                continue;
+            }
+            const uint32_t Head = OtherEnd[From];
+            const uint32_t Tail = OtherEnd[To];
+            Next[From] = To;
+            Prev[To] = From;
+            OtherEnd[Head] = Tail;
+            OtherEnd[Tail] = Head;
+            break;
+        }
+    }
+
+    // Number the chains in the order of their first state
+    for (uint32_t State = 0; State < NumAcceptStates; ++State) {
+        NewNumber[State] = State;
+    }
+    uint32_t NextNumber = NumAcceptStates;
+    for (uint32_t Head = NumAcceptStates; Head < NumStates; ++Head) {
+        if (Prev[Head] != NFA_NULLSTATE) {
+            continue;
+        }
+        for (uint32_t State = Head; State != NFA_NULLSTATE; State = Next[State]) {
+            NewNumber[State] = NextNumber++;
+        }
+    }
+    Assert(NextNumber == NumStates);
+
+    ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        for (size_t TransitionIdx = 0;
+             TransitionIdx < ArcList->NumTransitions;
+             ++TransitionIdx)
+        {
+            nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
+            Arc->From = NewNumber[Arc->From];
+            Arc->To = NewNumber[Arc->To];
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    NFA->StartState = NewNumber[NFA->StartState];
+    for (size_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        NFA->Counters[CounterIdx].State = NewNumber[NFA->Counters[CounterIdx].State];
+    }
+    Scratch->Used = ScratchUsed;
+}
+
+#define NFA_PASSES_H_
+#endif
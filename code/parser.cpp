@@ -4,6 +4,7 @@
 // TODO: Do we actually need a separate lexer?
 #include "lexer.cpp"
 #include "nfa.h"
+#include "nfa_passes.h"
 #include "mem_arena.h"
 
 void NFAAllocArcList(nfa *NFA, mem_arena *Arena, nfa_label Label) {
@@ -56,46 +57,46 @@ void NFAAddArc(nfa *NFA, mem_arena *Arena, nfa_label Label, nfa_transition Trans
  * it would just waste time.
  */
 void NFACombineArcLists(nfa *NFA) {
-    size_t NumListsRemoved = 0;
-    nfa_arc_list *CurrList = NFAFirstArcList(NFA);
-    // Skip the last one because it won't have any children
-    for (size_t Idx = 0; Idx < NFA->NumArcLists - 1; ++Idx) {
-        if (CurrList->NumTransitions < NFA_TRANSITIONS_PER_LIST_CHUNK) {
-            CurrList += 1;
-            continue;
-        }
-
-        size_t ChildrenFound = 0;
-        nfa_arc_list *Child = CurrList + 1;
-        nfa_arc_list *Swap = CurrList + 1;
-        for (size_t CIdx = Idx; CIdx < NFA->NumArcLists; ++CIdx) {
-            if (Child->Label != CurrList->Label) {
-                Child += 1;
+    // First move the chunks with the same label next to eachother, keeping
+    // them in the order they were allocated. Only the last chunk for a label
+    // can have less than NFA_TRANSITIONS_PER_LIST_CHUNK transitions, so after
+    // this each group is some full chunks followed by one that might not be.
+    nfa_arc_list *ArcLists = NFAFirstArcList(NFA);
+    for (size_t Idx = 0; Idx < NFA->NumArcLists; ++Idx) {
+        size_t GroupEnd = Idx + 1;
+        for (size_t SearchIdx = GroupEnd; SearchIdx < NFA->NumArcLists; ++SearchIdx) {
+            if (ArcLists[SearchIdx].Label != ArcLists[Idx].Label) {
                 continue;
             }
+            // Shift the lists in between over to make room
+            nfa_arc_list Moving = ArcLists[SearchIdx];
+            for (size_t ShiftIdx = SearchIdx; ShiftIdx > GroupEnd; --ShiftIdx) {
+                ArcLists[ShiftIdx] = ArcLists[ShiftIdx - 1];
+            }
+            ArcLists[GroupEnd++] = Moving;
+        }
+        Idx = GroupEnd - 1;
+    }
 
-            // Move list after CurrList to Child pos and copy over transitions
-            // from child
+    // Then copy the transitions from each chunk in the group over the headers
+    // of the following chunks. The transitions we write always end before the
+    // header of the next chunk, so we only need to save a copy of the chunk
+    // we're currently reading from.
+    size_t NumListsRemoved = 0;
+    nfa_arc_list *CurrList = ArcLists;
+    nfa_arc_list *End = ArcLists + NFA->NumArcLists;
+    while (CurrList < End) {
+        nfa_arc_list *Child = CurrList + 1;
+        for (; Child < End && Child->Label == CurrList->Label; ++Child) {
             nfa_arc_list ChildCopy = *Child;
-            if (Child != Swap) {
-                *Child = *Swap;
-            }
-            Swap += 1;
             nfa_transition *Dest = &CurrList->Transitions[CurrList->NumTransitions];
             for (size_t TIdx = 0; TIdx < ChildCopy.NumTransitions; ++TIdx) {
                 *Dest++ = ChildCopy.Transitions[TIdx];
             }
             CurrList->NumTransitions += ChildCopy.NumTransitions;
-            ChildrenFound += 1;
-
-            if (ChildCopy.NumTransitions < NFA_TRANSITIONS_PER_LIST_CHUNK) {
-                break;
-            }
-
-            Child += 1;
+            NumListsRemoved += 1;
         }
-        NumListsRemoved += ChildrenFound;
-        CurrList += 1 + ChildrenFound;
+        CurrList = Child;
     }
 
     NFA->NumArcLists -= NumListsRemoved;
@@ -116,36 +117,384 @@ size_t CountParenChunks(const char *Regex) {
     return Chunks;
 }
 
+#define NO_ATOM ((size_t) -1)
+
+// Add a char to Out, unless it's NULL and we're only counting
+inline void WriteChar(char *Out, size_t *Length, char Char) {
+    if (Out) {
+        Out[*Length] = Char;
+    }
+    *Length += 1;
+}
+
+/**
+ * Replace the thing at the end of Out (from AtomStart up to Length) with
+ * copies of it for the repetition. x{2,4} becomes (xx(x(x)?)?), x{2,} becomes
+ * (xx+), and x{0} becomes ().
+ *
+ * Returns the new length. Out can be NULL to only count.
+ */
+size_t WriteRepetition(repetition Rep, char *Out, size_t AtomStart, size_t Length) {
+    const size_t AtomLength = Length - AtomStart;
+    const bool Unbounded = (Rep.Max == LEX_UNBOUNDED_REPETITION);
+    Length = AtomStart;
+    if (Rep.Max == 0) {
+        WriteChar(Out, &Length, '(');
+        WriteChar(Out, &Length, ')');
+        return Length;
+    }
+
+    // Move the first copy over to make room for the parens before it, then
+    // copy it for the rest
+    const size_t NumParens = (Rep.Min == 0 && !Unbounded) ? 2 : 1;
+    if (Out) {
+        for (size_t i = AtomLength; i > 0; --i) {
+            Out[AtomStart + NumParens + i - 1] = Out[AtomStart + i - 1];
+        }
+    }
+    for (size_t i = 0; i < NumParens; ++i) {
+        WriteChar(Out, &Length, '(');
+    }
+    const char *Atom = Out ? Out + Length : 0;
+    Length += AtomLength;
+    uint32_t NumCopies = 1;
+    for (; NumCopies < Rep.Min; ++NumCopies) {
+        for (size_t i = 0; i < AtomLength; ++i) {
+            WriteChar(Out, &Length, Atom ? Atom[i] : '\0');
+        }
+    }
+    if (Unbounded) {
+        WriteChar(Out, &Length, (Rep.Min == 0) ? '*' : '+');
+    } else {
+        // The optional copies are nested, so each one can only match if the
+        // one before it did
+        const uint32_t NumOptional = Rep.Max - Rep.Min;
+        for (uint32_t Copy = (Rep.Min == 0) ? 1 : 0; Copy < NumOptional; ++Copy) {
+            WriteChar(Out, &Length, '(');
+            for (size_t i = 0; i < AtomLength; ++i) {
+                WriteChar(Out, &Length, Atom ? Atom[i] : '\0');
+            }
+        }
+        for (uint32_t Copy = 0; Copy < NumOptional; ++Copy) {
+            WriteChar(Out, &Length, ')');
+            WriteChar(Out, &Length, '?');
+        }
+    }
+    WriteChar(Out, &Length, ')');
+    return Length;
+}
+
+// How many chars writing out the {m,n} repetitions can add to a regex, which
+// bounds the states and arcs they make (see NFAMaxArcs)
+#define REGEX_MAX_ADDED_LENGTH 8192
+// A char, dot, or char set repeated more times than this gets counter states
+// (see NFAAddCounters) instead of being written out
+#define REGEX_MAX_WRITTEN_REPETITION 32
+
+// If the repetition of a char, dot, or char set is left for NFAAddCounters
+inline bool RegexIsCountedRepetition(repetition Rep) {
+    return Rep.Min > REGEX_MAX_WRITTEN_REPETITION ||
+        (Rep.Max != LEX_UNBOUNDED_REPETITION && Rep.Max > REGEX_MAX_WRITTEN_REPETITION);
+}
+
+// How many counters NFAAddCounters makes for the repetition
+inline uint32_t NFANumCountersFor(repetition Rep) {
+    const bool Unbounded = (Rep.Max == LEX_UNBOUNDED_REPETITION);
+    return (Rep.Min >= 3 && Rep.Min != Rep.Max && !Unbounded) ? 2 : 1;
+}
+
+// How many counters the regex needs, after RegexExpandRepetitions
+uint32_t RegexNumCounters(const char *Regex) {
+    uint32_t NumCounters = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        if (LexIsRepetition(Token)) {
+            NumCounters += NFANumCountersFor(LexRepetition(Token));
+        }
+    }
+    return NumCounters;
+}
+
+// Copy the regex into Out with every {m,n} written out by WriteRepetition,
+// except the ones on a char, dot, or char set that RegexIsCountedRepetition
+// unless WriteAll. Returns the length. Out can be NULL to only count, and
+// OpenParens needs room for every ( in the regex.
+//
+// Sets Error and stops if a {m,n} can't be written out, which can only happen
+// when counting.
+size_t WriteRepetitions(const char *Regex, char *Out, size_t *OpenParens,
+                        bool WriteAll, const char **Error) {
+    // Where the last thing that can be repeated starts in Out
+    size_t AtomStart = NO_ATOM;
+    bool AtomIsGroup = false;
+    size_t NumOpenParens = 0;
+    size_t Length = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        const char *TokenStart = Lexer.Pos;
+        token Token = LexNext(&Lexer);
+        if (LexIsRepetition(Token)) {
+            repetition Rep = LexRepetition(Token);
+            if (AtomStart == NO_ATOM) {
+                *Error = "{m,n} has nothing before it to repeat";
+                return Length;
+            }
+            if (!LexRepetitionIsValid(Rep)) {
+                *Error = "{m,n} needs m <= n, and both can be at most 1000";
+                return Length;
+            }
+            if (!WriteAll && !AtomIsGroup && RegexIsCountedRepetition(Rep)) {
+                // Keep it in parens like WriteRepetition does, so a *+? after
+                // it has a group to repeat
+                if (Out) {
+                    for (size_t i = Length; i > AtomStart; --i) {
+                        Out[i] = Out[i - 1];
+                    }
+                    Out[AtomStart] = '(';
+                }
+                Length += 1;
+                for (const char *Curr = TokenStart; Curr < Lexer.Pos; ++Curr) {
+                    WriteChar(Out, &Length, *Curr);
+                }
+                WriteChar(Out, &Length, ')');
+                AtomStart = NO_ATOM;
+                continue;
+            }
+            Length = WriteRepetition(Rep, Out, AtomStart, Length);
+            if (Length > (size_t)(Lexer.Pos - Regex) + REGEX_MAX_ADDED_LENGTH) {
+                *Error = "The regex is too big with its {m,n} repetitions written out";
+                return Length;
+            }
+            AtomStart = NO_ATOM; // Like after *, it can't be repeated again
+            continue;
+        }
+        const size_t TokenStartOut = Length;
+        for (const char *Curr = TokenStart; Curr < Lexer.Pos; ++Curr) {
+            WriteChar(Out, &Length, *Curr);
+        }
+        switch (Token.Escaped ? '\0' : *Token.Str) {
+        case '(': {
+            OpenParens[NumOpenParens++] = TokenStartOut;
+            AtomStart = NO_ATOM;
+        } break;
+        case ')': {
+            // TODO: Report an error
+            Assert(NumOpenParens > 0);
+            AtomStart = OpenParens[--NumOpenParens];
+            AtomIsGroup = true;
+        } break;
+        case '*':
+        case '+':
+        case '?':
+        case '|': {
+            AtomStart = NO_ATOM;
+        } break;
+        default: {
+            AtomStart = TokenStartOut;
+            AtomIsGroup = false;
+        } break;
+        }
+    }
+    return Length;
+}
+
+/**
+ * Write out the {m,n} repetitions in the regex as copies of what they repeat
+ * (see WriteRepetition), so the parsers only have to handle *+? and the
+ * counted repetitions of one char, dot, or char set. With WriteAll there are
+ * no counted ones left, for the NFAs that can't have counters.
+ *
+ * The copies are the same chars moving from each state to the next one. After
+ * NFAMinimize and NFARenumberStates they're runs of states numbered one after
+ * another, which the code generator steps with a shift of the state bitsets
+ * (see GenInstructionsShiftArcs in x86_codegen.cpp), so 32 of them cost about
+ * the same as one. Longer ones are left for NFAAddCounters.
+ *
+ * Returns Regex itself if it has no repetitions, otherwise a copy in Arena.
+ * Returns NULL and sets Error if a {m,n} is invalid, they would add more than
+ * REGEX_MAX_ADDED_LENGTH chars, or there are more than NFA_MAX_COUNTERS.
+ */
+const char *RegexExpandRepetitions(const char *Regex, mem_arena *Arena,
+                                   bool WriteAll, const char **Error) {
+    size_t NumParens = 0;
+    bool HasRepetition = false;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        NumParens += (!Token.Escaped && *Token.Str == '(');
+        HasRepetition |= LexIsRepetition(Token);
+    }
+    if (!HasRepetition) {
+        return Regex;
+    }
+    mem_arena Scratch = ArenaInit();
+    size_t *OpenParens = (size_t *)Alloc(&Scratch, NumParens * sizeof(size_t));
+    *Error = 0;
+    const size_t Length = WriteRepetitions(Regex, 0, OpenParens, WriteAll, Error);
+    if (*Error) {
+        ArenaFree(&Scratch);
+        return 0;
+    }
+    char *Result = (char *)Alloc(Arena, Length + 1);
+    WriteRepetitions(Regex, Result, OpenParens, WriteAll, Error);
+    Result[Length] = '\0';
+    ArenaFree(&Scratch);
+    if (RegexNumCounters(Result) > NFA_MAX_COUNTERS) {
+        *Error = "The regex has more than 32 counted {m,n} repetitions";
+        return 0;
+    }
+    return Result;
+}
+
+// The most arcs NFAAddRegex can add for a regex with its repetitions written
+// out. Every token adds at most 3, or a char set one for each of its labels,
+// and there's one more into the accept state. A counted repetition copies the
+// arcs of the token before it at most 4 times, and adds 3 epsilon arcs.
+size_t NFAMaxArcs(const char *Regex) {
+    size_t MaxArcs = 1;
+    int32_t LastLength = 0;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        MaxArcs += 3 * (size_t)Token.Length;
+        if (LexIsRepetition(Token)) {
+            MaxArcs += 4 * (size_t)LastLength + 3;
+        }
+        LastLength = Token.Length;
+    }
+    return MaxArcs;
+}
+
 struct chunk_bounds {
     uint32_t StartState;
     uint32_t EndState;
 };
 
-nfa *RegexToNFA(const char *Regex, mem_arena *Arena) {
-    // Allocate space to store the parentheses bounds
-    const size_t NumParenChunks = CountParenChunks(Regex);
-    chunk_bounds *ParenChunks = (chunk_bounds*)Alloc(Arena,
-        NumParenChunks * sizeof(chunk_bounds));
+// Add an arc for Copy with each label Atom has. Only the arc lists that were
+// there at the start are searched, since the arcs it adds are all copies.
+void NFACopyArcs(nfa *NFA, mem_arena *Arena, nfa_transition Atom, nfa_transition Copy) {
+    const size_t NumArcLists = NFA->NumArcLists;
+    for (size_t ArcListIdx = 1; ArcListIdx < NumArcLists; ++ArcListIdx) {
+        nfa_arc_list *ArcList = &NFA->_ArcLists[ArcListIdx];
+        for (size_t TIdx = 0; TIdx < ArcList->NumTransitions; ++TIdx) {
+            nfa_transition Transition = ArcList->Transitions[TIdx];
+            if (Transition.From == Atom.From && Transition.To == Atom.To) {
+                NFAAddArc(NFA, Arena, ArcList->Label, Copy);
+            }
+        }
+    }
+}
+
+// Make State a counter (see nfa_counter) for the labels of AtomArc, which has
+// to already have its arcs in. Returns the new state it exits to.
+uint32_t NFAAddCounter(nfa *NFA, mem_arena *Arena, nfa_transition AtomArc,
+                       uint32_t State, uint32_t MinCount, uint32_t MaxCount) {
+    Assert(NFA->NumCounters < NFA_MAX_COUNTERS);
+    nfa_counter *Counter = &NFA->Counters[NFA->NumCounters++];
+    Counter->State = State;
+    Counter->Min = MinCount;
+    Counter->Max = MaxCount;
+    NFACopyArcs(NFA, Arena, AtomArc, nfa_transition{State, State});
 
-    // Used in several places in this function
     nfa_label EpsilonLabel = {};
     EpsilonLabel.Type = EPSILON;
+    uint32_t Exit = NFA->NumStates++;
+    NFAAddArc(NFA, Arena, EpsilonLabel, nfa_transition{State, Exit});
+    return Exit;
+}
 
-    // Allocate space for the NFA result and set it up
-    nfa *NFA = (nfa *)Alloc(Arena, sizeof(nfa));
-    NFA->NumStates = 2; // Reserve 0 for accept, 1 for start
+/**
+ * Repeat the char, dot, or char set that goes from Atom.StartState to
+ * Atom.EndState with counters (see nfa_counter) instead of copies of it.
+ * RegexExpandRepetitions only leaves the ones with m or n more than
+ * REGEX_MAX_WRITTEN_REPETITION for this.
+ *
+ * Counters only count exactly k chars, X{k}, or 1 to n, X{1,n}. So X{m,n} is
+ * X{m-1} then X{1,n-m+1}, X{m,} is X{m-1} then X+, and X{0,n} is X{1,n} or
+ * nothing. Returns the bounds of it all, which can't be repeated again, so
+ * RegexExpandRepetitions keeps it in parens.
+ */
+chunk_bounds NFAAddCounters(nfa *NFA, mem_arena *Arena, chunk_bounds Atom,
+                            repetition Rep) {
+    // TODO: Report an error
+    Assert(Atom.StartState != NFA_NULLSTATE);
+    const nfa_transition AtomArc{Atom.StartState, Atom.EndState};
+
+    // Atom.EndState already has the first X, so it can be the first counter
+    uint32_t End = Atom.EndState;
+    if (Rep.Min == Rep.Max) {
+        End = NFAAddCounter(NFA, Arena, AtomArc, End, Rep.Min, Rep.Max);
+        return chunk_bounds{NFA_NULLSTATE, End};
+    }
+    if (Rep.Min >= 3) {
+        End = NFAAddCounter(NFA, Arena, AtomArc, End, Rep.Min - 1, Rep.Min - 1);
+    }
+    if (Rep.Min >= 2) {
+        uint32_t Next = NFA->NumStates++;
+        NFACopyArcs(NFA, Arena, AtomArc, nfa_transition{End, Next});
+        End = Next;
+    }
+    if (Rep.Max == LEX_UNBOUNDED_REPETITION) {
+        NFACopyArcs(NFA, Arena, AtomArc, nfa_transition{End, End});
+        return chunk_bounds{NFA_NULLSTATE, End};
+    }
+    End = NFAAddCounter(NFA, Arena, AtomArc, End, 1, Rep.Max - Max(Rep.Min, 1) + 1);
+    if (Rep.Min == 0) {
+        nfa_label EpsilonLabel = {};
+        EpsilonLabel.Type = EPSILON;
+        NFAAddArc(NFA, Arena, EpsilonLabel, nfa_transition{Atom.StartState, End});
+    }
+    return chunk_bounds{NFA_NULLSTATE, End};
+}
+
+// Allocate an NFA with just the epsilon arc list. Nothing else can be
+// allocated in the arena after it, since the arc lists grow at the end.
+//
+// Commits room for MaxArcLists more arc list chunks up front, so adding them
+// never moves the arena out from under the NFA pointer.
+nfa *NFAInit(mem_arena *Arena, size_t NumAcceptStates, size_t MaxArcLists) {
+    nfa_label EpsilonLabel = {};
+    EpsilonLabel.Type = EPSILON;
+
+    const size_t ArcListsSize = MaxArcLists * sizeof(nfa_arc_list);
+    nfa *NFA = (nfa *)Alloc(Arena, sizeof(nfa) + ArcListsSize);
+    Arena->Used -= ArcListsSize;
+    NFA->NumAcceptStates = NumAcceptStates;
+    NFA->NumCounters = 0;
     NFA->NumArcLists = NFA->NumArcListsAllocated = 1; // Reserve 0 for epsilon
-    NFA->StartState = NFA_DEFAULT_STARTSTATE;
     // Initialize the first arc list, which is always epsilon arcs
     // See x86_codegen.cpp. Epsilon arcs are a special case.
     NFA->_ArcLists[0].Label = EpsilonLabel;
     NFA->_ArcLists[0].NumTransitions = 0;
+    return NFA;
+}
+
+/**
+ * Add the states and arcs for Regex to the NFA, going from StartState to
+ * AcceptState.
+ *
+ * Returns the state the regex really starts at, which is a new one if there are
+ * alternatives outside of any parens. The NFA needs room for NFAMaxArcs(Regex)
+ * more arcs, see NFAInit.
+ */
+uint32_t NFAAddRegex(nfa *NFA, mem_arena *Arena, const char *Regex,
+                     uint32_t StartState, uint32_t AcceptState) {
+    // The parentheses bounds can't go in Arena, since the NFA has to be last
+    const size_t NumParenChunks = CountParenChunks(Regex);
+    mem_arena Scratch = ArenaInit();
+    chunk_bounds *ParenChunks = (chunk_bounds*)Alloc(&Scratch,
+        NumParenChunks * sizeof(chunk_bounds));
+
+    // Used in several places in this function
+    nfa_label EpsilonLabel = {};
+    EpsilonLabel.Type = EPSILON;
 
     // Used to track what was written by the previous iteration of the loop so
     // that we know what to loop over if we see a loop char like *+?
     //
     // LastChunk.StartState == NFA_NULLSTATE means the last chunk cannot be looped
-    chunk_bounds LastChunk{NFA_NULLSTATE, NFA->StartState};
+    chunk_bounds LastChunk{NFA_NULLSTATE, StartState};
     // Used to track which level of parentheses we are currently in
     size_t NumOpenParens = 0;
     // Used to track the first time we see a | char in the regex, at which time
@@ -155,6 +504,10 @@ nfa *RegexToNFA(const char *Regex, mem_arena *Arena) {
     lexer_state Lexer{Regex};
     while(LexHasNext(&Lexer)) {
         token Token = LexNext(&Lexer);
+        if (LexIsRepetition(Token)) {
+            LastChunk = NFAAddCounters(NFA, Arena, LastChunk, LexRepetition(Token));
+            continue;
+        }
 
         bool ActiveChar = true;
         if (Token.Escaped) {
@@ -282,15 +635,15 @@ nfa *RegexToNFA(const char *Regex, mem_arena *Arena) {
                   ReplacedStartState = true;
                   size_t AlternativeStart = NFA->NumStates++;
                   Transition.From = AlternativeStart;
-                  Transition.To = NFA->StartState;
+                  Transition.To = StartState;
                   NFAAddArc(NFA, Arena, EpsilonLabel, Transition);
-                  NFA->StartState = AlternativeStart;
+                  StartState = AlternativeStart;
                 }
 
                 // The bounds of the entire group of alternatives. Either the
                 // base regex is a list of alternatives of the body of a parens
                 // group is a list of alternatives.
-                chunk_bounds OrChunk{NFA->StartState, NFA_ACCEPTSTATE};
+                chunk_bounds OrChunk{StartState, AcceptState};
                 if (NumOpenParens > 0) {
                     OrChunk = ParenChunks[NumOpenParens - 1];
                 }
@@ -335,9 +688,461 @@ nfa *RegexToNFA(const char *Regex, mem_arena *Arena) {
         }
     }
     Transition.From = LastChunk.EndState;
-    Transition.To = NFA_ACCEPTSTATE;
+    Transition.To = AcceptState;
     NFAAddArc(NFA, Arena, EpsilonLabel, Transition);
+    ArenaFree(&Scratch);
+    return StartState;
+}
+
+// NFAAddRegex makes extra states for parens and alternations that it can't
+// avoid in one pass, and numbers the states in the order it makes them, which
+// splits up the states of paren groups and loops. See NFAMinimize and
+// NFARenumberStates.
+void NFAOptimizeParsedStates(nfa *NFA) {
+    mem_arena Scratch = ArenaInit();
+    NFAMinimize(NFA, &Scratch);
+    NFARenumberStates(NFA, &Scratch);
+    ArenaFree(&Scratch);
+}
+
+/**
+ * Parse the regex into an NFA in Arena, which has to be the last thing in it.
+ *
+ * {m,n} can repeat a char, dot, char set, or paren group, with m <= n and both
+ * at most LEX_MAX_REPETITION. Writing them out (see WriteRepetition) can add
+ * at most REGEX_MAX_ADDED_LENGTH chars to the regex, and the NFA has at most
+ * about 2 states per char of that. Long repetitions of a char, dot, or char
+ * set aren't written out but counted, and there can be at most
+ * NFA_MAX_COUNTERS of those (see NFAAddCounters), unless NoCounters.
+ *
+ * Returns NULL if the regex breaks those rules, and sets Error to what's wrong
+ * if it isn't NULL.
+ */
+nfa *RegexToNFA(const char *Regex, mem_arena *Arena, const char **Error = 0,
+                bool NoCounters = false) {
+    const char *UnusedError;
+    if (!Error) {
+        Error = &UnusedError;
+    }
+    // The NFA's arena is the one that grows, so the written out regex goes in
+    // another one
+    mem_arena Scratch = ArenaInit();
+    Regex = RegexExpandRepetitions(Regex, &Scratch, NoCounters, Error);
+    if (!Regex) {
+        ArenaFree(&Scratch);
+        return 0;
+    }
+
+    nfa *NFA = NFAInit(Arena, 1, NFAMaxArcs(Regex));
+    NFA->NumStates = 2; // Reserve 0 for accept, 1 for start
+    NFA->StartState = NFAAddRegex(NFA, Arena, Regex, NFA_DEFAULT_STARTSTATE,
+                                  NFA_ACCEPTSTATE);
+    ArenaFree(&Scratch);
 
     NFACombineArcLists(NFA);
+    NFAOptimizeParsedStates(NFA);
+    return NFA;
+}
+
+/**
+ * Make one NFA that matches any of the regexes, for matching all of them in
+ * one pass over the input.
+ *
+ * Regex i accepts in state i instead of NFA_ACCEPTSTATE, so the first
+ * NumRegexes bits of the active states say which ones matched. The start state
+ * has epsilon arcs to the start of each regex. See MatchSet in x86_codegen.cpp.
+ *
+ * Returns NULL if one of the regexes can't be parsed, see RegexToNFA. The
+ * limit on counters is for all of them together.
+ */
+nfa *RegexSetToNFA(const char **Regexes, size_t NumRegexes, mem_arena *Arena,
+                   const char **Error = 0) {
+    Assert(NumRegexes > 0);
+    const char *UnusedError;
+    if (!Error) {
+        Error = &UnusedError;
+    }
+
+    // Check every regex and count the arcs before making the NFA, since
+    // nothing can be allocated after it. The repetitions are written out
+    // again when adding each one, so only one copy is kept at a time.
+    size_t MaxArcs = NumRegexes;
+    uint32_t NumCounters = 0;
+    for (size_t RegexIdx = 0; RegexIdx < NumRegexes; ++RegexIdx) {
+        mem_arena Scratch = ArenaInit();
+        const char *Regex = RegexExpandRepetitions(Regexes[RegexIdx], &Scratch,
+                                                   false, Error);
+        if (Regex) {
+            MaxArcs += NFAMaxArcs(Regex);
+            NumCounters += RegexNumCounters(Regex);
+        }
+        ArenaFree(&Scratch);
+        if (!Regex) {
+            return 0;
+        }
+    }
+    if (NumCounters > NFA_MAX_COUNTERS) {
+        *Error = "The regexes have more than 32 counted {m,n} repetitions";
+        return 0;
+    }
+
+    nfa *NFA = NFAInit(Arena, NumRegexes, MaxArcs);
+    NFA->StartState = NumRegexes;
+    NFA->NumStates = NumRegexes + 1; // Reserve the accept states and start
+
+    nfa_label EpsilonLabel = {};
+    EpsilonLabel.Type = EPSILON;
+    nfa_transition Transition = {};
+    Transition.From = NFA->StartState;
+    for (size_t RegexIdx = 0; RegexIdx < NumRegexes; ++RegexIdx) {
+        mem_arena Scratch = ArenaInit();
+        const char *Regex = RegexExpandRepetitions(Regexes[RegexIdx], &Scratch,
+                                                   false, Error);
+        uint32_t RegexStart = NFA->NumStates++;
+        Transition.To = NFAAddRegex(NFA, Arena, Regex, RegexStart, RegexIdx);
+        NFAAddArc(NFA, Arena, EpsilonLabel, Transition);
+        ArenaFree(&Scratch);
+    }
+
+    NFACombineArcLists(NFA);
+    NFAOptimizeParsedStates(NFA);
+    return NFA;
+}
+
+// Glushkov construction
+//
+// RegexToNFA makes states and epsilon arcs for every *+?()|, and the JIT code
+// has to follow the epsilon arcs again after every char. The position
+// automaton instead has one state for each char, dot, or char set in the
+// regex (a position), and an arc into a position for every way the regex can
+// read it next, labeled with the position's label. So every arc consumes a
+// char, and position i is state i + 2, in the order they're in the regex.
+//
+// It's built from three things about each part of the regex: the positions
+// it can start with (First), the positions it can end with (Last), and if it
+// matches the empty string (Nullable). Concatenating A and B adds arcs from
+// Last(A) to First(B), and looping A adds arcs from Last(A) to First(A).
+
+#define GLUSHKOV_POSITION_STATE(Position) ((uint32_t)(Position) + 2)
+// The most arcs RegexToGlushkovNFA makes. Compiling the NFA slows down faster
+// than the arcs grow, so past this it takes longer than the Thompson NFA by
+// far (a second or more at 16K arcs).
+#define GLUSHKOV_MAX_ARCS (1 << 13)
+
+// The parts of the regex in one level of parens. The sets are bitsets of
+// positions.
+struct glushkov_level {
+    // The alternatives before the last |
+    uint32_t *AltFirst;
+    uint32_t *AltLast;
+    bool AltNullable;
+    // The concatenation since the last |, not including Atom
+    uint32_t *SeqFirst;
+    uint32_t *SeqLast;
+    bool SeqNullable;
+    // The last char or paren group, kept separate so *+? can apply to it
+    uint32_t *AtomFirst;
+    uint32_t *AtomLast;
+    bool AtomNullable;
+    bool HasAtom;
+    bool AtomLoopable; // False after *+? since they can't be repeated
+};
+
+inline void GlushkovSetClear(uint32_t *Set, uint32_t NumSetDwords) {
+    for (uint32_t i = 0; i < NumSetDwords; ++i) {
+        Set[i] = 0;
+    }
+}
+
+inline void GlushkovSetCopy(uint32_t *Dest, const uint32_t *Src, uint32_t NumSetDwords) {
+    for (uint32_t i = 0; i < NumSetDwords; ++i) {
+        Dest[i] = Src[i];
+    }
+}
+
+inline void GlushkovSetUnion(uint32_t *Dest, const uint32_t *Src, uint32_t NumSetDwords) {
+    for (uint32_t i = 0; i < NumSetDwords; ++i) {
+        Dest[i] |= Src[i];
+    }
+}
+
+// Start a level with no alternatives and an empty concatenation
+void GlushkovLevelInit(glushkov_level *Level, uint32_t NumSetDwords) {
+    GlushkovSetClear(Level->AltFirst, NumSetDwords);
+    GlushkovSetClear(Level->AltLast, NumSetDwords);
+    GlushkovSetClear(Level->SeqFirst, NumSetDwords);
+    GlushkovSetClear(Level->SeqLast, NumSetDwords);
+    Level->AltNullable = false;
+    Level->SeqNullable = true;
+    Level->HasAtom = false;
+    Level->AtomLoopable = false;
+}
+
+// Add an arc with each label of the position. Returns how many, and NFA can be
+// NULL to only count.
+size_t GlushkovAddLabelArcs(nfa *NFA, mem_arena *Arena, const token *Token,
+                            nfa_transition Transition) {
+    if (!Token->Escaped && *Token->Str == '[') {
+        size_t NumArcs = 0;
+        lexer_state Lexer{Token->Str+1};
+        while (LexHasNextCharSetLabel(&Lexer)) {
+            nfa_label Label = LexNextCharSetLabel(&Lexer);
+            if (NFA) {
+                NFAAddArc(NFA, Arena, Label, Transition);
+            }
+            NumArcs += 1;
+        }
+        return NumArcs;
+    }
+    nfa_label Label = {};
+    if (!Token->Escaped && *Token->Str == '.') {
+        Label.Type = DOT;
+    } else {
+        Label.Type = MATCH;
+        Label.A = *Token->Str;
+    }
+    if (NFA) {
+        NFAAddArc(NFA, Arena, Label, Transition);
+    }
+    return 1;
+}
+
+// Add the arcs from the state to every position in ToSet. A regex can end at
+// any position in LastSet, so the arcs into those are copied to go into the
+// accept state too. Returns how many, and NFA can be NULL to only count.
+size_t GlushkovAddArcs(nfa *NFA, mem_arena *Arena, const token *Positions,
+                       uint32_t NumPositions, uint32_t From, const uint32_t *ToSet,
+                       const uint32_t *LastSet) {
+    size_t NumArcs = 0;
+    nfa_transition Transition = {};
+    Transition.From = From;
+    for (uint32_t Position = 0; Position < NumPositions; ++Position) {
+        if (!StateSetHas(ToSet, Position)) {
+            continue;
+        }
+        Transition.To = GLUSHKOV_POSITION_STATE(Position);
+        NumArcs += GlushkovAddLabelArcs(NFA, Arena, &Positions[Position], Transition);
+        if (StateSetHas(LastSet, Position)) {
+            Transition.To = NFA_ACCEPTSTATE;
+            NumArcs += GlushkovAddLabelArcs(NFA, Arena, &Positions[Position], Transition);
+        }
+    }
+    return NumArcs;
+}
+
+// Add the arcs from the start to FirstSet and from each position to the ones
+// that can follow it. Returns how many, and NFA can be NULL to only count.
+size_t GlushkovAddAllArcs(nfa *NFA, mem_arena *Arena, const token *Positions,
+                          uint32_t NumPositions, const uint32_t *Follow,
+                          const uint32_t *FirstSet, const uint32_t *LastSet) {
+    const uint32_t NumSetDwords = DivCeil(NumPositions, 32);
+    size_t NumArcs = GlushkovAddArcs(NFA, Arena, Positions, NumPositions,
+                                     NFA_DEFAULT_STARTSTATE, FirstSet, LastSet);
+    for (uint32_t Position = 0; Position < NumPositions; ++Position) {
+        NumArcs += GlushkovAddArcs(NFA, Arena, Positions, NumPositions,
+                                   GLUSHKOV_POSITION_STATE(Position),
+                                   &Follow[Position * NumSetDwords], LastSet);
+    }
+    return NumArcs;
+}
+
+// Every position in FromSet can be followed by every position in ToSet
+void GlushkovAddFollows(uint32_t *Follow, uint32_t NumPositions,
+                        const uint32_t *FromSet, const uint32_t *ToSet) {
+    const uint32_t NumSetDwords = DivCeil(NumPositions, 32);
+    for (uint32_t Position = 0; Position < NumPositions; ++Position) {
+        if (StateSetHas(FromSet, Position)) {
+            GlushkovSetUnion(&Follow[Position * NumSetDwords], ToSet, NumSetDwords);
+        }
+    }
+}
+
+// Concatenate the level's atom onto the end of its sequence
+void GlushkovCommitAtom(uint32_t *Follow, uint32_t NumPositions, glushkov_level *Level) {
+    if (!Level->HasAtom) {
+        return;
+    }
+    const uint32_t NumSetDwords = DivCeil(NumPositions, 32);
+    GlushkovAddFollows(Follow, NumPositions, Level->SeqLast, Level->AtomFirst);
+    if (Level->SeqNullable) {
+        GlushkovSetUnion(Level->SeqFirst, Level->AtomFirst, NumSetDwords);
+    }
+    if (Level->AtomNullable) {
+        GlushkovSetUnion(Level->SeqLast, Level->AtomLast, NumSetDwords);
+    } else {
+        GlushkovSetCopy(Level->SeqLast, Level->AtomLast, NumSetDwords);
+    }
+    Level->SeqNullable &= Level->AtomNullable;
+    Level->HasAtom = false;
+}
+
+// Add the level's sequence to its alternatives and start an empty one
+void GlushkovCommitSeq(uint32_t NumSetDwords, glushkov_level *Level) {
+    GlushkovSetUnion(Level->AltFirst, Level->SeqFirst, NumSetDwords);
+    GlushkovSetUnion(Level->AltLast, Level->SeqLast, NumSetDwords);
+    Level->AltNullable |= Level->SeqNullable;
+    GlushkovSetClear(Level->SeqFirst, NumSetDwords);
+    GlushkovSetClear(Level->SeqLast, NumSetDwords);
+    Level->SeqNullable = true;
+}
+
+/**
+ * Make the position (Glushkov) automaton for the regex, which matches the same
+ * strings as RegexToNFA but has no epsilon arcs and a state for each position.
+ *
+ * State 0 is the accept state and 1 is the start, then position i is state
+ * i + 2. A regex can end at any of several positions, but there's only one
+ * accept state, so every arc into a position the regex can end at is copied
+ * to go into the accept state too. The one exception to no epsilon arcs is
+ * an arc from the start to the accept state when the regex matches the empty
+ * string, which the start closure takes care of before matching.
+ *
+ * The arcs can grow with the square of the positions, so it returns NULL if
+ * there would be more than GLUSHKOV_MAX_ARCS. It also returns NULL for the
+ * same regexes as RegexToNFA, and sets Error if it isn't NULL.
+ */
+nfa *RegexToGlushkovNFA(const char *Regex, mem_arena *Arena, const char **Error = 0) {
+    const char *UnusedError;
+    if (!Error) {
+        Error = &UnusedError;
+    }
+    // Neither the written out regex nor the parse state can go in Arena, since
+    // the NFA has to be last. They each get their own since an arena can move
+    // when it grows.
+    mem_arena RegexScratch = ArenaInit();
+    Regex = RegexExpandRepetitions(Regex, &RegexScratch, true, Error);
+    if (!Regex) {
+        ArenaFree(&RegexScratch);
+        return 0;
+    }
+
+    // Count the positions and the deepest the parens go
+    uint32_t NumPositions = 0;
+    uint32_t NumLevels = 1;
+    uint32_t Depth = 1;
+    lexer_state Lexer{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        if (!Token.Escaped && *Token.Str == '(') {
+            Depth += 1;
+            NumLevels = Max(NumLevels, Depth);
+        } else if (!Token.Escaped && *Token.Str == ')') {
+            // TODO: Report an error
+            Assert(Depth > 1);
+            Depth -= 1;
+        } else if (Token.Escaped || (*Token.Str != '*' && *Token.Str != '+' &&
+                                     *Token.Str != '?' && *Token.Str != '|'))
+        {
+            NumPositions += 1;
+        }
+    }
+    Assert(Depth == 1);
+    const uint32_t NumSetDwords = DivCeil(NumPositions, 32);
+
+    // One allocation, so none of the pointers go stale
+    const size_t PositionsSize = NumPositions * sizeof(token);
+    const size_t LevelsSize = NumLevels * sizeof(glushkov_level);
+    const size_t SetsSize = NumLevels * 6 * NumSetDwords * sizeof(uint32_t);
+    const size_t FollowSize = NumPositions * NumSetDwords * sizeof(uint32_t);
+    mem_arena Scratch = ArenaInit();
+    uint8_t *ScratchBase = (uint8_t *)Alloc(&Scratch,
+        PositionsSize + LevelsSize + SetsSize + FollowSize);
+    token *Positions = (token *)ScratchBase;
+    glushkov_level *Levels = (glushkov_level *)(ScratchBase + PositionsSize);
+    uint32_t *Sets = (uint32_t *)(ScratchBase + PositionsSize + LevelsSize);
+    uint32_t *Follow = Sets + NumLevels * 6 * NumSetDwords;
+    for (uint32_t LevelIdx = 0; LevelIdx < NumLevels; ++LevelIdx) {
+        glushkov_level *Level = &Levels[LevelIdx];
+        uint32_t *LevelSets = &Sets[LevelIdx * 6 * NumSetDwords];
+        Level->AltFirst  = LevelSets;
+        Level->AltLast   = LevelSets + 1*NumSetDwords;
+        Level->SeqFirst  = LevelSets + 2*NumSetDwords;
+        Level->SeqLast   = LevelSets + 3*NumSetDwords;
+        Level->AtomFirst = LevelSets + 4*NumSetDwords;
+        Level->AtomLast  = LevelSets + 5*NumSetDwords;
+    }
+
+    glushkov_level *Level = &Levels[0];
+    GlushkovLevelInit(Level, NumSetDwords);
+    uint32_t NextPosition = 0;
+    Lexer = lexer_state{Regex};
+    while (LexHasNext(&Lexer)) {
+        token Token = LexNext(&Lexer);
+        const char Char = Token.Escaped ? '\0' : *Token.Str;
+        switch (Char) {
+        case '*':
+        case '+':
+        case '?': {
+            // TODO: Report an error
+            Assert(Level->HasAtom && Level->AtomLoopable);
+            if (Char != '?') {
+                GlushkovAddFollows(Follow, NumPositions, Level->AtomLast, Level->AtomFirst);
+            }
+            if (Char != '+') {
+                Level->AtomNullable = true;
+            }
+            Level->AtomLoopable = false;
+        } break;
+        case '|': {
+            GlushkovCommitAtom(Follow, NumPositions, Level);
+            GlushkovCommitSeq(NumSetDwords, Level);
+        } break;
+        case '(': {
+            GlushkovCommitAtom(Follow, NumPositions, Level);
+            Level += 1;
+            GlushkovLevelInit(Level, NumSetDwords);
+        } break;
+        case ')': {
+            GlushkovCommitAtom(Follow, NumPositions, Level);
+            GlushkovCommitSeq(NumSetDwords, Level);
+            // The whole group is the atom of the level outside of it
+            glushkov_level *Inner = Level;
+            Level -= 1;
+            GlushkovSetCopy(Level->AtomFirst, Inner->AltFirst, NumSetDwords);
+            GlushkovSetCopy(Level->AtomLast, Inner->AltLast, NumSetDwords);
+            Level->AtomNullable = Inner->AltNullable;
+            Level->HasAtom = true;
+            Level->AtomLoopable = true;
+        } break;
+        default: { // A char, escaped char, dot, or char set
+            GlushkovCommitAtom(Follow, NumPositions, Level);
+            const uint32_t Position = NextPosition++;
+            Positions[Position] = Token;
+            GlushkovSetClear(Level->AtomFirst, NumSetDwords);
+            GlushkovSetClear(Level->AtomLast, NumSetDwords);
+            StateSetAdd(Level->AtomFirst, Position);
+            StateSetAdd(Level->AtomLast, Position);
+            Level->AtomNullable = false;
+            Level->HasAtom = true;
+            Level->AtomLoopable = true;
+        } break;
+        }
+    }
+    GlushkovCommitAtom(Follow, NumPositions, Level);
+    GlushkovCommitSeq(NumSetDwords, Level);
+    Assert(NextPosition == NumPositions);
+
+    // Count the arcs first, so the NFA can have room for all of them
+    const size_t NumArcs = 1 + GlushkovAddAllArcs(0, 0, Positions, NumPositions,
+        Follow, Level->AltFirst, Level->AltLast);
+    nfa *NFA = 0;
+    if (NumArcs > GLUSHKOV_MAX_ARCS) {
+        *Error = "The regex has too many arcs for the Glushkov NFA";
+    } else {
+        NFA = NFAInit(Arena, 1, NumArcs);
+        NFA->StartState = NFA_DEFAULT_STARTSTATE;
+        NFA->NumStates = GLUSHKOV_POSITION_STATE(NumPositions);
+        GlushkovAddAllArcs(NFA, Arena, Positions, NumPositions, Follow,
+                           Level->AltFirst, Level->AltLast);
+        if (Level->AltNullable) {
+            nfa_label EpsilonLabel = {};
+            EpsilonLabel.Type = EPSILON;
+            nfa_transition Transition{NFA->StartState, NFA_ACCEPTSTATE};
+            NFAAddArc(NFA, Arena, EpsilonLabel, Transition);
+        }
+        NFACombineArcLists(NFA);
+    }
+    ArenaFree(&Scratch);
+    ArenaFree(&RegexScratch);
     return NFA;
 }
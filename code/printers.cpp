@@ -45,7 +45,19 @@ void PrintNFA(nfa *NFA) {
     Print("Size: %u Bytes\n", NFASize);
     Print("Number of states: %u\n", NFA->NumStates);
     Print("Start State: %u\n", NFA->StartState);
-    Print("Accept State: %u\n\n", NFA_ACCEPTSTATE);
+    if (NFA->NumAcceptStates > 1) {
+        Print("Accept States: %u to %u\n\n", NFA_ACCEPTSTATE, NFA->NumAcceptStates - 1);
+    } else {
+        Print("Accept State: %u\n\n", NFA_ACCEPTSTATE);
+    }
+    for (size_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        nfa_counter *Counter = &NFA->Counters[CounterIdx];
+        Print("Counter State: %u, %u to %u chars\n", Counter->State, Counter->Min,
+              Counter->Max);
+    }
+    if (NFA->NumCounters > 0) {
+        Print("\n");
+    }
 
     nfa_arc_list *ArcList = NFAFirstArcList(NFA);
     for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
@@ -69,7 +81,15 @@ void PrintNFA(nfa *NFA) {
 
 inline void printFirstArg(instruction *Instruction) {
     const char *RegName = reg_strings[Instruction->Dest];
-    if (Instruction->Mode == MEM_DISP8 || Instruction->Mode == MEM_DISP32) {
+    if (Instruction->Type == XMM_REG && Instruction->Mode == REG) {
+        RegName = xmm_strings[Instruction->Dest];
+    }
+    if (Instruction->Scale != 0) {
+        Print("%s + %s*%u", RegName, reg_strings[Instruction->Index], (uint32_t)Instruction->Scale);
+        if (Instruction->Mode == MEM_DISP8 || Instruction->Mode == MEM_DISP32) {
+            Print(" + %x", (uint32_t)Instruction->Disp);
+        }
+    } else if (Instruction->Mode == MEM_DISP8 || Instruction->Mode == MEM_DISP32) {
         Print("%s + %x", RegName, (uint32_t)Instruction->Disp);
     } else {
         Print(RegName);
@@ -82,7 +102,12 @@ inline void printFirstArg(instruction *Instruction) {
 // [REG] OR   12345678      , EAX
 // [MEM] INC  EAX
 // [REG] ADD  EAX + 12345678, EAX
+// [DAT,32] DD   Op # 12 - Op # 4
 void PrintInstruction(instruction *Instruction) {
+    if (Instruction->Type == DATA) {
+        Print("[DAT,32] DD   Op # %x - Op # %x", (uint32_t)Instruction->JumpDestIdx, Instruction->Imm);
+        return;
+    }
     // Mode
     switch (Instruction->Mode) {
     case REG:
@@ -98,7 +123,9 @@ void PrintInstruction(instruction *Instruction) {
         break;
     }
     // Bit-width
-    if (Instruction->Is16) {
+    if (Instruction->Type == XMM_REG) {
+        Print(",128] ");
+    } else if (Instruction->Is16) {
         Print(",32] ");
     } else {
         Print(", 8] ");
@@ -128,6 +155,18 @@ void PrintInstruction(instruction *Instruction) {
         printFirstArg(Instruction);
         Print(", %x", (uint32_t)Instruction->Imm);
         break;
+    case DATA:
+        break;
+    case XMM_REG:
+        printFirstArg(Instruction);
+        if (Instruction->Op == PMOVMSKB) {
+            Print(", %s", reg_strings[Instruction->Src]);
+        } else if (Instruction->Op == PSRLW || Instruction->Op == PSRLDQ || Instruction->Op == PSLLDQ) {
+            Print(", %x", (uint32_t)Instruction->Imm);
+        } else {
+            Print(", %s", xmm_strings[Instruction->Src]);
+        }
+        break;
     }
 }
 
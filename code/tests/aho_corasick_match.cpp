@@ -0,0 +1,108 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+#include "aho_corasick.cpp"
+
+#include "utils.h"
+#include "print.h"
+#include "mem_arena.h"
+
+// Uses EXPECT_MATCH and EXPECT_NO_MATCH from tests/end_to_end.cpp
+
+#define EXPECT_LITERALS(regex, count) do { \
+   uint32_t NumLiterals = RegexCountLiterals(regex); \
+   if (NumLiterals != (count)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s has %u literals instead of %u. %s:%u\n", \
+             (regex), NumLiterals, (count), __FILE__, __LINE__); \
+   } \
+} while(false)
+
+void aho_corasick_RunTests(tester_state *T) {
+    mem_arena Arena = ArenaInit();
+
+    EXPECT_LITERALS("foo", 1);
+    EXPECT_LITERALS("foo|bar|baz", 3);
+    EXPECT_LITERALS("a\\*b|\\(c\\)", 2);
+    EXPECT_LITERALS("", 0);
+    EXPECT_LITERALS("foo|", 0);
+    EXPECT_LITERALS("|foo", 0);
+    EXPECT_LITERALS("foo||bar", 0);
+    EXPECT_LITERALS("fo*|bar", 0);
+    EXPECT_LITERALS("(foo|bar)", 0);
+    EXPECT_LITERALS("foo|b.r", 0);
+    EXPECT_LITERALS("foo|[bc]ar", 0);
+    EXPECT_LITERALS("fo{2}", 0);
+    EXPECT_LITERALS("a{|b{x}", 2); // Not repetitions
+
+    {
+        const char *Regex = "he|she|his|hers|a\\|b";
+        aho_corasick AC = AhoCorasickInit(Regex, &Arena);
+        auto Match = [&](const char *Str) { return AhoCorasickMatch(&AC, Str); };
+
+        EXPECT_MATCH("he");
+        EXPECT_MATCH("she");
+        EXPECT_MATCH("hers");
+        EXPECT_MATCH("a|b");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("h");
+        EXPECT_NO_MATCH("her");
+        EXPECT_NO_MATCH("ushers");
+        EXPECT_NO_MATCH("a");
+        EXPECT_NO_MATCH("b");
+
+        Arena.Used = 0;
+    }
+    { // Unanchored search, where the failure links matter
+        const char *Regex = "he|she|his|hers";
+        aho_corasick AC = AhoCorasickInit(Regex, &Arena, true);
+        auto Match = [&](const char *Str) { return AhoCorasickMatch(&AC, Str); };
+
+        EXPECT_MATCH("ushers");
+        EXPECT_MATCH("ahishe");
+        EXPECT_MATCH("shhe");
+        EXPECT_MATCH("xxxxxxhis");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("hhhhh");
+        EXPECT_NO_MATCH("sshs");
+        EXPECT_NO_MATCH("hi s");
+
+        Arena.Used = 0;
+    }
+    { // Thousands of literals: w0000 up to w4999 but only the even ones
+        mem_arena RegexArena = ArenaInit();
+        const uint32_t NumLiterals = 2500;
+        char *Regex = (char *)Alloc(&RegexArena, NumLiterals * 6);
+        char *Curr = Regex;
+        for (uint32_t i = 0; i < NumLiterals; ++i) {
+            uint32_t Number = 2 * i;
+            *Curr++ = 'w';
+            *Curr++ = (char)('0' + Number / 1000);
+            *Curr++ = (char)('0' + Number / 100 % 10);
+            *Curr++ = (char)('0' + Number / 10 % 10);
+            *Curr++ = (char)('0' + Number % 10);
+            *Curr++ = '|';
+        }
+        *(Curr - 1) = '\0';
+        EXPECT_LITERALS(Regex, NumLiterals);
+
+        aho_corasick AC = AhoCorasickInit(Regex, &Arena, true);
+        auto Match = [&](const char *Str) { return AhoCorasickMatch(&AC, Str); };
+
+        EXPECT_MATCH("w0000");
+        EXPECT_MATCH("w4998");
+        EXPECT_MATCH("ww1234w");
+        EXPECT_MATCH("w12w3w0w0w0w1w0006");
+
+        EXPECT_NO_MATCH("w1235");
+        EXPECT_NO_MATCH("w500");
+        EXPECT_NO_MATCH("w0001w0003w0005");
+
+        ArenaFree(&RegexArena);
+        Arena.Used = 0;
+    }
+
+    ArenaFree(&Arena);
+}
@@ -1,5 +1,7 @@
 #include "parser.cpp"
 #include "x86_codegen.cpp"
+#include "x86_dfa_codegen.cpp"
+#include "x86_lanes_codegen.cpp"
 
 #include "utils.h"
 #include "print.h"
@@ -8,28 +10,36 @@
 //TODO: put this stuff in a standalone file
 extern "C" typedef uint32_t (*dfreMatch)(const char *Str); // Function pointer type for calling the compiled regex code
 
-dfreMatch CompileRegex(const char *Regex, size_t *CodeSize) {
-    static mem_arena ArenaA = ArenaInit();
-    static mem_arena ArenaB = ArenaInit();
-
-    nfa *NFA = RegexToNFA(Regex, &ArenaA);
+// Compile the NFA, which has to be in ArenaA, and clear the arenas
+dfreMatch CompileTestNFA(nfa *NFA, mem_arena *ArenaA, mem_arena *ArenaB,
+                         bool UseDFA, size_t *CodeSize, codegen_options Options,
+                         bool UseLanes = false) {
     // Convert the NFA into an intermediate code representation
-    GeneratedInstructions Generated = GenerateInstructions(NFA, &ArenaB);
+    GeneratedInstructions Generated = {};
+    if (UseLanes) {
+        Generated = GenerateLanesInstructions(NFA, ArenaB, Options);
+    }
+    if (UseDFA && Generated.Count == 0) {
+        Generated = GenerateDFAInstructions(NFA, ArenaB, Options);
+    }
+    if (Generated.Count == 0) { // Also the fallback when the DFA is too big
+        Generated = GenerateInstructions(NFA, ArenaB, Options);
+    }
     size_t InstructionsGenerated = Generated.Count;
     instruction *Instructions = Generated.Instructions;
     // Allocate storage for the unpacked x86 opcodes
     NFA = (nfa*)0;
-    ArenaA.Used = 0;
-    opcode_unpacked *UnpackedOpcodes = (opcode_unpacked*)Alloc(&ArenaA,
+    ArenaA->Used = 0;
+    opcode_unpacked *UnpackedOpcodes = (opcode_unpacked*)Alloc(ArenaA,
             sizeof(opcode_unpacked) * InstructionsGenerated);
     // Assemble the x86
     AssembleInstructions(Instructions, InstructionsGenerated, UnpackedOpcodes);
     // Note: no more return count here, this keeps the same number of instructions
     // Allocate storage for the actual byte code
     Instructions = (instruction*)0;
-    ArenaB.Used = 0;
+    ArenaB->Used = 0;
     size_t UpperBoundCodeSize = MAX_OPCODE_LEN * InstructionsGenerated;
-    uint8_t *Code = (uint8_t*)Alloc(&ArenaB, UpperBoundCodeSize);
+    uint8_t *Code = (uint8_t*)Alloc(ArenaB, UpperBoundCodeSize);
     // Write the code to the arena
     size_t CodeWritten = PackCode(UnpackedOpcodes, InstructionsGenerated, Code);
     *CodeSize = CodeWritten;
@@ -37,13 +47,34 @@ dfreMatch CompileRegex(const char *Regex, size_t *CodeSize) {
     void *CodeLoc = LoadCode(Code, CodeWritten);
     dfreMatch Match = (dfreMatch)CodeLoc;
     // Clear the arenas
-    for (size_t i = 0; i < ArenaA.Committed; ++i) ArenaA.Base[i] = 0;
-    ArenaA.Used = 0;
-    for (size_t i = 0; i < ArenaB.Committed; ++i) ArenaB.Base[i] = 0;
-    ArenaB.Used = 0;
+    for (size_t i = 0; i < ArenaA->Committed; ++i) ArenaA->Base[i] = 0;
+    ArenaA->Used = 0;
+    for (size_t i = 0; i < ArenaB->Committed; ++i) ArenaB->Base[i] = 0;
+    ArenaB->Used = 0;
     return Match;
 }
 
+dfreMatch CompileRegex(const char *Regex, bool UseDFA, size_t *CodeSize,
+                       codegen_options Options = {}, bool UseLanes = false) {
+    static mem_arena ArenaA = ArenaInit();
+    static mem_arena ArenaB = ArenaInit();
+
+    nfa *NFA = RegexToNFA(Regex, &ArenaA);
+    if (Options.Reverse) {
+        NFAReverse(NFA);
+    }
+    return CompileTestNFA(NFA, &ArenaA, &ArenaB, UseDFA, CodeSize, Options, UseLanes);
+}
+
+dfreMatch CompileRegexSet(const char **Regexes, size_t NumRegexes, bool UseDFA,
+                          size_t *CodeSize, codegen_options Options) {
+    static mem_arena ArenaA = ArenaInit();
+    static mem_arena ArenaB = ArenaInit();
+
+    nfa *NFA = RegexSetToNFA(Regexes, NumRegexes, &ArenaA);
+    return CompileTestNFA(NFA, &ArenaA, &ArenaB, UseDFA, CodeSize, Options);
+}
+
 // TODO: print case pass counts
 // TODO: make %#s print \n instead of a real newline and print PASS strings
 #define EXPECT_MATCH(str) do { \
@@ -60,11 +91,149 @@ dfreMatch CompileRegex(const char *Regex, size_t *CodeSize) {
    } \
 } while(false)
 
+#define EXPECT_OFFSETS(str, start, end) do { \
+   match_offsets Offsets = {}; \
+   if (!FindMatchOffsets(FindStart, FindEnd, (str), &Offsets)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" did not match regex %s. %s:%u\n", (str), Regex, __FILE__, __LINE__); \
+   } else if (Offsets.Start != (start) || Offsets.End != (end)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" matched regex %s at %u to %u instead of %u to %u. %s:%u\n", \
+             (str), Regex, Offsets.Start, Offsets.End, (start), (end), __FILE__, __LINE__); \
+   } \
+} while(false)
+
+#define EXPECT_NO_OFFSETS(str) do { \
+   match_offsets Offsets = {}; \
+   if (FindMatchOffsets(FindStart, FindEnd, (str), &Offsets)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" matched regex %s. %s:%u\n", (str), Regex, __FILE__, __LINE__); \
+   } \
+} while(false)
+
+// For code generated with Counted, Str is a string literal that can have NULs
+#define EXPECT_MATCH_COUNTED(str) do { \
+   if (!MatchCounted((const uint8_t *)(str), sizeof(str) - 1)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" (%u bytes) did not match regex %s. %s:%u\n", (str), sizeof(str) - 1, Regex, __FILE__, __LINE__); \
+   } \
+} while(false)
+
+#define EXPECT_NO_MATCH_COUNTED(str) do { \
+   if (MatchCounted((const uint8_t *)(str), sizeof(str) - 1)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" (%u bytes) matched regex %s. %s:%u\n", (str), sizeof(str) - 1, Regex, __FILE__, __LINE__); \
+   } \
+} while(false)
+
+// Check the number of states left after NFAMinimize
+#define EXPECT_NFA_STATES(regex, states) do { \
+   mem_arena ArenaA = ArenaInit(); \
+   nfa *NFA = RegexToNFA((regex), &ArenaA); \
+   if (NFA->NumStates != (states)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s has %u states instead of %u. %s:%u\n", \
+             (regex), NFA->NumStates, (states), __FILE__, __LINE__); \
+   } \
+   ArenaFree(&ArenaA); \
+} while(false)
+
+// Check that RegexToNFA rejects the regex instead of making an NFA
+#define EXPECT_REGEX_ERROR(regex) do { \
+   mem_arena ArenaA = ArenaInit(); \
+   const char *Error = 0; \
+   if (RegexToNFA((regex), &ArenaA, &Error) || !Error) { \
+       T->Failed = true; \
+       Print("FAIL regex %s was parsed without an error. %s:%u\n", \
+             (regex), __FILE__, __LINE__); \
+   } \
+   ArenaFree(&ArenaA); \
+} while(false)
+
+// Check if GenerateInstructions steps with one shift for the regex, see
+// ShiftAndFinalStates
+#define EXPECT_SHIFT_AND(regex, expected) do { \
+   mem_arena ArenaA = ArenaInit(); \
+   mem_arena ArenaB = ArenaInit(); \
+   nfa *NFA = RegexToNFA((regex), &ArenaA); \
+   GeneratedInstructions Generated = GenerateInstructions(NFA, &ArenaB); \
+   if (Generated.ShiftAnd != (expected)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s %s the shift. %s:%u\n", (regex), \
+             (expected) ? "did not use" : "used", __FILE__, __LINE__); \
+   } \
+   ArenaFree(&ArenaA); \
+   ArenaFree(&ArenaB); \
+} while(false)
+
+// Check that the generated code doesn't grow with the repetition count, see
+// GenInstructionsShiftArcs
+#define EXPECT_MAX_INSTRUCTIONS(regex, max) do { \
+   mem_arena ArenaA = ArenaInit(); \
+   mem_arena ArenaB = ArenaInit(); \
+   nfa *NFA = RegexToNFA((regex), &ArenaA); \
+   GeneratedInstructions Generated = GenerateInstructions(NFA, &ArenaB); \
+   if (Generated.Count > (max)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s has %u instructions instead of at most %u. %s:%u\n", \
+             (regex), Generated.Count, (max), __FILE__, __LINE__); \
+   } \
+   ArenaFree(&ArenaA); \
+   ArenaFree(&ArenaB); \
+} while(false)
+
+// Count the arcs that consume a char and go to the next state, see
+// NFARenumberStates
+#define EXPECT_CHAINED_ARCS(regex, count) do { \
+   mem_arena ArenaA = ArenaInit(); \
+   nfa *NFA = RegexToNFA((regex), &ArenaA); \
+   uint32_t NumChained = 0; \
+   nfa_arc_list *ArcList = NFANextArcList(NFAFirstArcList(NFA)); \
+   for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) { \
+       for (size_t TIdx = 0; TIdx < ArcList->NumTransitions; ++TIdx) { \
+           NumChained += (ArcList->Transitions[TIdx].To == ArcList->Transitions[TIdx].From + 1); \
+       } \
+       ArcList = NFANextArcList(ArcList); \
+   } \
+   if (NumChained != (count)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s has %u arcs to the next state instead of %u. %s:%u\n", \
+             (regex), NumChained, (count), __FILE__, __LINE__); \
+   } \
+   ArenaFree(&ArenaA); \
+} while(false)
+
+// For code generated with MatchSet, Matched is the bitmap of regexes that
+// should match Str. Only checks the first dword of the bitmap.
+#define EXPECT_SET_MATCHES(str, matched) do { \
+   uint32_t Matched[2] = {}; \
+   uint32_t AnyMatched = MatchSet(Matched, (str)); \
+   if (Matched[0] != (matched) || (AnyMatched != 0) != ((matched) != 0)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" matched %x in the regex set instead of %x. %s:%u\n", \
+             (str), Matched[0], (matched), __FILE__, __LINE__); \
+   } \
+} while(false)
+
+// For code generated with ReturnToken and Counted, expect the next token in
+// Str starting at Pos to be the given regex and length, then skip over it
+#define EXPECT_TOKEN(str, pos, token, length) do { \
+   uint32_t Token = 0xFFFFFFFF; \
+   uint32_t Length = Scan(&Token, (const uint8_t *)(str) + (pos), sizeof(str) - 1 - (pos)); \
+   if (Token != (token) || Length != (length)) { \
+       T->Failed = true; \
+       Print("FAIL \"%s\" at %u scanned as token %u length %u instead of %u length %u. %s:%u\n", \
+             (str), (pos), Token, Length, (token), (length), __FILE__, __LINE__); \
+   } \
+   (pos) += Length; \
+} while(false)
+
 // TODO: Maybe it could work to have a flat list of cases and deduplicate the
 // compiled regex by using the same pointer for the regex field and checking for
 // it changing. Is that better though?
 
-void end_to_end_RunTests(tester_state *T) {
+// Runs every case through either the NFA or the DFA code generator
+void end_to_end_RunTests(tester_state *T, bool UseDFA) {
     size_t CodeSize;
 
     // TODO: split into categories and make pretty printing like the x86 tests
@@ -72,7 +241,7 @@ void end_to_end_RunTests(tester_state *T) {
 
     {
         const char *Regex = "test";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("test");
 
@@ -92,7 +261,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "ab*";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("ab");
@@ -112,7 +281,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "ab+";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("ab");
         EXPECT_MATCH("abb");
@@ -132,7 +301,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "ab?";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("ab");
@@ -152,7 +321,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "a|b";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("b");
@@ -172,7 +341,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "..";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("ab");
         EXPECT_MATCH("ba");
@@ -196,7 +365,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "[abc]";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("b");
@@ -215,7 +384,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "[a-z]";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("b");
@@ -243,7 +412,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "[a-g2-6]";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("b");
@@ -270,7 +439,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     { // Matches nothing
         const char *Regex = "[]+";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_NO_MATCH("");
         EXPECT_NO_MATCH("0");
@@ -289,7 +458,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "[a-g\\]2-6\\\\]";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("a");
         EXPECT_MATCH("b");
@@ -318,7 +487,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "(ab)*";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("");
         EXPECT_MATCH("ab");
@@ -343,7 +512,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "\\(ab\\)\\*+";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         EXPECT_MATCH("(ab)*");
         EXPECT_MATCH("(ab)**");
@@ -364,7 +533,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "(ab)*|[3-7.]+\\**|(ggg|9)*";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         // First alternative
         EXPECT_MATCH(""); // Also matches the third alternative
@@ -401,7 +570,7 @@ void end_to_end_RunTests(tester_state *T) {
     }
     {
         const char *Regex = "(ab)*|[3-7.]+\\**|(ggg|9)*|[a0-15-6]+|\\.\\.+|ansuehsntuasnthueoshuashouahseuoasnhtheuoanshtheouaeuaheouabuonb";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         // First alternative
         EXPECT_MATCH(""); // Also matches the third alternative
@@ -433,9 +602,72 @@ void end_to_end_RunTests(tester_state *T) {
 
         Free((void*)Match, CodeSize);
     }
+    { // Long epsilon chains and nested epsilon loops, all folded at compile time
+        const char *Regex = "((a|b*)*c?)*d";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+
+        EXPECT_MATCH("d");
+        EXPECT_MATCH("ad");
+        EXPECT_MATCH("bbbd");
+        EXPECT_MATCH("cd");
+        EXPECT_MATCH("abcabcd");
+        EXPECT_MATCH("ccccd");
+        EXPECT_MATCH("bababbbcaad");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("a");
+        EXPECT_NO_MATCH("abc");
+        EXPECT_NO_MATCH("dd");
+        EXPECT_NO_MATCH("da");
+        EXPECT_NO_MATCH("abxd");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Overlapping ranges, dots, and single chars split the bytes into many classes
+        const char *Regex = "[a-zA-Z_][a-zA-Z0-9_]*(:[0-9a-f]+|=.|x)";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+
+        EXPECT_MATCH("ax");
+        EXPECT_MATCH("_x");
+        EXPECT_MATCH("Foo_9x");
+        EXPECT_MATCH("abc:ff09");
+        EXPECT_MATCH("z=!");
+        EXPECT_MATCH("xx");
+        EXPECT_MATCH("a==");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("9x");
+        EXPECT_NO_MATCH("abc:");
+        EXPECT_NO_MATCH("abc:fg");
+        EXPECT_NO_MATCH("a=");
+        EXPECT_NO_MATCH("a=bc");
+        EXPECT_NO_MATCH("a-x");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Hundreds of states (state bitsets in SSE registers) and many arc list chunks
+        const char *Regex = "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+                            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+                            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)+";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+
+        EXPECT_MATCH("foo");
+        EXPECT_MATCH("garply");
+        EXPECT_MATCH("omega");
+        EXPECT_MATCH("alphabetagamma");
+        EXPECT_MATCH("psichiomicronxyzzy");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("om");
+        EXPECT_NO_MATCH("omegaa");
+        EXPECT_NO_MATCH("alphabet");
+        EXPECT_NO_MATCH("fooba");
+
+        Free((void*)Match, CodeSize);
+    }
     {
         const char *Regex = "((((((((((((((((((((((((((((((((((((((((a))))))))))))))))))))))))))))))))))))))))";
-        auto Match = CompileRegex(Regex, &CodeSize);
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
 
         // First alternative
         EXPECT_MATCH("a");
@@ -458,4 +690,991 @@ void end_to_end_RunTests(tester_state *T) {
 
         Free((void*)Match, CodeSize);
     }
+
+    codegen_options Unanchored = {};
+    Unanchored.Unanchored = true;
+    { // Unanchored search
+        const char *Regex = "ab+c";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+
+        EXPECT_MATCH("abc");
+        EXPECT_MATCH("xxabbbc");
+        EXPECT_MATCH("abcxx");
+        EXPECT_MATCH("aababcab");
+        EXPECT_MATCH("abbc abx");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("ac");
+        EXPECT_NO_MATCH("abbx");
+        EXPECT_NO_MATCH("xxab");
+        EXPECT_NO_MATCH("a b c");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Unanchored search, matches the empty string at the start
+        const char *Regex = "a*";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+
+        EXPECT_MATCH("");
+        EXPECT_MATCH("bbb");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Unanchored search with the states on the stack and a jump table
+        const char *Regex = "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+                            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+                            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)!";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+
+        EXPECT_MATCH("foo!");
+        EXPECT_MATCH("it was omega!!");
+        EXPECT_MATCH("zzzxyzzy!zzz");
+        EXPECT_MATCH("alphabetagamma!");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("omeg!a");
+        EXPECT_NO_MATCH("fo o!");
+        EXPECT_NO_MATCH("gamm!");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Unanchored search that skips to a literal every match starts with
+        const char *Regex = "error: .*timeout";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+
+        EXPECT_MATCH("error: timeout");
+        EXPECT_MATCH("2019-01-01 12:00:00 host errrror: eerror: connection timeout");
+        EXPECT_MATCH("eeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeeerror: timeout");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("erro");
+        EXPECT_NO_MATCH("error: timeou");
+        EXPECT_NO_MATCH("2019-01-01 12:00:00 host warning: connection timeout");
+        EXPECT_NO_MATCH("2019-01-01 12:00:00 host error:timeout error");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Unanchored search for a literal in the middle of every match, at every alignment
+        const char *Regex = "(a|b)+hello";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        codegen_options UnanchoredCounted = Unanchored;
+        UnanchoredCounted.Counted = true;
+        size_t CountedCodeSize;
+        auto MatchCounted = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &CountedCodeSize, UnanchoredCounted);
+
+        char Str[64];
+        for (uint32_t Pad = 0; Pad < 40; ++Pad) {
+            for (uint32_t i = 0; i < Pad; ++i) {
+                Str[i] = (i % 3 == 0) ? 'h' : 'a';
+            }
+            const char *Hello = "hello";
+            for (uint32_t i = 0; i <= 5; ++i) {
+                Str[Pad + i] = Hello[i];
+            }
+            const bool CanMatch = (Pad > 0 && Str[Pad - 1] == 'a');
+            const bool Found = Match(Str);
+            const bool FoundCounted = MatchCounted((const uint8_t *)Str, Pad + 5);
+            const bool FoundCut = MatchCounted((const uint8_t *)Str, Pad + 4);
+            Str[Pad + 4] = 0;
+            const bool FoundPartial = Match(Str);
+            if (Found != CanMatch || FoundCounted != CanMatch || FoundCut || FoundPartial) {
+                T->Failed = true;
+                Print("FAIL regex %s after %u chars: %u %u %u %u. %s:%u\n", Regex, Pad,
+                      Found, FoundCounted, FoundCut, FoundPartial, __FILE__, __LINE__);
+            }
+        }
+
+        Free((void*)Match, CodeSize);
+        Free((void*)MatchCounted, CountedCodeSize);
+    }
+    { // Unanchored search for any of a few prefixes
+        const char *Regex = "(cat|dog|cow)s";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+
+        EXPECT_MATCH("cats");
+        EXPECT_MATCH("hot dogs");
+        EXPECT_MATCH("the cat and the cows");
+        EXPECT_MATCH("cacowcats");
+        EXPECT_MATCH("a lot of text before we get to the dogs");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("cat");
+        EXPECT_NO_MATCH("the dog and the cow");
+        EXPECT_NO_MATCH("cots cogs dots doss");
+        EXPECT_NO_MATCH("a lot of text before the end with a dog");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Unanchored search for any of a lot of keywords, at every alignment
+        const char *Regex = "(auto|break|case|char|const|continue|default|do|double|else|"
+                            "enum|extern|float|for|goto|if|int|long):";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        codegen_options UnanchoredCounted = Unanchored;
+        UnanchoredCounted.Counted = true;
+        size_t CountedCodeSize;
+        auto MatchCounted = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &CountedCodeSize, UnanchoredCounted);
+
+        // Lots of chars that share nibbles with the keywords, but no :
+        const char *Filler = "caa chs dou xif elong ";
+        const char *Keywords[] = {"continue", "do", "long"};
+        char Str[64];
+        for (uint32_t Keyword = 0; Keyword < ArrayLength(Keywords); ++Keyword) {
+            for (uint32_t Pad = 0; Pad < 40; ++Pad) {
+                for (uint32_t i = 0; i < Pad; ++i) {
+                    Str[i] = Filler[i % 22];
+                }
+                uint32_t Length = Pad;
+                for (const char *c = Keywords[Keyword]; *c; ++c) {
+                    Str[Length++] = *c;
+                }
+                Str[Length++] = ':';
+                Str[Length] = 0;
+                const bool Found = Match(Str);
+                const bool FoundCounted = MatchCounted((const uint8_t *)Str, Length);
+                const bool FoundCut = MatchCounted((const uint8_t *)Str, Length - 1);
+                Str[Length - 1] = 0;
+                const bool FoundPartial = Match(Str);
+                if (!Found || !FoundCounted || FoundCut || FoundPartial) {
+                    T->Failed = true;
+                    Print("FAIL regex %s with %s after %u chars: %u %u %u %u. %s:%u\n", Regex,
+                          Keywords[Keyword], Pad, Found, FoundCounted, FoundCut, FoundPartial,
+                          __FILE__, __LINE__);
+                }
+            }
+        }
+        // NULs right before the string aren't the end of it
+        for (uint32_t Start = 1; Start <= 16; ++Start) {
+            for (uint32_t i = 0; i < Start; ++i) {
+                Str[i] = 0;
+            }
+            const char *Text = "x if:";
+            for (uint32_t i = 0; i <= 5; ++i) {
+                Str[Start + i] = Text[i];
+            }
+            if (!Match(Str + Start)) {
+                T->Failed = true;
+                Print("FAIL \"%s\" did not match regex %s after %u NULs. %s:%u\n", Str + Start,
+                      Regex, Start, __FILE__, __LINE__);
+            }
+        }
+
+        Free((void*)Match, CodeSize);
+        Free((void*)MatchCounted, CountedCodeSize);
+    }
+
+    size_t StartCodeSize;
+    codegen_options FindStartOptions = {};
+    FindStartOptions.Unanchored = true;
+    FindStartOptions.ReturnOffset = true;
+    FindStartOptions.Reverse = true;
+    codegen_options FindEndOptions = {};
+    FindEndOptions.ReturnOffset = true;
+    { // Match offsets
+        const char *Regex = "ab+c|b";
+        auto FindStart = (dfreOffset)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartOptions);
+        auto FindEnd = (dfreOffset)CompileRegex(Regex, UseDFA, &CodeSize, FindEndOptions);
+
+        EXPECT_OFFSETS("abc", 0, 3);
+        EXPECT_OFFSETS("xxabbbcx", 2, 7);
+        EXPECT_OFFSETS("xxbq", 2, 3);
+        EXPECT_OFFSETS("abbx", 1, 2);
+        EXPECT_OFFSETS("xabc abbc", 1, 4);
+
+        EXPECT_NO_OFFSETS("");
+        EXPECT_NO_OFFSETS("xxac");
+
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+    { // Match offsets of the empty string
+        const char *Regex = "a*";
+        auto FindStart = (dfreOffset)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartOptions);
+        auto FindEnd = (dfreOffset)CompileRegex(Regex, UseDFA, &CodeSize, FindEndOptions);
+
+        EXPECT_OFFSETS("", 0, 0);
+        EXPECT_OFFSETS("bbb", 0, 0);
+        EXPECT_OFFSETS("aab", 0, 2);
+
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+    { // Match offsets with the states on the stack and a jump table
+        const char *Regex = "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+                            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+                            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)+";
+        auto FindStart = (dfreOffset)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartOptions);
+        auto FindEnd = (dfreOffset)CompileRegex(Regex, UseDFA, &CodeSize, FindEndOptions);
+
+        EXPECT_OFFSETS("foo", 0, 3);
+        EXPECT_OFFSETS("xx alphabeta yy", 3, 12);
+        EXPECT_OFFSETS("omeg omegaa", 5, 10);
+
+        EXPECT_NO_OFFSETS("");
+        EXPECT_NO_OFFSETS("omeg alph");
+
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+
+    codegen_options Counted = {};
+    Counted.Counted = true;
+    { // Length delimited input
+        const char *Regex = "a.b*";
+        auto MatchCounted = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &CodeSize, Counted);
+
+        EXPECT_MATCH_COUNTED("ax");
+        EXPECT_MATCH_COUNTED("a\0");
+        EXPECT_MATCH_COUNTED("a\0bb");
+
+        EXPECT_NO_MATCH_COUNTED("");
+        EXPECT_NO_MATCH_COUNTED("a");
+        EXPECT_NO_MATCH_COUNTED("a\0b\0");
+        EXPECT_NO_MATCH_COUNTED("\0ab");
+        // Stops at the length, not the NUL
+        if (!MatchCounted((const uint8_t *)"axbbbc", 5) || MatchCounted((const uint8_t *)"axbbbc", 6)) {
+            T->Failed = true;
+            Print("FAIL counted match read past the end. %s:%u\n", __FILE__, __LINE__);
+        }
+
+        Free((void*)MatchCounted, CodeSize);
+    }
+    { // Length delimited input with a jump table and the states on the stack
+        const char *Regex = "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+                            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+                            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega|.)+";
+        auto MatchCounted = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &CodeSize, Counted);
+
+        EXPECT_MATCH_COUNTED("foo");
+        EXPECT_MATCH_COUNTED("foo\0omega");
+        EXPECT_MATCH_COUNTED("\0");
+
+        EXPECT_NO_MATCH_COUNTED("");
+
+        Free((void*)MatchCounted, CodeSize);
+    }
+    { // Linear patterns step with one shift, with and without a jump table
+        EXPECT_SHIFT_AND("abc", true);
+        EXPECT_SHIFT_AND("a.c[0-9]x", true);
+        EXPECT_SHIFT_AND("a|b", true);
+        EXPECT_SHIFT_AND("(abc)d", true); // The paren states are removed
+        EXPECT_SHIFT_AND("ab*c", false);
+        EXPECT_SHIFT_AND("abcdefghijklmnopqrstuvwxyz0123456789", false); // Too many states
+
+        const char *Regex = "q[0-9]x.yzw[a-c]";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("q5x!yzwb");
+        EXPECT_NO_MATCH("q5x!yzw");
+        EXPECT_NO_MATCH("q5x!yzwbb");
+        EXPECT_NO_MATCH("qqx!yzwb");
+        Free((void*)Match, CodeSize);
+
+        codegen_options Unanchored = {};
+        Unanchored.Unanchored = true;
+        Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        EXPECT_MATCH("qq5x!yzwb");
+        EXPECT_MATCH("q1xq2x.yzwcc");
+        EXPECT_NO_MATCH("q5x!yzw q5x!yzwd");
+        Free((void*)Match, CodeSize);
+
+        auto FindStart = (dfreOffset)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartOptions);
+        auto FindEnd = (dfreOffset)CompileRegex(Regex, UseDFA, &CodeSize, FindEndOptions);
+        EXPECT_OFFSETS("--q1xq2x.yzwcc", 5, 13);
+        EXPECT_NO_OFFSETS("q2x.yzw");
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+    { // Renumbered states, shifting the arcs to the next state on the stack
+        EXPECT_CHAINED_ARCS("(ab)cd", 4);
+        EXPECT_CHAINED_ARCS("(ab|cd)ef", 4);
+
+        const char *Regex = "(a[0-9]..................................b|c)+";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("a0abcdefghijklmnopqrstuvwxyz01234567b");
+        EXPECT_MATCH("ca9..................................bc");
+
+        EXPECT_NO_MATCH("a0abcdefghijklmnopqrstuvwxyz0123456b");
+        EXPECT_NO_MATCH("a0abcdefghijklmnopqrstuvwxyz012345678b");
+        EXPECT_NO_MATCH("aaabcdefghijklmnopqrstuvwxyz01234567b");
+        Free((void*)Match, CodeSize);
+    }
+    { // Minimized NFAs, without the states for parens and alternations
+        EXPECT_NFA_STATES("((a))b", 4);
+        EXPECT_NFA_STATES("(ab|cd)ef", 7);
+        EXPECT_NFA_STATES("(a|b)*abb", 7);
+        EXPECT_NFA_STATES("[0-9]+(\\.[0-9]*)?", 6);
+        EXPECT_NFA_STATES("x(ab|ac)*y", 7); // Both a arcs merge into one
+
+        const char *Regex = "x(ab|ac)*y";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("xy");
+        EXPECT_MATCH("xaby");
+        EXPECT_MATCH("xabacaby");
+
+        EXPECT_NO_MATCH("x");
+        EXPECT_NO_MATCH("xay");
+        EXPECT_NO_MATCH("xaay");
+        EXPECT_NO_MATCH("xabcy");
+        Free((void*)Match, CodeSize);
+
+        Regex = "(a*)*(b|)(b|)c";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("c");
+        EXPECT_MATCH("aabc");
+        EXPECT_MATCH("abbc");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("abbbc");
+        EXPECT_NO_MATCH("bac");
+        Free((void*)Match, CodeSize);
+    }
+    { // Bounded repetition, expanded into copies of the atom or counted when long
+        EXPECT_NFA_STATES("a{32}", 34);
+        EXPECT_NFA_STATES("a{33}", 4);
+        EXPECT_NFA_STATES("(a){40}", 42); // Groups are always expanded
+        EXPECT_MAX_INSTRUCTIONS("[0-9]{1,500}", 300);
+        EXPECT_MAX_INSTRUCTIONS("x[0-9]{1,300}y", 450);
+        // Counters always use the jump table, with 256 entries
+        EXPECT_MAX_INSTRUCTIONS("a{1000}", 350);
+
+        EXPECT_REGEX_ERROR("a{5,2}");
+        EXPECT_REGEX_ERROR("a{1001}");
+        EXPECT_REGEX_ERROR("a{1,1001}");
+        EXPECT_REGEX_ERROR("a{99999999999}");
+        EXPECT_REGEX_ERROR("{3}");
+        EXPECT_REGEX_ERROR("(|{3})");
+        EXPECT_REGEX_ERROR("a*{2}");
+        EXPECT_REGEX_ERROR("a{2}{2}");
+        // Nested repetitions multiply, counters too
+        EXPECT_REGEX_ERROR("(a{100}){100}");
+        EXPECT_REGEX_ERROR("(a{100}){33}");
+        EXPECT_REGEX_ERROR("(a{40,50}){17}");
+        EXPECT_REGEX_ERROR("((a{10}){10}){100}");
+
+        const char *Regex = "(ab){2,3}c";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("ababc");
+        EXPECT_MATCH("abababc");
+
+        EXPECT_NO_MATCH("abc");
+        EXPECT_NO_MATCH("ababababc");
+        EXPECT_NO_MATCH("ababac");
+        Free((void*)Match, CodeSize);
+
+        Regex = "a{2,}b{0}c{0,1}d{1}";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("aad");
+        EXPECT_MATCH("aaaaacd");
+
+        EXPECT_NO_MATCH("ad");
+        EXPECT_NO_MATCH("aabd");
+        EXPECT_NO_MATCH("aaccd");
+        Free((void*)Match, CodeSize);
+
+        // Braces that aren't a repetition are literal chars
+        Regex = "a{|b{x}|c{,2}|d{2";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("a{");
+        EXPECT_MATCH("b{x}");
+        EXPECT_MATCH("c{,2}");
+        EXPECT_MATCH("d{2");
+
+        EXPECT_NO_MATCH("a");
+        EXPECT_NO_MATCH("dd");
+        Free((void*)Match, CodeSize);
+
+        Regex = "[0-9]{1,3}\\.[0-9]{1,3}";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("1.2");
+        EXPECT_MATCH("123.456");
+
+        EXPECT_NO_MATCH("1234.5");
+        EXPECT_NO_MATCH("1.");
+        EXPECT_NO_MATCH("12.3456");
+        Free((void*)Match, CodeSize);
+
+        // Long enough to need many dwords of states
+        Regex = "x[0-9]{1,300}y";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("x0y");
+        EXPECT_MATCH("x0123456789012345678901234567890123456789y");
+
+        EXPECT_NO_MATCH("xy");
+        EXPECT_NO_MATCH("x01234567890123456789a123y");
+        Free((void*)Match, CodeSize);
+
+        codegen_options Unanchored = {};
+        Unanchored.Unanchored = true;
+        Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        EXPECT_MATCH("--x12x345y--");
+        EXPECT_MATCH("xx0yy");
+
+        EXPECT_NO_MATCH("xy x1 2y");
+        Free((void*)Match, CodeSize);
+
+        // Groups near the limits, which grow the NFA's arena a lot while
+        // adding the arcs
+        char Str[1500] = {};
+        Regex = "(a|b){1,1000}";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        for (uint32_t i = 0; i < 1000; ++i) {
+            Str[i] = (i % 3 == 0) ? 'b' : 'a';
+        }
+        EXPECT_MATCH(Str);
+        EXPECT_MATCH("ab");
+        Str[1000] = 'a';
+        EXPECT_NO_MATCH(Str);
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("abc");
+        Free((void*)Match, CodeSize);
+
+        Regex = "(ab){1,700}c";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        for (uint32_t i = 0; i < 1400; ++i) {
+            Str[i] = (i % 2 == 0) ? 'a' : 'b';
+        }
+        Str[1400] = 'c';
+        Str[1401] = '\0';
+        EXPECT_MATCH(Str);
+        EXPECT_MATCH("abc");
+        Str[1398] = 'c';
+        Str[1399] = '\0';
+        EXPECT_MATCH(Str);
+        Str[1398] = 'a';
+        Str[1399] = 'b';
+        Str[1400] = 'a';
+        Str[1401] = 'b';
+        Str[1402] = 'c';
+        EXPECT_NO_MATCH(Str);
+        EXPECT_NO_MATCH("c");
+        Free((void*)Match, CodeSize);
+
+        Regex = "((ab){10}c){40}";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        for (uint32_t i = 0; i < 40; ++i) {
+            for (uint32_t j = 0; j < 10; ++j) {
+                Str[21*i + 2*j] = 'a';
+                Str[21*i + 2*j + 1] = 'b';
+            }
+            Str[21*i + 20] = 'c';
+        }
+        Str[21*40] = '\0';
+        EXPECT_MATCH(Str);
+        Str[21*39] = '\0';
+        EXPECT_NO_MATCH(Str);
+        Free((void*)Match, CodeSize);
+
+        // The most counters there can be, one in each copy
+        char LongStr[3300] = {};
+        Regex = "(a{100}){32}";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        for (uint32_t i = 0; i < 3200; ++i) {
+            LongStr[i] = 'a';
+        }
+        EXPECT_MATCH(LongStr);
+        LongStr[3200] = 'a';
+        EXPECT_NO_MATCH(LongStr);
+        LongStr[3199] = '\0';
+        EXPECT_NO_MATCH(LongStr);
+        Free((void*)Match, CodeSize);
+    }
+    { // Counted repetitions, see nfa_counter
+        char Str[200] = {};
+        const char *Regex = "a{40}";
+        auto Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        for (uint32_t i = 0; i < 41; ++i) {
+            Str[i] = 'a';
+        }
+        EXPECT_NO_MATCH(Str);
+        Str[40] = '\0';
+        EXPECT_MATCH(Str);
+        Str[39] = '\0';
+        EXPECT_NO_MATCH(Str);
+        Str[20] = 'b';
+        Str[39] = 'a';
+        EXPECT_NO_MATCH(Str);
+        EXPECT_NO_MATCH("");
+        Free((void*)Match, CodeSize);
+
+        // A *+? after a counted repetition repeats all of it
+        for (uint32_t i = 0; i < 80; ++i) {
+            Str[i] = 'a';
+        }
+        Regex = "a{40}*";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH(Str);
+        EXPECT_MATCH(Str + 40);
+        EXPECT_MATCH("");
+        EXPECT_NO_MATCH(Str + 1);
+        EXPECT_NO_MATCH(Str + 41);
+        EXPECT_NO_MATCH("b");
+        Free((void*)Match, CodeSize);
+
+        Regex = "a{40}+";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH(Str);
+        EXPECT_MATCH(Str + 40);
+        EXPECT_NO_MATCH(Str + 1);
+        EXPECT_NO_MATCH(Str + 41);
+        EXPECT_NO_MATCH("");
+        Free((void*)Match, CodeSize);
+
+        Regex = "a{40}?b";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        Str[80] = 'b';
+        EXPECT_MATCH(Str + 40);
+        EXPECT_MATCH(Str + 80);
+        EXPECT_NO_MATCH(Str + 41);
+        EXPECT_NO_MATCH(Str);
+        Str[80] = '\0';
+        Free((void*)Match, CodeSize);
+
+        Regex = "x[0-9]{1,500}*y";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("xy");
+        EXPECT_MATCH("x0123456789y");
+
+        EXPECT_NO_MATCH("x01a23y");
+        EXPECT_NO_MATCH("x0123");
+        Free((void*)Match, CodeSize);
+
+        Regex = "x[0-9]{5,40}y";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("x01234y");
+        EXPECT_MATCH("x0123456789012345678901234567890123456789y");
+
+        EXPECT_NO_MATCH("x0123y");
+        EXPECT_NO_MATCH("x01234567890123456789012345678901234567890y");
+        EXPECT_NO_MATCH("x01234567890123456789a123y");
+        EXPECT_NO_MATCH("xy");
+        Free((void*)Match, CodeSize);
+
+        Regex = "[ab]{0,40}c|a{35,}b";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize);
+        EXPECT_MATCH("c");
+        EXPECT_MATCH("ababc");
+        EXPECT_MATCH("abababababababababababababababababababac");
+        EXPECT_MATCH("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab");
+        EXPECT_MATCH("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab");
+
+        EXPECT_NO_MATCH("aababababababababababababababababababababc");
+        EXPECT_NO_MATCH("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab");
+        EXPECT_NO_MATCH("cc");
+        Free((void*)Match, CodeSize);
+
+        // Runs that overlap, where the counter keeps track of every one
+        codegen_options Unanchored = {};
+        Unanchored.Unanchored = true;
+        Regex = "a{33}b";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        for (uint32_t i = 0; i < 100; ++i) {
+            Str[i] = 'a';
+        }
+        Str[100] = 'b';
+        EXPECT_MATCH(Str);
+        EXPECT_NO_MATCH("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab");
+        EXPECT_NO_MATCH("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+        Free((void*)Match, CodeSize);
+
+        Regex = "x.{35}y";
+        Match = CompileRegex(Regex, UseDFA, &CodeSize, Unanchored);
+        EXPECT_MATCH("--xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxyy");
+        EXPECT_MATCH("x0123456789x0123456789x0123456789012y");
+        EXPECT_MATCH("x0123456789012345678901234567890123yy");
+
+        EXPECT_NO_MATCH("x0123456789012345678901234567890123y");
+        EXPECT_NO_MATCH("x01234567890123456789012345678901234--y");
+        Free((void*)Match, CodeSize);
+
+        // Reversed for the start of the match
+        size_t StartCodeSize;
+        codegen_options FindStartOptions = {};
+        FindStartOptions.Unanchored = true;
+        FindStartOptions.ReturnOffset = true;
+        FindStartOptions.Reverse = true;
+        codegen_options FindEndOptions = {};
+        FindEndOptions.ReturnOffset = true;
+        Regex = "ba{33,40}|c.{35}c";
+        auto FindStart = (dfreOffset)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartOptions);
+        auto FindEnd = (dfreOffset)CompileRegex(Regex, UseDFA, &CodeSize, FindEndOptions);
+        EXPECT_OFFSETS("xbaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 1, 42);
+        EXPECT_OFFSETS("--bbaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaax", 3, 37);
+        EXPECT_OFFSETS("ccccccccccccccccccccccccccccccccccccccccc", 0, 37);
+
+        EXPECT_NO_OFFSETS("baaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa");
+        EXPECT_NO_OFFSETS("cccccccccccccccccccccccccccccccccccc");
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+    { // Match offsets of length delimited input
+        const char *Regex = "ab+c|b";
+        codegen_options FindStartCounted = FindStartOptions;
+        FindStartCounted.Counted = true;
+        codegen_options FindEndCounted = FindEndOptions;
+        FindEndCounted.Counted = true;
+        auto FindStart = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &StartCodeSize, FindStartCounted);
+        auto FindEnd = (dfreMatchCounted)(void*)CompileRegex(Regex, UseDFA, &CodeSize, FindEndCounted);
+
+        const uint8_t Str[] = "x\0abbcb\0b";
+        uint32_t Start = FindStart(Str, 7);
+        uint32_t End = Start + FindEnd(Str + Start, 7 - Start);
+        uint32_t LastStart = FindStart(Str, sizeof(Str) - 1);
+        uint32_t NoStart = FindStart(Str, 2);
+        if (Start != 2 || End != 6 || LastStart != 2 || NoStart != DFRE_NO_MATCH) {
+            T->Failed = true;
+            Print("FAIL counted offsets for regex %s were %u to %u, %u, %u. %s:%u\n",
+                  Regex, Start, End, LastStart, NoStart, __FILE__, __LINE__);
+        }
+
+        Free((void*)FindStart, StartCodeSize);
+        Free((void*)FindEnd, CodeSize);
+    }
+
+    { // Streaming in chunks
+        const char *Regex = "(ab)*c";
+        codegen_options StreamOptions = {};
+        StreamOptions.Stream = true;
+        auto Feed = (dfreStreamFeed)(void*)CompileRegex(Regex, UseDFA, &CodeSize, StreamOptions);
+        uint32_t ContextMemory[8];
+        stream_context *Context = (stream_context *)ContextMemory;
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"aba", 3);
+        Feed(Context, (const uint8_t *)"", 0);
+        Feed(Context, (const uint8_t *)"b", 1);
+        bool Matched = (Feed(Context, (const uint8_t *)"c", 1) != 0) && StreamEnd(Feed, Context);
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"ab", 2);
+        bool Partial = StreamEnd(Feed, Context);
+
+        StreamBegin(Context);
+        bool Empty = StreamEnd(Feed, Context);
+
+        if (!Matched || Partial || Empty) {
+            T->Failed = true;
+            Print("FAIL streaming regex %s gave %u %u %u. %s:%u\n",
+                  Regex, Matched, Partial, Empty, __FILE__, __LINE__);
+        }
+
+        Free((void*)Feed, CodeSize);
+    }
+    { // Unanchored streaming with the states on the stack
+        const char *Regex = "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+                            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+                            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)!";
+        codegen_options StreamOptions = {};
+        StreamOptions.Stream = true;
+        StreamOptions.Unanchored = true;
+        auto Feed = (dfreStreamFeed)(void*)CompileRegex(Regex, UseDFA, &CodeSize, StreamOptions);
+        uint32_t ContextMemory[64];
+        stream_context *Context = (stream_context *)ContextMemory;
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"xx om", 5);
+        Feed(Context, (const uint8_t *)"eg", 2);
+        Feed(Context, (const uint8_t *)"a!", 2);
+        Feed(Context, (const uint8_t *)"zz", 2);
+        bool Matched = StreamEnd(Feed, Context);
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"omeg", 4);
+        Feed(Context, (const uint8_t *)"!a!", 3);
+        bool NotMatched = StreamEnd(Feed, Context);
+
+        if (!Matched || NotMatched) {
+            T->Failed = true;
+            Print("FAIL streaming regex %s gave %u %u. %s:%u\n",
+                  Regex, Matched, NotMatched, __FILE__, __LINE__);
+        }
+
+        Free((void*)Feed, CodeSize);
+    }
+    { // Streaming with counters, which keep counting across chunks
+        const char *Regex = "x.{35}y|a{2,40}b";
+        codegen_options StreamOptions = {};
+        StreamOptions.Stream = true;
+        StreamOptions.Unanchored = true;
+        auto Feed = (dfreStreamFeed)(void*)CompileRegex(Regex, UseDFA, &CodeSize, StreamOptions);
+        uint32_t ContextMemory[64];
+        stream_context *Context = (stream_context *)ContextMemory;
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"--x01234567890123", 17);
+        Feed(Context, (const uint8_t *)"45678901234567890123", 20);
+        Feed(Context, (const uint8_t *)"4y-", 3);
+        bool Matched = StreamEnd(Feed, Context);
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"aaaaaaaaaaaaaaaaaaaa", 20);
+        Feed(Context, (const uint8_t *)"aaaaaaaaaaaaaaaaaaaa", 20);
+        Feed(Context, (const uint8_t *)"ab", 2);
+        bool MatchedRun = StreamEnd(Feed, Context);
+
+        StreamBegin(Context);
+        Feed(Context, (const uint8_t *)"x01234567890123", 15);
+        Feed(Context, (const uint8_t *)"45678901234567890123", 20);
+        Feed(Context, (const uint8_t *)"y-ab", 4);
+        bool NotMatched = StreamEnd(Feed, Context);
+
+        if (!Matched || !MatchedRun || NotMatched) {
+            T->Failed = true;
+            Print("FAIL streaming regex %s gave %u %u %u. %s:%u\n",
+                  Regex, Matched, MatchedRun, NotMatched, __FILE__, __LINE__);
+        }
+
+        Free((void*)Feed, CodeSize);
+    }
+
+    { // Caller provided scratch memory, with and without the states in
+      // registers, and with counters
+        const char *Regexes[] = {
+            "(ab)*c",
+            "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)!",
+            "x.{35}y",
+        };
+        const char *Matches[] = { "ababc", "omega!", "x01234567890123456789012345678901234y" };
+        const char *NonMatches[] = { "abab", "omega", "x0123456789012345678901234567890123y" };
+        uint8_t ScratchMemory[1024 + XMM_TO_BYTES];
+        uint8_t *Scratch = (uint8_t *)(((size_t)ScratchMemory + XMM_TO_BYTES - 1) & ~(size_t)(XMM_TO_BYTES - 1));
+        for (size_t i = 0; i < 1024; ++i) {
+            Scratch[i] = 0;
+        }
+        for (size_t RegexIdx = 0; RegexIdx < ArrayLength(Regexes); ++RegexIdx) {
+            const char *Regex = Regexes[RegexIdx];
+            for (int Unanchored = 0; Unanchored < 2; ++Unanchored) {
+                codegen_options ScratchOptions = {};
+                ScratchOptions.CallerScratch = true;
+                ScratchOptions.Unanchored = (Unanchored != 0);
+                auto MatchScratch = (dfreMatchScratch)(void*)CompileRegex(Regex, UseDFA, &CodeSize, ScratchOptions);
+
+                // Alternate so a dirty buffer would show up as a wrong answer
+                bool Correct = true;
+                for (int Round = 0; Round < 3; ++Round) {
+                    Correct = Correct && MatchScratch(Scratch, Matches[RegexIdx]);
+                    Correct = Correct && !MatchScratch(Scratch, NonMatches[RegexIdx]);
+                    Correct = Correct && !MatchScratch(Scratch, "");
+                }
+                bool Clean = true;
+                for (size_t i = 0; i < 1024; ++i) {
+                    Clean = Clean && (Scratch[i] == 0);
+                }
+                if (!Correct || !Clean) {
+                    T->Failed = true;
+                    Print("FAIL scratch memory regex %s (unanchored: %u) correct: %u, clean: %u. %s:%u\n",
+                          Regex, Unanchored, Correct, Clean, __FILE__, __LINE__);
+                }
+
+                Free((void*)MatchScratch, CodeSize);
+            }
+        }
+    }
+
+    { // Matching a set of regexes at once
+        const char *Regexes[] = { "abc", "a.*", "b+", "(x|y)z" };
+        codegen_options SetOptions = {};
+        SetOptions.MatchSet = true;
+        auto MatchSet = (dfreMatchSet)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, SetOptions);
+        EXPECT_SET_MATCHES("abc", 0x3);
+        EXPECT_SET_MATCHES("abd", 0x2);
+        EXPECT_SET_MATCHES("bbb", 0x4);
+        EXPECT_SET_MATCHES("yz", 0x8);
+        EXPECT_SET_MATCHES("xabc", 0);
+        EXPECT_SET_MATCHES("", 0);
+        Free((void*)MatchSet, CodeSize);
+
+        SetOptions.Unanchored = true;
+        MatchSet = (dfreMatchSet)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, SetOptions);
+        EXPECT_SET_MATCHES("xxabcxx", 0x7);
+        EXPECT_SET_MATCHES("yzb", 0xC);
+        EXPECT_SET_MATCHES("a", 0x2);
+        EXPECT_SET_MATCHES("qqq", 0);
+        EXPECT_SET_MATCHES("", 0);
+        Free((void*)MatchSet, CodeSize);
+    }
+    { // Matching a set of regexes with counters
+        const char *Regexes[] = { "a{40}", "[0-9a]{5,40}", "x.{33,}y" };
+        codegen_options SetOptions = {};
+        SetOptions.MatchSet = true;
+        auto MatchSet = (dfreMatchSet)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, SetOptions);
+        EXPECT_SET_MATCHES("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0x3);
+        EXPECT_SET_MATCHES("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0x2);
+        EXPECT_SET_MATCHES("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", 0);
+        EXPECT_SET_MATCHES("x012345678901234567890123456789012y", 0x4);
+        EXPECT_SET_MATCHES("x01234567890123456789012345678901y", 0);
+        Free((void*)MatchSet, CodeSize);
+
+        SetOptions.Unanchored = true;
+        MatchSet = (dfreMatchSet)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, SetOptions);
+        EXPECT_SET_MATCHES("--aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa--", 0x3);
+        EXPECT_SET_MATCHES("x01234567890123456789012345678901234567890123456789y", 0x6);
+        EXPECT_SET_MATCHES("aaaa", 0);
+        Free((void*)MatchSet, CodeSize);
+
+        mem_arena ArenaA = ArenaInit();
+        const char *TooMany[] = { "(a{40}){20}", "(b{40}){13}" };
+        const char *Error = 0;
+        if (RegexSetToNFA(TooMany, ArrayLength(TooMany), &ArenaA, &Error) || !Error) {
+            T->Failed = true;
+            Print("FAIL regex set with 33 counters was parsed without an error. %s:%u\n",
+                  __FILE__, __LINE__);
+        }
+        ArenaFree(&ArenaA);
+    }
+    { // More regexes than fit in one dword, with the states on the stack
+        const char *Regexes[] = {
+            "foo", "bar", "baz", "qux", "quux", "corge", "grault", "garply", "waldo",
+            "fred", "plugh", "xyzzy", "thud", "alpha", "beta", "gamma", "delta",
+            "epsilon", "zeta", "eta", "theta", "iota", "kappa", "lambda", "mu", "nu",
+            "xi", "omicron", "pi", "rho", "sigma", "tau", "upsilon", "phi", "chi",
+            "psi", "omega", "[0-9]+",
+        };
+        const uint32_t NumRegexes = ArrayLength(Regexes);
+        const char *Regex = "{foo, bar, ..., omega, [0-9]+}";
+        for (int Unanchored = 0; Unanchored < 2; ++Unanchored) {
+            codegen_options SetOptions = {};
+            SetOptions.MatchSet = true;
+            SetOptions.Unanchored = (Unanchored != 0);
+            auto MatchSet = (dfreMatchSet)(void*)CompileRegexSet(Regexes, NumRegexes, UseDFA, &CodeSize, SetOptions);
+
+            uint32_t Omega[2] = {};
+            uint32_t Many[2] = {};
+            uint32_t None[2] = { 0xFFFFFFFF, 0xFFFFFFFF };
+            bool OmegaMatched = (MatchSet(Omega, "omega") != 0);
+            bool ManyMatched = (MatchSet(Many, "beta 42 omega") != 0);
+            bool NoneMatched = (MatchSet(None, "?") != 0);
+
+            // omega is regex 36, beta is 14 (with eta, 19), and [0-9]+ is 37
+            uint32_t ExpectMany[2] = {};
+            if (Unanchored) {
+                ExpectMany[0] = (1u << 14) | (1u << 19);
+                ExpectMany[1] = (1u << (36 - 32)) | (1u << (37 - 32));
+            }
+            if (!OmegaMatched || Omega[0] != 0 || Omega[1] != (1u << (36 - 32)) ||
+                ManyMatched != (Unanchored != 0) ||
+                Many[0] != ExpectMany[0] || Many[1] != ExpectMany[1] ||
+                NoneMatched || None[0] != 0 || None[1] != 0)
+            {
+                T->Failed = true;
+                Print("FAIL regex set %s (unanchored: %u) gave %x %x, %x %x, %x %x. %s:%u\n",
+                      Regex, Unanchored, Omega[0], Omega[1], Many[0], Many[1],
+                      None[0], None[1], __FILE__, __LINE__);
+            }
+
+            Free((void*)MatchSet, CodeSize);
+        }
+    }
+
+    { // Scanning tokens with the longest match, earlier regexes win ties
+        const char *Regexes[] = { "if", "[a-z]+", "[0-9]+", " +" };
+        codegen_options ScanOptions = {};
+        ScanOptions.ReturnToken = true;
+        ScanOptions.Counted = true;
+        auto Scan = (dfreScan)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, ScanOptions);
+
+        const char Str[] = "if x1  iffy 42";
+        uint32_t Pos = 0;
+        EXPECT_TOKEN(Str, Pos, 0, 2);
+        EXPECT_TOKEN(Str, Pos, 3, 1);
+        EXPECT_TOKEN(Str, Pos, 1, 1);
+        EXPECT_TOKEN(Str, Pos, 2, 1);
+        EXPECT_TOKEN(Str, Pos, 3, 2);
+        EXPECT_TOKEN(Str, Pos, 1, 4);
+        EXPECT_TOKEN(Str, Pos, 3, 1);
+        EXPECT_TOKEN(Str, Pos, 2, 2);
+
+        uint32_t Token = 1234;
+        uint32_t End = Scan(&Token, (const uint8_t *)Str + Pos, 0);
+        uint32_t Bad = Scan(&Token, (const uint8_t *)"?", 1);
+        if (End != DFRE_NO_MATCH || Bad != DFRE_NO_MATCH || Token != 1234) {
+            T->Failed = true;
+            Print("FAIL scanning no token gave %u %u %u. %s:%u\n",
+                  End, Bad, Token, __FILE__, __LINE__);
+        }
+
+        Free((void*)Scan, CodeSize);
+    }
+    { // Scanning with more regexes than fit in one dword
+        const char *Regexes[] = {
+            "foo", "bar", "baz", "qux", "quux", "corge", "grault", "garply", "waldo",
+            "fred", "plugh", "xyzzy", "thud", "alpha", "beta", "gamma", "delta",
+            "epsilon", "zeta", "eta", "theta", "iota", "kappa", "lambda", "mu", "nu",
+            "xi", "omicron", "pi", "rho", "sigma", "tau", "upsilon", "phi", "chi",
+            "psi", "omega", "[a-z]+", ",",
+        };
+        codegen_options ScanOptions = {};
+        ScanOptions.ReturnToken = true;
+        ScanOptions.Counted = true;
+        auto Scan = (dfreScan)(void*)CompileRegexSet(Regexes, ArrayLength(Regexes), UseDFA, &CodeSize, ScanOptions);
+
+        const char Str[] = "omega,omegas,foo,eta";
+        uint32_t Pos = 0;
+        EXPECT_TOKEN(Str, Pos, 36, 5);
+        EXPECT_TOKEN(Str, Pos, 38, 1);
+        EXPECT_TOKEN(Str, Pos, 37, 6);
+        EXPECT_TOKEN(Str, Pos, 38, 1);
+        EXPECT_TOKEN(Str, Pos, 0, 3);
+        EXPECT_TOKEN(Str, Pos, 38, 1);
+        EXPECT_TOKEN(Str, Pos, 19, 3);
+
+        Free((void*)Scan, CodeSize);
+    }
+
+    { // Matching a batch of strings at once
+        const char *Regexes[] = {
+            "(ab)*c",
+            "(foo|bar|baz|qux|quux|corge|grault|garply|waldo|fred|plugh|xyzzy|thud|"
+            "alpha|beta|gamma|delta|epsilon|zeta|eta|theta|iota|kappa|lambda|mu|nu|"
+            "xi|omicron|pi|rho|sigma|tau|upsilon|phi|chi|psi|omega)!",
+            "[a-z]{3,40}!",
+        };
+        const char Data[] = "ababc" "omega!" "ab" "" "omeg\0a!" "c" "xxomega!!" "zzabc";
+        const uint32_t Offsets[] = { 0, 5, 11, 13, 13, 20, 21, 30, 35 };
+        const uint32_t NumStrings = ArrayLength(Offsets) - 1;
+        // For each regex, anchored then unanchored
+        const uint32_t Expected[3][2] = {
+            { (1u << 0) | (1u << 5), (1u << 0) | (1u << 5) | (1u << 7) },
+            { (1u << 1), (1u << 1) | (1u << 6) },
+            { (1u << 1), (1u << 1) | (1u << 6) },
+        };
+        // The first regex is small enough for the SIMD lanes, the others fall
+        // back (the last one because of its counter)
+        for (size_t RegexIdx = 0; RegexIdx < ArrayLength(Regexes); ++RegexIdx) {
+            const char *Regex = Regexes[RegexIdx];
+            for (int Unanchored = 0; Unanchored < 2; ++Unanchored) {
+                for (int UseLanes = 0; UseLanes < 2; ++UseLanes) {
+                    codegen_options BatchOptions = {};
+                    BatchOptions.Batch = true;
+                    BatchOptions.Unanchored = (Unanchored != 0);
+                    auto MatchBatch = (dfreMatchBatch)(void*)CompileRegex(Regex, UseDFA, &CodeSize, BatchOptions,
+                                                                          UseLanes != 0);
+
+                    uint32_t Results = 0xFFFFFFFF; // Only the first NumStrings bits get written
+                    uint32_t NumMatched = MatchBatch(&Results, Offsets, (const uint8_t *)Data, NumStrings);
+                    uint32_t Want = Expected[RegexIdx][Unanchored];
+                    uint32_t WantCount = 0;
+                    for (uint32_t i = 0; i < NumStrings; ++i) {
+                        WantCount += (Want >> i) & 1;
+                    }
+                    // Leave the last group of lanes partly empty
+                    uint32_t FewerResults = 0;
+                    uint32_t FewerMatched = MatchBatch(&FewerResults, Offsets, (const uint8_t *)Data, NumStrings - 1);
+                    uint32_t FewerWant = Want & ((1u << (NumStrings - 1)) - 1);
+                    uint32_t NoResults = 0x1234;
+                    uint32_t NoneMatched = MatchBatch(&NoResults, Offsets, (const uint8_t *)Data, 0);
+                    if (Results != (Want | ~((1u << NumStrings) - 1)) ||
+                        NumMatched != WantCount || NoneMatched != 0 || NoResults != 0x1234 ||
+                        FewerResults != FewerWant || FewerMatched != WantCount - ((Want >> (NumStrings - 1)) & 1))
+                    {
+                        T->Failed = true;
+                        Print("FAIL batch regex %s (unanchored: %u, lanes: %u) gave %x with %u matches instead of %x. %s:%u\n",
+                              Regex, Unanchored, UseLanes, Results, NumMatched, Want, __FILE__, __LINE__);
+                    }
+
+                    Free((void*)MatchBatch, CodeSize);
+                }
+            }
+        }
+    }
 }
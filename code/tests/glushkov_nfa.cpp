@@ -0,0 +1,130 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+#include "utils.h"
+#include "print.h"
+#include "mem_arena.h"
+
+// Uses EXPECT_MATCH and EXPECT_NO_MATCH from tests/end_to_end.cpp
+
+dfreMatch CompileGlushkovRegex(const char *Regex, bool UseDFA, size_t *CodeSize,
+                               codegen_options Options = {}) {
+    static mem_arena ArenaA = ArenaInit();
+    static mem_arena ArenaB = ArenaInit();
+
+    nfa *NFA = RegexToGlushkovNFA(Regex, &ArenaA);
+    return CompileTestNFA(NFA, &ArenaA, &ArenaB, UseDFA, CodeSize, Options);
+}
+
+#define EXPECT_GLUSHKOV_STATES(regex, states, epsilons) do { \
+   nfa *NFA = RegexToGlushkovNFA((regex), &Arena); \
+   if (NFA->NumStates != (states) || NFAFirstArcList(NFA)->NumTransitions != (epsilons)) { \
+       T->Failed = true; \
+       Print("FAIL regex %s has %u states and %u epsilon arcs instead of %u and %u. %s:%u\n", \
+             (regex), NFA->NumStates, NFAFirstArcList(NFA)->NumTransitions, \
+             (states), (epsilons), __FILE__, __LINE__); \
+   } \
+   Arena.Used = 0; \
+} while(false)
+
+void glushkov_RunTests(tester_state *T, bool UseDFA) {
+    mem_arena Arena = ArenaInit();
+    size_t CodeSize;
+
+    // One state per position, plus accept and start
+    EXPECT_GLUSHKOV_STATES("test", 6, 0);
+    EXPECT_GLUSHKOV_STATES("(a|b)*abb", 7, 0);
+    EXPECT_GLUSHKOV_STATES("[a-z]+\\.(com|net)", 10, 0);
+    EXPECT_GLUSHKOV_STATES("a*", 3, 1);
+    EXPECT_GLUSHKOV_STATES("", 2, 1);
+    EXPECT_GLUSHKOV_STATES("abcdefghijklmnopqrstuvwxyz0123456789x*", 39, 0); // 2 set dwords
+
+    // Every copy can follow every one before it, so the arcs grow with the
+    // square of the copies
+    if (RegexToGlushkovNFA("(a*b*){1,300}", &Arena) || RegexToGlushkovNFA("a{5,2}", &Arena) ||
+        RegexToGlushkovNFA("b?b*|.*((a)*[a-c]|[bc]*|a*|([a-b]cb*|c*.|.{4,6}.+|.|.)*"
+                           "[a-c]c*[a-c]){35}a+c|bc{3,4}c*", &Arena)) {
+        T->Failed = true;
+        Print("FAIL regex was too big or invalid for the Glushkov NFA but had no error. %s:%u\n",
+              __FILE__, __LINE__);
+    }
+    EXPECT_GLUSHKOV_STATES("(a|b){1,1000}", 2002, 0);
+
+    {
+        const char *Regex = "(a|b)*abb";
+        auto Match = CompileGlushkovRegex(Regex, UseDFA, &CodeSize);
+
+        EXPECT_MATCH("abb");
+        EXPECT_MATCH("aabb");
+        EXPECT_MATCH("babababb");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("ab");
+        EXPECT_NO_MATCH("abba");
+        EXPECT_NO_MATCH("abbb");
+
+        Free((void*)Match, CodeSize);
+    }
+    { // Nullable parts at the start and end of concatenations
+        const char *Regex = "a?(b|)c*(d?e?)";
+        auto Match = CompileGlushkovRegex(Regex, UseDFA, &CodeSize);
+
+        EXPECT_MATCH("");
+        EXPECT_MATCH("a");
+        EXPECT_MATCH("b");
+        EXPECT_MATCH("ccc");
+        EXPECT_MATCH("abcde");
+        EXPECT_MATCH("ae");
+        EXPECT_MATCH("bd");
+
+        EXPECT_NO_MATCH("ba");
+        EXPECT_NO_MATCH("ed");
+        EXPECT_NO_MATCH("cb");
+        EXPECT_NO_MATCH("abcdef");
+
+        Free((void*)Match, CodeSize);
+    }
+
+    // Every string has to match the same as the Thompson NFA
+    const char *Regexes[] = {
+        "test",
+        "ab*",
+        "a+b?|c",
+        "(ab|cd)+e",
+        "((a|b)*c)+",
+        "(a*)*b",
+        "x(a|)*y",
+        "[0-9]+(\\.[0-9]*)?",
+        ".*abc.*",
+        "a.c|[a-c]+",
+        "\\*\\(|\\)+",
+        "(((a)))|((b)c)",
+        "(ab|c){1,3}d|a{2,}",
+    };
+    const char *Strings[] = {
+        "", "a", "b", "c", "ab", "abb", "test", "tes", "abe", "cde", "ababcde",
+        "aabc", "abcc", "c", "bbc", "cabcc", "b", "aab", "xy", "xaaay", "x",
+        "42", "3.", "3.14", ".5", "1.2.3", "abc", "zzabczz", "ac", "azc",
+        "*(", ")))", "*", "a", "bc", "abcd",
+        "cd", "aaa", "abccd", "ababcd",
+    };
+    for (size_t RegexIdx = 0; RegexIdx < ArrayLength(Regexes); ++RegexIdx) {
+        const char *Regex = Regexes[RegexIdx];
+        size_t ThompsonCodeSize;
+        auto Thompson = CompileRegex(Regex, UseDFA, &ThompsonCodeSize);
+        auto Glushkov = CompileGlushkovRegex(Regex, UseDFA, &CodeSize);
+        for (size_t StrIdx = 0; StrIdx < ArrayLength(Strings); ++StrIdx) {
+            const char *Str = Strings[StrIdx];
+            const bool Expected = (Thompson(Str) != 0);
+            if ((Glushkov(Str) != 0) != Expected) {
+                T->Failed = true;
+                Print("FAIL \"%s\" %s regex %s with the Glushkov NFA. %s:%u\n", Str,
+                      Expected ? "did not match" : "matched", Regex, __FILE__, __LINE__);
+            }
+        }
+        Free((void*)Thompson, ThompsonCodeSize);
+        Free((void*)Glushkov, CodeSize);
+    }
+
+    ArenaFree(&Arena);
+}
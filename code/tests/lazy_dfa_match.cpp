@@ -0,0 +1,133 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+#include "lazy_dfa.cpp"
+
+#include "utils.h"
+#include "print.h"
+#include "mem_arena.h"
+
+// Uses EXPECT_MATCH and EXPECT_NO_MATCH from tests/end_to_end.cpp
+
+void lazy_dfa_RunTests(tester_state *T) {
+    mem_arena Arena = ArenaInit();
+    mem_arena DFAArena = ArenaInit(); // Not the NFA's, see LazyDFAInit
+
+    {
+        const char *Regex = "(ab)*|[3-7.]+\\**|(ggg|9)*";
+        nfa *NFA = RegexToNFA(Regex, &Arena);
+        lazy_dfa DFA = LazyDFAInit(NFA, &DFAArena, LAZY_DFA_DEFAULT_MEMORY_CAP);
+        auto Match = [&](const char *Str) { return LazyDFAMatch(&DFA, Str); };
+
+        EXPECT_MATCH("");
+        EXPECT_MATCH("ababab");
+        EXPECT_MATCH("3....7");
+        EXPECT_MATCH("34********");
+        EXPECT_MATCH("gggggg9ggg9999ggg");
+
+        EXPECT_NO_MATCH("aba");
+        EXPECT_NO_MATCH("ab5");
+        EXPECT_NO_MATCH("****");
+        EXPECT_NO_MATCH("gg");
+        EXPECT_NO_MATCH("\n");
+
+        // Matching the same strings again only uses cached transitions
+        size_t NumCachedStates = DFA.NumCachedStates;
+        EXPECT_MATCH("ababab");
+        EXPECT_NO_MATCH("ab5");
+        if (DFA.NumCachedStates != NumCachedStates) {
+            T->Failed = true;
+            Print("FAIL lazy DFA added states for input it has already seen. %s:%u\n",
+                  __FILE__, __LINE__);
+        }
+
+        LazyDFAFree(&DFA);
+        Arena.Used = 0;
+        DFAArena.Used = 0;
+    }
+    { // Cache only fits a few states, so it has to flush while matching
+        const char *Regex = "(a|b)*a(a|b)(a|b)(a|b)";
+        nfa *NFA = RegexToNFA(Regex, &Arena);
+        size_t StateSize = sizeof(lazy_dfa_state) + (NFANumStateDwords(NFA) - 1) * sizeof(uint32_t);
+        lazy_dfa DFA = LazyDFAInit(NFA, &DFAArena, 4 * StateSize);
+        auto Match = [&](const char *Str) { return LazyDFAMatch(&DFA, Str); };
+
+        EXPECT_MATCH("abbb");
+        EXPECT_MATCH("bbbbaaaa");
+        EXPECT_MATCH("abababaaba");
+        EXPECT_MATCH("babbbbbbbbbbbaabb");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("bbbb");
+        EXPECT_NO_MATCH("aaabbbb");
+        EXPECT_NO_MATCH("abababbbbb");
+        EXPECT_NO_MATCH("abac");
+
+        if (DFA.NumFlushes == 0) {
+            T->Failed = true;
+            Print("FAIL lazy DFA cache never flushed with a %u byte cap. %s:%u\n",
+                  DFA.MemoryCap, __FILE__, __LINE__);
+        }
+
+        LazyDFAFree(&DFA);
+        Arena.Used = 0;
+        DFAArena.Used = 0;
+    }
+
+    { // Cache can't fit two states, so it's an error instead of failing later
+        nfa *NFA = RegexToNFA("(a|b)*abb", &Arena);
+        size_t StateSize = sizeof(lazy_dfa_state) + (NFANumStateDwords(NFA) - 1) * sizeof(uint32_t);
+        lazy_dfa DFA = LazyDFAInit(NFA, &DFAArena, StateSize);
+        if (DFA.Cache.Base) {
+            T->Failed = true;
+            Print("FAIL lazy DFA accepted a %u byte cap. %s:%u\n",
+                  DFA.MemoryCap, __FILE__, __LINE__);
+            LazyDFAFree(&DFA);
+        }
+        Arena.Used = 0;
+        DFAArena.Used = 0;
+    }
+
+    { // Unanchored search
+        const char *Regex = "ab+c";
+        nfa *NFA = RegexToNFA(Regex, &Arena);
+        lazy_dfa DFA = LazyDFAInit(NFA, &DFAArena, LAZY_DFA_DEFAULT_MEMORY_CAP, true);
+        auto Match = [&](const char *Str) { return LazyDFAMatch(&DFA, Str); };
+
+        EXPECT_MATCH("abc");
+        EXPECT_MATCH("xxabbbc");
+        EXPECT_MATCH("aababcab");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("abbx");
+        EXPECT_NO_MATCH("xxab");
+
+        LazyDFAFree(&DFA);
+        Arena.Used = 0;
+        DFAArena.Used = 0;
+    }
+
+    { // Big enough that the closures grow the arena a lot
+        const char *Regex = "(a{30}){100}";
+        nfa *NFA = RegexToNFA(Regex, &Arena);
+        lazy_dfa DFA = LazyDFAInit(NFA, &DFAArena, LAZY_DFA_DEFAULT_MEMORY_CAP);
+        auto Match = [&](const char *Str) { return LazyDFAMatch(&DFA, Str); };
+
+        char Str[3002] = {};
+        for (uint32_t i = 0; i < 3000; ++i) {
+            Str[i] = 'a';
+        }
+        EXPECT_MATCH(Str);
+        Str[3000] = 'a';
+        EXPECT_NO_MATCH(Str);
+        Str[2999] = '\0';
+        EXPECT_NO_MATCH(Str);
+
+        LazyDFAFree(&DFA);
+        Arena.Used = 0;
+        DFAArena.Used = 0;
+    }
+
+    ArenaFree(&Arena);
+    ArenaFree(&DFAArena);
+}
@@ -0,0 +1,79 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+#include "literal_search.cpp"
+
+#include "utils.h"
+#include "print.h"
+#include "mem_arena.h"
+
+// Uses EXPECT_MATCH and EXPECT_NO_MATCH from tests/end_to_end.cpp, and
+// EXPECT_MATCH_COUNTED and EXPECT_NO_MATCH_COUNTED
+
+void literal_search_RunTests(tester_state *T) {
+    mem_arena Arena = ArenaInit();
+
+    {
+        const char *Regex = "a\\*b";
+        literal_search LS = LiteralSearchInit(Regex, &Arena);
+        auto Match = [&](const char *Str) { return LiteralSearchMatch(&LS, Str); };
+
+        EXPECT_MATCH("a*b");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("a*");
+        EXPECT_NO_MATCH("a*bb");
+        EXPECT_NO_MATCH("xa*b");
+        EXPECT_NO_MATCH("aab");
+
+        Arena.Used = 0;
+    }
+    { // Unanchored search, with chars that repeat in the literal
+        const char *Regex = "abracadabra";
+        literal_search LS = LiteralSearchInit(Regex, &Arena, true);
+        auto Match = [&](const char *Str) { return LiteralSearchMatch(&LS, Str); };
+        auto MatchCounted = [&](const uint8_t *Ptr, size_t Len) {
+            return LiteralSearchMatchCounted(&LS, Ptr, Len);
+        };
+
+        EXPECT_MATCH("abracadabra");
+        EXPECT_MATCH("abracadabracadabra");
+        EXPECT_MATCH("xxabracadabrx abracadabra");
+        EXPECT_MATCH("aaaaaaaaaaabracadabraaaaaaaa");
+
+        EXPECT_NO_MATCH("");
+        EXPECT_NO_MATCH("abracadabr");
+        EXPECT_NO_MATCH("bracadabra");
+        EXPECT_NO_MATCH("abracadabbra abracad abra");
+
+        EXPECT_MATCH_COUNTED("\0abracadabra\0");
+        EXPECT_NO_MATCH_COUNTED("abracadab\0ra");
+
+        Arena.Used = 0;
+    }
+    { // Every position, and cut off before the end
+        const char *Regex = "needle";
+        literal_search LS = LiteralSearchInit(Regex, &Arena, true);
+
+        char Str[64];
+        for (uint32_t Pad = 0; Pad < 40; ++Pad) {
+            for (uint32_t i = 0; i < Pad; ++i) {
+                Str[i] = "edlneedl "[i % 9];
+            }
+            for (uint32_t i = 0; i <= 6; ++i) {
+                Str[Pad + i] = Regex[i];
+            }
+            const bool Found = LiteralSearchMatch(&LS, Str);
+            const bool FoundCut = LiteralSearchMatchCounted(&LS, (const uint8_t *)Str, Pad + 5);
+            if (!Found || FoundCut) {
+                T->Failed = true;
+                Print("FAIL regex %s after %u chars: %u %u. %s:%u\n", Regex, Pad,
+                      Found, FoundCut, __FILE__, __LINE__);
+            }
+        }
+
+        Arena.Used = 0;
+    }
+
+    ArenaFree(&Arena);
+}
@@ -24,6 +24,10 @@ struct tester_state {
 
 #include "tests/x86_opcode.cpp"
 #include "tests/end_to_end.cpp"
+#include "tests/glushkov_nfa.cpp"
+#include "tests/lazy_dfa_match.cpp"
+#include "tests/aho_corasick_match.cpp"
+#include "tests/literal_search_match.cpp"
 
 int main(int argc, char *argv[]) {
     tester_state T = {};
@@ -32,7 +36,19 @@ int main(int argc, char *argv[]) {
     Print("Running opcode tests.\n");
     x86_opcode_RunTests(&T);
     Print("Running end-to-end regex tests.\n");
-    end_to_end_RunTests(&T);
+    end_to_end_RunTests(&T, false);
+    Print("Running end-to-end regex tests with the DFA code.\n");
+    end_to_end_RunTests(&T, true);
+    Print("Running Glushkov NFA tests.\n");
+    glushkov_RunTests(&T, false);
+    Print("Running Glushkov NFA tests with the DFA code.\n");
+    glushkov_RunTests(&T, true);
+    Print("Running lazy DFA tests.\n");
+    lazy_dfa_RunTests(&T);
+    Print("Running Aho-Corasick tests.\n");
+    aho_corasick_RunTests(&T);
+    Print("Running literal search tests.\n");
+    literal_search_RunTests(&T);
 
     if (T.Failed) {
         Print("At least one test failed.\n");
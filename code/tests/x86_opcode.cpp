@@ -257,6 +257,8 @@ void TestOpRegReg(tester_state *T) {
             {RR32(AND , REG, EAX, EAX, 0), WantOp(0x21, 0xC0)},
             {RR32(OR  , REG, EAX, EAX, 0), WantOp(0x09, 0xC0)},
             {RR32(XOR , REG, EAX, EAX, 0), WantOp(0x31, 0xC0)},
+            {RR32(ADD , REG, EAX, EAX, 0), WantOp(0x01, 0xC0)},
+            {RR32(SUB , REG, EAX, EAX, 0), WantOp(0x29, 0xC0)},
             {RR32(CMP , REG, EAX, EAX, 0), WantOp(0x39, 0xC0)},
             {RR32(MOV , REG, EAX, EAX, 0), WantOp(0x89, 0xC0)},
             {RR32(MOVR, MEM, EAX, EAX, 0), WantOp(0x8B, 0x00)}, // MEM To see if its actually reversed
@@ -464,6 +466,7 @@ void TestOpRegImm(tester_state *T) {
     {
         opcode_case Cases[] = {
             {RI8(BT , REG, EAX, /*disp*/0, /*imm*/0x88), WantOp(0x0F, 0xBA, 0xE0, 0x88)}, // Note the register is still tested as 32 bits, but imm can only be 8 bits
+            {RI8(BT , REG, ESI, /*disp*/0, /*imm*/0x1F), WantOp(0x0F, 0xBA, 0xE6, 0x1F)}, // So ESI and EDI are allowed
             {RI8(AND, REG, EAX, /*disp*/0, /*imm*/0x88), WantOp(0x80, 0xE0, 0x88)},
             {RI8(XOR, REG, EBX, /*disp*/0, /*imm*/0x3C), WantOp(0x80, 0xF3, 0x3C)},
             {RI8(CMP, REG, ECX, /*disp*/0, /*imm*/0x12), WantOp(0x80, 0xF9, 0x12)},
@@ -530,6 +533,10 @@ void TestOpJump(tester_state *T) {
             {JD(JNE, /*instrIdx=*/1), WantOp(0x75, 0xFA)},
             {JD(JL , /*instrIdx=*/0), WantOp(0x7C, 0xF6)},
             {JD(JG , /*instrIdx=*/3), WantOp(0x7F, 0xFA)},
+            {JD(JB , /*instrIdx=*/6), WantOp(0x72, 0xFE)},
+            {JD(JBE, /*instrIdx=*/9), WantOp(0x76, 0x02)},
+            {JD(JA , /*instrIdx=*/9), WantOp(0x77, 0x00)},
+            {JD(JAE, /*instrIdx=*/0), WantOp(0x73, 0xEC)},
         };
         TestOpcodes(T, "OpJump8(..) - All 8 bit jumps with offset", 0, Cases, ArrayLength(Cases));
     }
@@ -562,10 +569,75 @@ void TestOpJump(tester_state *T) {
     // Note the J(..) macro isn't tested because it is just JD but with 0 offset (for filling later)
 }
 
+void TestJumpTable(tester_state *T) {
+    {
+        opcode_case Cases[] = {
+            {RR32(MOVZX, MEM      , EBX, EAX, 0),                WantOp(0x0F, 0xB6, 0x03)},
+            {RR32(MOVZX, MEM_DISP8, ESP, ECX, 4),                WantOp(0x0F, 0xB6, 0x4C, 0x24, 0x04)},
+            {RRS32(MOVR, MEM      , ESI, EAX, EAX, 4, 0),        WantOp(0x8B, 0x04, 0x86)},
+            {RRS32(MOVR, MEM      , EBP, EDX, ECX, 1, 0),        WantOp(0x8B, 0x54, 0x0D, 0x00)}, // [EBP] needs a displacement
+            {RRS32(MOV , MEM_DISP8, EBX, ECX, EDI, 8, 0x10),     WantOp(0x89, 0x4C, 0xFB, 0x10)},
+            {RRS32(ADD , MEM_DISP32, EAX, EAX, ESI, 2, 0x100),   WantOp(0x01, 0x84, 0x70, 0x00, 0x01, 0x00, 0x00)},
+            {R32(JMPI  , REG      , EAX, 0),                     WantOp(0xFF, 0xE0)},
+            {R32(JMPI  , MEM      , ESI, 0),                     WantOp(0xFF, 0x26)},
+        };
+        TestOpcodes(T, "Jump table support - MOVZX, scaled index, JMPI", 0, Cases, ArrayLength(Cases));
+    }
+    {
+        opcode_case Cases[] = {
+            {JD(CALL, /*instrIdx=*/4),            WantOp(0xE8, 0x0C, 0x00, 0x00, 0x00)}, // Always 32 bit
+            {DATA32(/*destIdx=*/4, /*baseIdx=*/1), WantOp(0x0C, 0x00, 0x00, 0x00)},
+            {DATA32(/*destIdx=*/1, /*baseIdx=*/1), WantOp(0x00, 0x00, 0x00, 0x00)},
+            {DATA32(/*destIdx=*/0, /*baseIdx=*/1), WantOp(0xFB, 0xFF, 0xFF, 0xFF)},
+            {RET, WantOp(0xC3)},
+        };
+        TestOpcodes(T, "CALL and DATA32 - Offsets for jump tables", 0, Cases, ArrayLength(Cases));
+    }
+    {
+        opcode_case Cases[] = {
+            {RR32(BSF, REG      , EAX, EAX, 0), WantOp(0x0F, 0xBC, 0xC0)},
+            {RR32(BSF, REG      , ESI, ECX, 0), WantOp(0x0F, 0xBC, 0xCE)},
+            {RR32(BSF, MEM_DISP8, ESP, EDX, 8), WantOp(0x0F, 0xBC, 0x54, 0x24, 0x08)},
+            {RR32(BTS, MEM      , EAX, EDX, 0), WantOp(0x0F, 0xAB, 0x10)},
+            {RR32(BTS, REG      , ECX, EBX, 0), WantOp(0x0F, 0xAB, 0xD9)},
+            {RR32(BTR, MEM      , EAX, EDX, 0), WantOp(0x0F, 0xB3, 0x10)},
+            {RR32(BTR, MEM_DISP8, EBP, ESI, 4), WantOp(0x0F, 0xB3, 0x75, 0x04)},
+        };
+        TestOpcodes(T, "BSF, BTS, BTR - Bit scan and bit string ops", 0, Cases, ArrayLength(Cases));
+    }
+}
+
+void TestOpXmm(tester_state *T) {
+    {
+        opcode_case Cases[] = {
+            {RX(MOVDQA  , MEM_DISP8 , ESP , XMM1, 0x10),  WantOp(0x66, 0x0F, 0x7F, 0x4C, 0x24, 0x10)},
+            {RX(MOVDQAR , MEM       , EAX , XMM0, 0),     WantOp(0x66, 0x0F, 0x6F, 0x00)},
+            {RX(MOVDQU  , MEM_DISP32, EBP , XMM7, 0x100), WantOp(0xF3, 0x0F, 0x7F, 0xBD, 0x00, 0x01, 0x00, 0x00)},
+            {RX(MOVDQUR , MEM       , EBP , XMM2, 0),     WantOp(0xF3, 0x0F, 0x6F, 0x55, 0x00)}, // [EBP] needs a displacement
+            {RX(PAND    , REG       , XMM1, XMM2, 0),     WantOp(0x66, 0x0F, 0xDB, 0xD1)},
+            {RX(POR     , REG       , XMM3, XMM0, 0),     WantOp(0x66, 0x0F, 0xEB, 0xC3)},
+            {RX(PXOR    , REG       , XMM0, XMM0, 0),     WantOp(0x66, 0x0F, 0xEF, 0xC0)},
+            {RX(PCMPEQB , MEM       , EBX , XMM5, 0),     WantOp(0x66, 0x0F, 0x74, 0x2B)},
+            {RX(PCMPEQD , MEM_DISP32, ESP , XMM3, 0x120), WantOp(0x66, 0x0F, 0x76, 0x9C, 0x24, 0x20, 0x01, 0x00, 0x00)},
+            {RX(PCMPEQD , REG       , XMM2, XMM4, 0),     WantOp(0x66, 0x0F, 0x76, 0xE2)},
+            {RX(MOVDQAR , REG       , XMM1, XMM0, 0),     WantOp(0x66, 0x0F, 0x6F, 0xC1)},
+            {RX(PMOVMSKB, REG       , XMM1, EAX , 0),     WantOp(0x66, 0x0F, 0xD7, 0xC1)},
+            {RX(PSHUFB  , REG       , XMM3, XMM4, 0),     WantOp(0x66, 0x0F, 0x38, 0x00, 0xE3)},
+            {RX(PSHUFB  , MEM_DISP8 , ESP , XMM1, 0x20),  WantOp(0x66, 0x0F, 0x38, 0x00, 0x4C, 0x24, 0x20)},
+            {RXI(PSRLW  , XMM3, 4),                       WantOp(0x66, 0x0F, 0x71, 0xD3, 0x04)},
+            {RXI(PSRLDQ , XMM5, 14),                      WantOp(0x66, 0x0F, 0x73, 0xDD, 0x0E)},
+            {RXI(PSLLDQ , XMM4, 2),                       WantOp(0x66, 0x0F, 0x73, 0xFC, 0x02)},
+        };
+        TestOpcodes(T, "OpXmm(..) - SSE2 and SSSE3 ops", 0, Cases, ArrayLength(Cases));
+    }
+}
+
 void x86_opcode_RunTests(tester_state *T) {
     TestOpNoarg(T);
     TestOpReg(T);
     TestOpRegReg(T);
     TestOpRegImm(T);
     TestOpJump(T);
+    TestJumpTable(T);
+    TestOpXmm(T);
 }
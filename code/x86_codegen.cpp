@@ -2,44 +2,140 @@
 // Provided under the MIT License: https://mit-license.org
 
 #include "nfa.h"
+#include "nfa_passes.h"
 #include "x86_opcode.h"
 
 #define DWORD_TO_BYTES 4
+#define XMM_TO_BYTES 16
 
-void NFASortArcList(nfa_arc_list *ArcList) {
+// When the NFA has at most 32 states the state bitsets fit in one register
+// each, so the generated loop never has to touch the stack
+#define ACTIVE_STATES_REG ESI
+#define CURRENT_ENABLES_REG EDI
+
+// When checking the labels would take at least this many compares, we dispatch
+// on the byte class of the character with a jump table instead
+#define JUMP_TABLE_MIN_COMPARES 4
+
+void NFASortTransitions(nfa_transition *Transitions, size_t NumTransitions) {
     // TODO(fsmv): Replace with radix sort or something
     for (size_t ATransitionIdx = 0;
-         ATransitionIdx < ArcList->NumTransitions;
+         ATransitionIdx < NumTransitions;
          ++ATransitionIdx)
     {
         for (size_t BTransitionIdx = ATransitionIdx + 1;
-             BTransitionIdx < ArcList->NumTransitions;
+             BTransitionIdx < NumTransitions;
              ++BTransitionIdx)
         {
-            if (ArcList->Transitions[ATransitionIdx].From >
-                ArcList->Transitions[BTransitionIdx].From)
+            if (Transitions[ATransitionIdx].From >
+                Transitions[BTransitionIdx].From)
             {
-                nfa_transition Temp = ArcList->Transitions[ATransitionIdx];
-                ArcList->Transitions[ATransitionIdx] = 
-                    ArcList->Transitions[BTransitionIdx];
-                ArcList->Transitions[BTransitionIdx] = Temp;
+                nfa_transition Temp = Transitions[ATransitionIdx];
+                Transitions[ATransitionIdx] = 
+                    Transitions[BTransitionIdx];
+                Transitions[BTransitionIdx] = Temp;
             }
         }
     }
 }
 
+/**
+ * Where code generated with Stream keeps the active states between chunks.
+ *
+ * The caller owns it and it has to be StreamContextSize bytes. The states are
+ * copied in and out of it once per chunk, so the loop is the same as for one
+ * shot matching.
+ */
+struct stream_context {
+    uint32_t Started; // 0 until the first chunk, see StreamBegin
+    // We allocate extra space at the end of the struct for this array, the
+    // same size as the state bitsets and counter rings in the generated code
+    uint32_t States[1];
+};
+#define STREAM_STATES_OFFSET 4
+
+// Returned by code generated with ReturnOffset when the accept state was
+// never active
+#define DFRE_NO_MATCH ((uint32_t) -1)
+
+// Options for the generated code, shared by all of the code generators.
+// Zero initialized means the defaults.
+struct codegen_options {
+  // Return 1 as soon as any substring of the input is in the language, instead
+  // of only when the whole string is
+  bool Unanchored;
+  // Instead of returning 0 or 1, keep going to the end of the string (or until
+  // nothing is active) and return the offset in the string where we were the
+  // last time the accept state was active, or DFRE_NO_MATCH. Without
+  // Unanchored that's the end of the longest match of a prefix of the string.
+  bool ReturnOffset;
+  // Read the string from the end back to the start, for NFAs made with
+  // NFAReverse. The offset returned is of the last char consumed, so with
+  // Unanchored and ReturnOffset it's the start of the leftmost match.
+  bool Reverse;
+  // The generated function takes (const uint8_t *Ptr, size_t Len) instead of
+  // a NUL terminated string (see dfreMatchCounted), and NUL is a normal char
+  bool Counted;
+  // Match a stream one chunk at a time, see StreamBegin. Implies Counted, and
+  // can't be used with ReturnOffset or Reverse.
+  bool Stream;
+  // The generated function takes a ScratchSize byte buffer for the state
+  // bitsets as its first argument (after the stream context), instead of
+  // making room on the stack on every call. See dfreMatchScratch.
+  bool CallerScratch;
+  // For an NFA from RegexSetToNFA. The generated function takes a bitmap with
+  // a bit for each regex as its first argument (after the scratch memory) and
+  // sets the bits of the ones that matched (see dfreMatchSet). With Unanchored,
+  // that's every regex that matched some substring. Can't be used with
+  // ReturnOffset, Reverse, or Stream.
+  bool MatchSet;
+  // For an NFA from RegexSetToNFA, to use it as a scanner. Like ReturnOffset,
+  // returns the length of the longest prefix of the string that any of the
+  // regexes match. Also writes the index of the first regex that matches that
+  // much of it to the first argument (after the scratch memory), so earlier
+  // regexes win ties. See dfreScan. Implies ReturnOffset, and can't be used
+  // with Unanchored, Reverse, Stream, or MatchSet.
+  bool ReturnToken;
+  // Match many strings in one call, with the states reset between them in the
+  // generated loop. The function takes a bitmap for the results as its first
+  // argument (after the scratch memory), then the strings packed the way
+  // Arrow does it. See dfreMatchBatch. Implies Counted, and can't be used with
+  // ReturnOffset, Reverse, Stream, MatchSet, or ReturnToken.
+  bool Batch;
+};
+
 struct GeneratedInstructions {
   instruction *Instructions;
   size_t Count;
 
   //private:
   mem_arena *Arena;
+  // Compile time only data (masks, closures, etc.), freed when done generating
+  mem_arena Scratch;
   uint32_t NumStateDwords;
+  uint32_t NumStateXmms;
+  bool StatesInRegisters; // See ACTIVE_STATES_REG
+  reg StatesBaseReg; // Points at the state bitsets when they aren't in registers
   uint32_t *ActivateMask;
+  uint32_t *EpsilonClosures;
+  // Room for every non-epsilon transition, for merging arc lists
+  nfa_transition *MergedTransitions;
+  uint8_t *ByteClass; // See NFAByteClasses
+  // Step with a shift instead of a test for each state, see ShiftAndFinalStates
+  bool ShiftAnd;
+  uint32_t ShiftAndFinal;
+  // States that activating doesn't activate anything else that matters, so
+  // arcs into them from the state before can be done with a shift. See
+  // NFAShiftTargets. NULL when we don't shift.
+  uint32_t *ShiftTargets;
+  uint32_t *ShiftMask; // The arcs being shifted, one bit per To state
+  int32_t CounterRings; // StatesBaseReg offset, see GenInstructionsCounter
 };
 
 instruction *NextInstr(GeneratedInstructions *ret) {
   instruction *Result = (instruction *)Alloc(ret->Arena, sizeof(instruction));
+  // The instructions are contiguous, but the arena may have moved to expand
+  ret->Instructions = Result - ret->Count;
   ret->Count += 1;
   return Result;
 }
@@ -47,10 +143,22 @@ instruction *NextInstr(GeneratedInstructions *ret) {
 void GenInstructionsTransitionSet(uint32_t FromState, GeneratedInstructions *ret) {
     // Note: bittest is weird. It takes a r/m32, imm8 argument. So we have to
     // use RI8 in this assembler API when it actually acts on a 32 bit dword.
-    const uint32_t ActivateMask = 0; // TODO: Maybe pass in the ActivateMask address
+    const int32_t ActiveStates = 0; // StatesBaseReg offsets, see GenerateInstructions
+    const int32_t CurrentEnables = ret->NumStateXmms * XMM_TO_BYTES;
     const int32_t FromDword = (FromState / 32);
     const uint8_t FromBit = FromState - (32*FromDword);
-    *NextInstr(ret) = RI8(BT, MEM_DISP32, EBP, ActivateMask - FromDword * DWORD_TO_BYTES, FromBit); // Check if DisableState is active
+    if (ret->StatesInRegisters) {
+        *NextInstr(ret) = RI8(BT, REG, ACTIVE_STATES_REG, 0, FromBit); // Check if DisableState is active
+        size_t Jump = ret->Count;
+        *NextInstr(ret) = J(JNC); // skip the following if it's not active
+        if (ret->ActivateMask[0] != 0) {
+            *NextInstr(ret) = RI32(OR, REG, CURRENT_ENABLES_REG, 0, ret->ActivateMask[0]);
+        }
+        ret->Instructions[Jump].JumpDestIdx = ret->Count;
+        return;
+    }
+
+    *NextInstr(ret) = RI8(BT, MEM_DISP32, ret->StatesBaseReg, ActiveStates + FromDword * DWORD_TO_BYTES, FromBit); // Check if DisableState is active
     size_t Jump = ret->Count;
     *NextInstr(ret) = J(JNC); // skip the following if it's not active
 
@@ -59,26 +167,313 @@ void GenInstructionsTransitionSet(uint32_t FromState, GeneratedInstructions *ret
         if (ret->ActivateMask[i] == 0) {
           continue; // We can skip or-ing with 0, the mask is always the same
         }
-        // Set EBP[CurrentEnables[i]] = ActivateMask[i]
-        *NextInstr(ret) = RI32(OR, MEM_DISP32, EBP, ActivateMask - (ret->NumStateDwords + i) * DWORD_TO_BYTES, ret->ActivateMask[i]);
+        // Set CurrentEnables[i] |= ActivateMask[i]
+        *NextInstr(ret) = RI32(OR, MEM_DISP32, ret->StatesBaseReg, CurrentEnables + i * DWORD_TO_BYTES, ret->ActivateMask[i]);
     }
 
     ret->Instructions[Jump].JumpDestIdx = ret->Count;
 }
 
-void GenInstructionsArcList(nfa_arc_list *ArcList, GeneratedInstructions *ret) {
-    NFASortArcList(ArcList);
+/**
+ * Check if every arc of the NFA goes from a state to the next one, so a step
+ * can be done with one shift for all of the states at once (Shift-And):
+ *
+ *     CurrentEnables |= (ActiveStates << 1) & Mask
+ *
+ * where Mask has the To state of every arc consuming the char. The masks come
+ * from the arcs being handled, so each case of the switch on the char just
+ * uses a different immediate.
+ *
+ * The epsilon closure of an arc's To state can only add the accept state, and
+ * then it has to for every arc into that To state. Those are the final states,
+ * put in ret->ShiftAndFinal, and reaching any of them sets the accept state.
+ * States that aren't live are ignored (see NFALiveStates).
+ *
+ * Needs ret->ByteClass, EpsilonClosures, and MergedTransitions, and the states
+ * have to fit in registers.
+ */
+bool ShiftAndFinalStates(nfa *NFA, uint32_t NumByteClasses, GeneratedInstructions *ret) {
+    if (!ret->StatesInRegisters || NFA->NumAcceptStates != 1) {
+        return false;
+    }
+    uint32_t Live;
+    NFALiveStates(NFA, &Live);
 
+    uint32_t Final = 0;
+    uint32_t NotFinal = 0;
+    for (uint32_t Class = 0; Class < NumByteClasses; ++Class) {
+        size_t FirstByte = 0;
+        while (ret->ByteClass[FirstByte] != Class) {
+            FirstByte += 1;
+        }
+        size_t NumTransitions = 0;
+        nfa_arc_list *ArcList = NFANextArcList(NFAFirstArcList(NFA));
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (LabelMatches(ArcList->Label, (char)FirstByte)) {
+                for (size_t TransitionIdx = 0;
+                     TransitionIdx < ArcList->NumTransitions;
+                     ++TransitionIdx)
+                {
+                    ret->MergedTransitions[NumTransitions++] = ArcList->Transitions[TransitionIdx];
+                }
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+        NFASortTransitions(ret->MergedTransitions, NumTransitions);
+
+        // Everything activated from each state, other than ignored states
+        size_t TransitionIdx = 0;
+        while (TransitionIdx < NumTransitions) {
+            const uint32_t From = ret->MergedTransitions[TransitionIdx].From;
+            uint32_t Activated = 0;
+            for (; TransitionIdx < NumTransitions &&
+                   ret->MergedTransitions[TransitionIdx].From == From;
+                 ++TransitionIdx)
+            {
+                const uint32_t To = ret->MergedTransitions[TransitionIdx].To;
+                Activated |= ret->EpsilonClosures[To] & (Live | (1 << To));
+            }
+            if (From == 31) {
+                return false;
+            }
+            const uint32_t Next = 1 << (From + 1);
+            if (Activated & ~(Next | (1 << NFA_ACCEPTSTATE))) {
+                return false;
+            }
+            if (Activated & (1 << NFA_ACCEPTSTATE)) {
+                if (!(Activated & Next)) {
+                    return false;
+                }
+                Final |= Next;
+            } else {
+                NotFinal |= Next;
+            }
+        }
+    }
+    if (Final & NotFinal) {
+        return false;
+    }
+    ret->ShiftAndFinal = Final;
+    return true;
+}
+
+/**
+ * Find the states where the arc into them from the state before can be done
+ * with a shift, even when the rest of the NFA can't (see ShiftAndFinalStates
+ * for when all of it can). Activating them can't activate any other live
+ * state, so it's just their bit.
+ *
+ * Targets is a bitset of NumStateDwords dwords. Needs ret->EpsilonClosures.
+ * Uses the ret->ShiftMask array as scratch space.
+ */
+void NFAShiftTargets(nfa *NFA, uint32_t *Targets, GeneratedInstructions *ret) {
+    const uint32_t NumStateDwords = ret->NumStateDwords;
+    uint32_t *Live = ret->ShiftMask;
+    NFALiveStates(NFA, Live);
+    for (uint32_t i = 0; i < NumStateDwords; ++i) {
+        Targets[i] = 0;
+    }
+    for (uint32_t State = 0; State < NFA->NumStates; ++State) {
+        const uint32_t *Closure = &ret->EpsilonClosures[State * NumStateDwords];
+        bool Target = true;
+        for (uint32_t i = 0; i < NumStateDwords; ++i) {
+            uint32_t Others = Closure[i] & Live[i];
+            if (i == State / 32) {
+                Others &= ~(1u << (State % 32));
+            }
+            if (Others != 0) {
+                Target = false;
+                break;
+            }
+        }
+        if (Target) {
+            StateSetAdd(Targets, State);
+        }
+    }
+}
+
+// Check if the arc is done by the shift GenInstructionsShiftArcs writes.
+// The shift doesn't carry between dwords, so the arc into the first state of
+// a dword is done with a test instead.
+inline bool IsShiftedArc(nfa_transition *Arc, GeneratedInstructions *ret) {
+    return ret->ShiftTargets && Arc->To == Arc->From + 1 && Arc->To % 32 != 0 &&
+           StateSetHas(ret->ShiftMask, Arc->To);
+}
+
+// Check if activating states A and B activates the same other states, from
+// their epsilon closures
+inline bool SameOtherStates(uint32_t A, uint32_t B, GeneratedInstructions *ret) {
+    const uint32_t *ClosureA = &ret->EpsilonClosures[A * ret->NumStateDwords];
+    const uint32_t *ClosureB = &ret->EpsilonClosures[B * ret->NumStateDwords];
+    for (uint32_t i = 0; i < ret->NumStateDwords; ++i) {
+        const uint32_t OthersA = (i == A / 32) ? (ClosureA[i] & ~(1u << (A % 32))) : ClosureA[i];
+        const uint32_t OthersB = (i == B / 32) ? (ClosureB[i] & ~(1u << (B % 32))) : ClosureB[i];
+        if (OthersA != OthersB) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ * Write a shift for the arcs that go to the next state in each dword of the
+ * state bitsets, when there's more than one of them in the dword:
+ *
+ *     CurrentEnables[i] |= (ActiveStates[i] << 1) & ShiftMask[i]
+ *
+ * The To states of the arcs have to be in ret->ShiftTargets, or be part of a
+ * group of more than one in the dword that activate the same other states.
+ * For each group, if any of its states were activated by the shift, the
+ * other states get activated too. That's how the optional copies of a {m,n}
+ * repetition are done, since the match can go on after any of them.
+ *
+ * Leaves the arcs it did in ret->ShiftMask, for IsShiftedArc.
+ */
+void GenInstructionsShiftArcs(nfa_transition *Transitions, size_t NumTransitions,
+                              GeneratedInstructions *ret)
+{
+    const int32_t ActiveStates = 0; // StatesBaseReg offsets, see GenerateInstructions
+    const int32_t CurrentEnables = ret->NumStateXmms * XMM_TO_BYTES;
+    uint32_t *ShiftMask = ret->ShiftMask;
+    for (uint32_t i = 0; i < ret->NumStateDwords; ++i) {
+        ShiftMask[i] = 0;
+    }
+    for (size_t TransitionIdx = 0; TransitionIdx < NumTransitions; ++TransitionIdx) {
+        nfa_transition *Arc = &Transitions[TransitionIdx];
+        if (Arc->To == Arc->From + 1 && Arc->To % 32 != 0) {
+            StateSetAdd(ShiftMask, Arc->To);
+        }
+    }
+    for (uint32_t i = 0; i < ret->NumStateDwords; ++i) {
+        // Split the rest up into groups that activate the same other states
+        uint32_t Groups[16];
+        uint32_t NumGroups = 0;
+        uint32_t Rest = ShiftMask[i] & ~ret->ShiftTargets[i];
+        ShiftMask[i] &= ret->ShiftTargets[i];
+        while (Rest != 0) {
+            uint32_t First = 0;
+            while (!(Rest & (1u << First))) {
+                First += 1;
+            }
+            uint32_t Group = 1u << First;
+            for (uint32_t Bit = First + 1; Bit < 32; ++Bit) {
+                if ((Rest & (1u << Bit)) && SameOtherStates(i*32 + First, i*32 + Bit, ret)) {
+                    Group |= 1u << Bit;
+                }
+            }
+            Rest &= ~Group;
+            if (Group & (Group - 1)) {
+                Groups[NumGroups++] = Group;
+                ShiftMask[i] |= Group;
+            }
+        }
+        // The test for one arc is just as short, and only runs when its from
+        // state is active
+        if ((ShiftMask[i] & (ShiftMask[i] - 1)) == 0) {
+            ShiftMask[i] = 0;
+            continue;
+        }
+        for (uint32_t GroupIdx = 0; GroupIdx <= NumGroups; ++GroupIdx) {
+            // The first time is the shift for all of them, which is still in
+            // eax for the first group
+            if (GroupIdx != 1) {
+                if (ret->StatesInRegisters) {
+                    *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+                } else {
+                    *NextInstr(ret) = RR32(MOVR, MEM_DISP32, ret->StatesBaseReg, EAX, ActiveStates + i*DWORD_TO_BYTES);
+                }
+                *NextInstr(ret) = RR32(ADD, REG, EAX, EAX, 0); // Shift left by 1
+            }
+            if (GroupIdx == 0) {
+                *NextInstr(ret) = RI32(AND, REG, EAX, 0, ShiftMask[i]);
+                if (ret->StatesInRegisters) {
+                    *NextInstr(ret) = RR32(OR, REG, CURRENT_ENABLES_REG, EAX, 0);
+                } else {
+                    *NextInstr(ret) = RR32(OR, MEM_DISP32, ret->StatesBaseReg, EAX, CurrentEnables + i*DWORD_TO_BYTES);
+                }
+                continue;
+            }
+            const uint32_t Group = Groups[GroupIdx - 1];
+            *NextInstr(ret) = RI32(AND, REG, EAX, 0, Group);
+            size_t JmpNone = ret->Count;
+            *NextInstr(ret) = J(JE);
+            uint32_t First = 0;
+            while (!(Group & (1u << First))) {
+                First += 1;
+            }
+            const uint32_t State = i*32 + First;
+            const uint32_t *Closure = &ret->EpsilonClosures[State * ret->NumStateDwords];
+            for (uint32_t j = 0; j < ret->NumStateDwords; ++j) {
+                const uint32_t Others = (j == i) ? (Closure[j] & ~(1u << First)) : Closure[j];
+                if (Others == 0) {
+                    continue;
+                }
+                if (ret->StatesInRegisters) {
+                    *NextInstr(ret) = RI32(OR, REG, CURRENT_ENABLES_REG, 0, Others);
+                } else {
+                    *NextInstr(ret) = RI32(OR, MEM_DISP32, ret->StatesBaseReg, CurrentEnables + j*DWORD_TO_BYTES, Others);
+                }
+            }
+            ret->Instructions[JmpNone].JumpDestIdx = ret->Count;
+        }
+    }
+}
+
+// Activate the To state of every arc from an active state at once. Only for
+// NFAs that ShiftAndFinalStates says are shiftable.
+void GenInstructionsShiftAnd(nfa_transition *Transitions, size_t NumTransitions,
+                             GeneratedInstructions *ret)
+{
+    uint32_t Mask = 0;
+    for (size_t TransitionIdx = 0; TransitionIdx < NumTransitions; ++TransitionIdx) {
+        if (Transitions[TransitionIdx].To != NFA_ACCEPTSTATE) { // See ShiftAndFinal
+            Mask |= 1 << Transitions[TransitionIdx].To;
+        }
+    }
+    if (Mask == 0) {
+        return;
+    }
+    *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+    *NextInstr(ret) = RR32(ADD, REG, EAX, EAX, 0); // Shift left by 1
+    *NextInstr(ret) = RI32(AND, REG, EAX, 0, Mask);
+    if ((Mask & ~ret->ShiftAndFinal) == 0) { // Anything activated is final
+        size_t JmpNone = ret->Count;
+        *NextInstr(ret) = J(JE);
+        *NextInstr(ret) = RI32(OR, REG, EAX, 0, 1 << NFA_ACCEPTSTATE);
+        *NextInstr(ret) = RR32(OR, REG, CURRENT_ENABLES_REG, EAX, 0);
+        ret->Instructions[JmpNone].JumpDestIdx = ret->Count;
+        return;
+    }
+    *NextInstr(ret) = RR32(OR, REG, CURRENT_ENABLES_REG, EAX, 0);
+    if (Mask & ret->ShiftAndFinal) {
+        *NextInstr(ret) = RI32(AND, REG, EAX, 0, ret->ShiftAndFinal);
+        size_t JmpNotFinal = ret->Count;
+        *NextInstr(ret) = J(JE);
+        *NextInstr(ret) = RI32(OR, REG, CURRENT_ENABLES_REG, 0, 1 << NFA_ACCEPTSTATE);
+        ret->Instructions[JmpNotFinal].JumpDestIdx = ret->Count;
+    }
+}
+
+// Transitions must be sorted by From
+void GenInstructionsTransitions(nfa_transition *Transitions, size_t NumTransitions,
+                                GeneratedInstructions *ret)
+{
+    if (ret->ShiftAnd) {
+        GenInstructionsShiftAnd(Transitions, NumTransitions, ret);
+        return;
+    }
+    if (ret->ShiftTargets) {
+        GenInstructionsShiftArcs(Transitions, NumTransitions, ret);
+    }
     uint32_t DisableState = (uint32_t) -1;
     for (size_t TransitionIdx = 0;
-         TransitionIdx < ArcList->NumTransitions;
+         TransitionIdx < NumTransitions;
          ++TransitionIdx)
     {
-        nfa_transition *Arc = &ArcList->Transitions[TransitionIdx];
-
-        // Calculate where to set the bit in the ActivateMask
-        const uint32_t ActivateDword = Arc->To / 32;
-        const uint32_t ActivateBit = 1 << (Arc->To - (ActivateDword*32));
+        nfa_transition *Arc = &Transitions[TransitionIdx];
+        if (IsShiftedArc(Arc, ret)) {
+            continue;
+        }
 
         if (Arc->From != DisableState) { // New from state
             // Write the transition set code at the end of each group of Arcs
@@ -93,7 +488,12 @@ void GenInstructionsArcList(nfa_arc_list *ArcList, GeneratedInstructions *ret) {
             }
             DisableState = Arc->From; // Remember which group we're working on
         }
-        ret->ActivateMask[ActivateDword] |= ActivateBit;
+        // Activate the To state and everything reachable from it by epsilon
+        // arcs, so we never have to follow epsilon arcs at runtime
+        uint32_t *Closure = &ret->EpsilonClosures[Arc->To * ret->NumStateDwords];
+        for (size_t i = 0; i < ret->NumStateDwords; ++i) {
+            ret->ActivateMask[i] |= Closure[i];
+        }
     }
 
     // Write the code for the last group of Arcs
@@ -102,184 +502,1151 @@ void GenInstructionsArcList(nfa_arc_list *ArcList, GeneratedInstructions *ret) {
     }
 }
 
+// The generated code keeps a dword for each counter (see nfa_counter) after the
+// state bits in both ActiveStates and CurrentEnables, so they're copied and
+// cleared with the states
+inline uint32_t NFANumStateXmms(nfa *NFA) {
+    return DivCeil(NFANumStateDwords(NFA) + (uint32_t)NFA->NumCounters, 4);
+}
+
+// Bits in the ring of a counter for exactly Min chars, see
+// GenInstructionsCounter. A power of 2, so it can be indexed with an AND.
+inline uint32_t CounterRingBits(nfa_counter *Counter) {
+    uint32_t Bits = 32;
+    while (Bits < Counter->Min) {
+        Bits *= 2;
+    }
+    return Bits;
+}
+
+// Bytes from the start of the rings to the ring of counter Idx, or the size
+// of all of them (padded to 16 bytes) for Idx == NFA->NumCounters
+uint32_t CounterRingOffset(nfa *NFA, size_t Idx) {
+    uint32_t Offset = 0;
+    for (size_t CounterIdx = 0; CounterIdx < Idx; ++CounterIdx) {
+        nfa_counter *Counter = &NFA->Counters[CounterIdx];
+        if (Counter->Min == Counter->Max) {
+            Offset += CounterRingBits(Counter) / 8;
+        }
+    }
+    if (Idx == NFA->NumCounters) {
+        Offset = DivCeil(Offset, XMM_TO_BYTES) * XMM_TO_BYTES;
+    }
+    return Offset;
+}
+
+/**
+ * Write the code for a counter (see nfa_counter) when Char matches its label.
+ * Its dword has the count of chars of the run it's keeping track of, or 0 if
+ * it isn't active, and a char either starts a new run from the entry state or
+ * adds to the old one.
+ *
+ * For 1 to Max chars, only the newest run matters, since it can go on the
+ * longest and any run from 1 to Max exits:
+ *
+ *     Count = Entry active ? 1 : (0 < Count < Max ? Count + 1 : 0)
+ *
+ * For exactly Min chars, every run that started in the last Min chars might
+ * exit later, so there's a ring of bits (at least Min) after CurrentEnables
+ * where bit (Count % Bits) is set when a run starts at that count. The count
+ * keeps going from the oldest run, and the run that started Min - 1 chars ago
+ * exits now if its bit was set. The count wraps from 2*Bits back to Bits, so
+ * it stays at least Min and the bits don't move.
+ *
+ * Uses EAX, which is free once the jump table has jumped to the code for Char.
+ */
+void GenInstructionsCounter(nfa *NFA, uint32_t CounterIdx, GeneratedInstructions *ret) {
+    nfa_counter *Counter = &NFA->Counters[CounterIdx];
+    const int32_t ActiveStates = 0; // StatesBaseReg offsets, see GenerateInstructions
+    const int32_t CurrentEnables = ret->NumStateXmms * XMM_TO_BYTES;
+    const int32_t Count = (ret->NumStateDwords + CounterIdx) * DWORD_TO_BYTES;
+    const reg Base = ret->StatesBaseReg;
+    const uint32_t Entry = NFACounterEntry(NFA, Counter->State);
+
+    *NextInstr(ret) = RR32(MOVR, MEM_DISP32, Base, EAX, ActiveStates + Count);
+    *NextInstr(ret) = RI8(BT, MEM_DISP32, Base, ActiveStates + (Entry / 32) * DWORD_TO_BYTES, Entry % 32);
+    size_t JmpToEnter = ret->Count;
+    *NextInstr(ret) = J(JB);
+    size_t JmpsToDone[3];
+    size_t NumJmpsToDone = 0;
+    if (Counter->Min != Counter->Max) {
+        *NextInstr(ret) = R32(DEC, REG, EAX, 0);
+        *NextInstr(ret) = RI32(CMP, REG, EAX, 0, Counter->Max - 1); // Was 0 or Max
+        JmpsToDone[NumJmpsToDone++] = ret->Count;
+        *NextInstr(ret) = J(JAE);
+        *NextInstr(ret) = RI32(ADD, REG, EAX, 0, 2);
+        size_t JmpToStore = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpToEnter].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RI32(MOV, REG, EAX, 0, 1);
+        ret->Instructions[JmpToStore].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(MOV, MEM_DISP32, Base, EAX, CurrentEnables + Count);
+    } else {
+        const uint32_t Bits = CounterRingBits(Counter);
+        const int32_t Ring = ret->CounterRings + CounterRingOffset(NFA, CounterIdx);
+        *NextInstr(ret) = RI32(CMP, REG, EAX, 0, 0);
+        JmpsToDone[NumJmpsToDone++] = ret->Count;
+        *NextInstr(ret) = J(JE);
+        // No run starts here, so clear its bit
+        *NextInstr(ret) = R32(INC, REG, EAX, 0);
+        *NextInstr(ret) = RR32(MOV, MEM_DISP32, Base, EAX, CurrentEnables + Count);
+        *NextInstr(ret) = RI32(AND, REG, EAX, 0, Bits - 1);
+        *NextInstr(ret) = RR32(BTR, MEM_DISP32, Base, EAX, Ring);
+        size_t JmpToCheck = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpToEnter].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = R32(INC, REG, EAX, 0);
+        *NextInstr(ret) = RR32(MOV, MEM_DISP32, Base, EAX, CurrentEnables + Count);
+        *NextInstr(ret) = RI32(AND, REG, EAX, 0, Bits - 1);
+        *NextInstr(ret) = RR32(BTS, MEM_DISP32, Base, EAX, Ring);
+        ret->Instructions[JmpToCheck].JumpDestIdx = ret->Count;
+
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP32, Base, EAX, CurrentEnables + Count);
+        *NextInstr(ret) = RI32(CMP, REG, EAX, 0, 2 * Bits);
+        size_t JmpNoWrap = ret->Count;
+        *NextInstr(ret) = J(JB);
+        *NextInstr(ret) = RI32(SUB, REG, EAX, 0, Bits);
+        *NextInstr(ret) = RR32(MOV, MEM_DISP32, Base, EAX, CurrentEnables + Count);
+        ret->Instructions[JmpNoWrap].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RI32(CMP, REG, EAX, 0, Counter->Min);
+        JmpsToDone[NumJmpsToDone++] = ret->Count;
+        *NextInstr(ret) = J(JB);
+        // The bit of the run that started Min - 1 chars ago. Nothing reads it
+        // again before it's written, so BTR is fine for testing it.
+        *NextInstr(ret) = RI32(SUB, REG, EAX, 0, Counter->Min - 1);
+        *NextInstr(ret) = RI32(AND, REG, EAX, 0, Bits - 1);
+        *NextInstr(ret) = RR32(BTR, MEM_DISP32, Base, EAX, Ring);
+        JmpsToDone[NumJmpsToDone++] = ret->Count;
+        *NextInstr(ret) = J(JAE);
+    }
+
+    // Activate what the counter exits to
+    const uint32_t *Closure = &ret->EpsilonClosures[Counter->State * ret->NumStateDwords];
+    for (size_t i = 0; i < ret->NumStateDwords; ++i) {
+        uint32_t Others = Closure[i];
+        if (i == Counter->State / 32) {
+            Others &= ~(1u << (Counter->State % 32));
+        }
+        if (Others != 0) {
+            *NextInstr(ret) = RI32(OR, MEM_DISP32, Base, CurrentEnables + i * DWORD_TO_BYTES, Others);
+        }
+    }
+    for (size_t i = 0; i < NumJmpsToDone; ++i) {
+        ret->Instructions[JmpsToDone[i]].JumpDestIdx = ret->Count;
+    }
+}
+
+void GenInstructionsArcList(nfa_arc_list *ArcList, GeneratedInstructions *ret) {
+    NFASortTransitions(ArcList->Transitions, ArcList->NumTransitions);
+    GenInstructionsTransitions(ArcList->Transitions, ArcList->NumTransitions, ret);
+}
+
+// Write the code for every arc that consumes Char, from all of the arc lists
+// together so each from state is only tested once. The arcs of counter states
+// are done by GenInstructionsCounter instead.
+void GenInstructionsByteClass(nfa *NFA, char Char, GeneratedInstructions *ret) {
+    size_t NumTransitions = 0;
+    uint32_t Counters = 0; // A bit for each counter Char continues
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        if (LabelMatches(ArcList->Label, Char)) {
+            for (size_t TransitionIdx = 0;
+                 TransitionIdx < ArcList->NumTransitions;
+                 ++TransitionIdx)
+            {
+                nfa_transition Transition = ArcList->Transitions[TransitionIdx];
+                const uint32_t CounterIdx = (NFA->NumCounters == 0) ? NFA_NULLSTATE :
+                    NFACounterIdx(NFA, Transition.To);
+                if (CounterIdx != NFA_NULLSTATE) {
+                    Counters |= 1u << CounterIdx;
+                    continue;
+                }
+                ret->MergedTransitions[NumTransitions++] = Transition;
+            }
+        }
+        ArcList = NFANextArcList(ArcList);
+    }
+    NFASortTransitions(ret->MergedTransitions, NumTransitions);
+    GenInstructionsTransitions(ret->MergedTransitions, NumTransitions, ret);
+    for (uint32_t CounterIdx = 0; CounterIdx < NFA->NumCounters; ++CounterIdx) {
+        if (Counters & (1u << CounterIdx)) {
+            GenInstructionsCounter(NFA, CounterIdx, ret);
+        }
+    }
+}
+
+
+// The bits of dword Dword in the state bitsets that are accept states
+uint32_t AcceptStatesMask(nfa *NFA, uint32_t Dword) {
+    const size_t AcceptBits = NFA->NumAcceptStates - Dword*32;
+    if (AcceptBits >= 32) {
+        return 0xFFFFFFFF;
+    }
+    return (1u << AcceptBits) - 1;
+}
+
+// The literal for GenInstructionsPrefilter, or a Length of 0 if the options
+// don't allow one. Only an Unanchored search scans far enough to be worth it,
+// and a literal could be split between the chunks of a Stream.
+//
+// Uses the scratch arena, and leaves it empty.
+nfa_literal PrefilterLiteral(nfa *NFA, codegen_options Options, GeneratedInstructions *ret) {
+    nfa_literal Result = {};
+    if (!Options.Unanchored || Options.Reverse || Options.Stream || Options.MatchSet ||
+        Options.ReturnToken || Options.Batch)
+    {
+        return Result;
+    }
+    Result = NFARequiredLiteral(NFA, &ret->Scratch);
+    ret->Scratch.Used = 0;
+    return Result;
+}
+
+// Write a jump and add it to the front of a linked list of jumps to the same
+// place, threaded through JumpDestIdx and ending with (size_t)-1
+void JumpToList(op Op, size_t *List, GeneratedInstructions *ret) {
+    size_t Jmp = ret->Count;
+    *NextInstr(ret) = J(Op);
+    ret->Instructions[Jmp].JumpDestIdx = *List;
+    *List = Jmp;
+}
+
+/**
+ * Write code that searches the string for a literal every match contains (see
+ * NFARequiredLiteral) before the main loop. If it isn't there, ebx is moved to
+ * the end of the string so the loop stops right away. If the literal is a
+ * prefix of every match, ebx is moved up to it instead since no match can
+ * start before it.
+ *
+ * The first char is found 16 bytes at a time with PCMPEQB, like memchr, and
+ * then the rest are compared one by one. The loads are aligned, so reading
+ * past the end of the string never crosses into another page.
+ *
+ * ecx has to be the end of a Counted string. Uses eax, edx, and xmm1-xmm4.
+ */
+void GenInstructionsPrefilter(nfa_literal *Literal, bool Counted, GeneratedInstructions *ret) {
+    Assert(Literal->Length > 0);
+    const uint8_t First = (uint8_t)Literal->Bytes[0];
+    // xmm1 = the first char in every byte, xmm2 = 0
+    *NextInstr(ret) = RI32(MOV, REG, EAX, 0, First * 0x01010101u);
+    for (size_t i = 0; i < XMM_TO_BYTES / DWORD_TO_BYTES; ++i) {
+        *NextInstr(ret) = R32(PUSH, REG, EAX, 0);
+    }
+    *NextInstr(ret) = RX(MOVDQUR, MEM_DISP32, ESP, XMM1, 0);
+    *NextInstr(ret) = RI32(ADD, REG, ESP, 0, XMM_TO_BYTES);
+    *NextInstr(ret) = RX(PXOR, REG, XMM2, XMM2, 0);
+    *NextInstr(ret) = RR32(MOV, REG, EAX, EBX, 0);
+
+    // Linked lists of the jumps to NotFound and Next, see JumpDestIdx
+    size_t LastNotFoundJmp = (size_t)-1;
+    size_t LastNextJmp = (size_t)-1;
+    // One char at a time until eax is aligned
+    size_t Head = ret->Count;
+    if (Counted) {
+        *NextInstr(ret) = RR32(CMP, REG, EAX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RR32(MOV, REG, EDX, EAX, 0);
+    *NextInstr(ret) = RI32(AND, REG, EDX, 0, XMM_TO_BYTES - 1);
+    size_t JmpToBlock = ret->Count;
+    *NextInstr(ret) = J(JE);
+    *NextInstr(ret) = RI8(CMP, MEM, EAX, 0, First);
+    size_t JmpToCandidate = ret->Count;
+    *NextInstr(ret) = J(JE);
+    if (!Counted) {
+        *NextInstr(ret) = RI8(CMP, MEM, EAX, 0, 0);
+        JumpToList(JE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = R32(INC, REG, EAX, 0);
+    *NextInstr(ret) = JD(JMP, Head);
+
+    // Then 16 chars at a time until one is the first char (or NUL)
+    size_t Block = ret->Count;
+    ret->Instructions[JmpToBlock].JumpDestIdx = Block;
+    if (Counted) {
+        *NextInstr(ret) = RR32(CMP, REG, EAX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RX(MOVDQAR, MEM, EAX, XMM3, 0);
+    if (!Counted) {
+        *NextInstr(ret) = RX(MOVDQAR, REG, XMM3, XMM4, 0);
+        *NextInstr(ret) = RX(PCMPEQB, REG, XMM2, XMM4, 0);
+    }
+    *NextInstr(ret) = RX(PCMPEQB, REG, XMM1, XMM3, 0);
+    if (!Counted) {
+        *NextInstr(ret) = RX(POR, REG, XMM4, XMM3, 0);
+    }
+    *NextInstr(ret) = RX(PMOVMSKB, REG, XMM3, EDX, 0);
+    *NextInstr(ret) = RI32(CMP, REG, EDX, 0, 0);
+    size_t JmpToFoundInBlock = ret->Count;
+    *NextInstr(ret) = J(JNE);
+    *NextInstr(ret) = RI32(ADD, REG, EAX, 0, XMM_TO_BYTES);
+    *NextInstr(ret) = JD(JMP, Block);
+
+    ret->Instructions[JmpToFoundInBlock].JumpDestIdx = ret->Count;
+    *NextInstr(ret) = RR32(BSF, REG, EDX, EDX, 0);
+    *NextInstr(ret) = RR32(ADD, REG, EAX, EDX, 0);
+    if (Counted) { // The last block can go past the end
+        *NextInstr(ret) = RR32(CMP, REG, EAX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    } else {
+        *NextInstr(ret) = RI8(CMP, MEM, EAX, 0, 0);
+        JumpToList(JE, &LastNotFoundJmp, ret);
+    }
+
+    // eax points at the first char, check the rest
+    ret->Instructions[JmpToCandidate].JumpDestIdx = ret->Count;
+    if (Counted && Literal->Length > 1) { // Nothing later fits either
+        *NextInstr(ret) = RR32(MOV, REG, EDX, ECX, 0);
+        *NextInstr(ret) = RR32(SUB, REG, EDX, EAX, 0);
+        *NextInstr(ret) = RI32(CMP, REG, EDX, 0, Literal->Length);
+        JumpToList(JB, &LastNotFoundJmp, ret);
+    }
+    for (uint32_t i = 1; i < Literal->Length; ++i) {
+        *NextInstr(ret) = RI8(CMP, MEM_DISP8, EAX, i, (uint8_t)Literal->Bytes[i]);
+        JumpToList(JNE, &LastNextJmp, ret);
+    }
+    if (Literal->IsPrefix) {
+        *NextInstr(ret) = RR32(MOV, REG, EBX, EAX, 0);
+    }
+    size_t JmpToDone = ret->Count;
+    *NextInstr(ret) = J(JMP);
+
+    // Not this one, keep looking after it
+    while (LastNextJmp != (size_t)-1) {
+        size_t NextJmp = ret->Instructions[LastNextJmp].JumpDestIdx;
+        ret->Instructions[LastNextJmp].JumpDestIdx = ret->Count;
+        LastNextJmp = NextJmp;
+    }
+    *NextInstr(ret) = R32(INC, REG, EAX, 0);
+    *NextInstr(ret) = JD(JMP, Head);
+
+    // Skip to the end. Without Counted eax is at the NUL.
+    while (LastNotFoundJmp != (size_t)-1) {
+        size_t NextJmp = ret->Instructions[LastNotFoundJmp].JumpDestIdx;
+        ret->Instructions[LastNotFoundJmp].JumpDestIdx = ret->Count;
+        LastNotFoundJmp = NextJmp;
+    }
+    *NextInstr(ret) = RR32(MOV, REG, EBX, Counted ? ECX : EAX, 0);
+
+    ret->Instructions[JmpToDone].JumpDestIdx = ret->Count;
+}
+
+// Teddy puts the prefixes in up to 8 groups, one for each bit of a byte
+#define TEDDY_BUCKETS 8
+
+// The shuffle tables for GenInstructionsTeddy
+struct teddy_masks {
+    uint32_t Length; // Of the prefixes, 0 if there's no Teddy prefilter
+    // Byte n of Lo[i] has the bit for each bucket with a prefix whose char i
+    // has a low nibble of n. Hi[i] is the same for the high nibble.
+    uint8_t Lo[NFA_MAX_PREFIX][XMM_TO_BYTES];
+    uint8_t Hi[NFA_MAX_PREFIX][XMM_TO_BYTES];
+};
+
+// The tables for GenInstructionsTeddy, or a Length of 0 if the options don't
+// allow it or the prefixes aren't longer than the literal for
+// GenInstructionsPrefilter. It keeps its tables after the state arrays on the
+// stack, and it uses edx, so it's only for the stack states without
+// ReturnOffset.
+//
+// The prefixes are sorted, so the ones next to each other in a bucket tend to
+// share their first chars.
+//
+// Uses the scratch arena, and leaves it empty.
+teddy_masks TeddyPrefilter(nfa *NFA, codegen_options Options, nfa_literal *Literal,
+                           GeneratedInstructions *ret) {
+    teddy_masks Result = {};
+    if (!Options.Unanchored || Options.Reverse || Options.Stream || Options.MatchSet ||
+        Options.ReturnToken || Options.Batch || Options.ReturnOffset || Options.CallerScratch)
+    {
+        return Result;
+    }
+    nfa_prefixes Prefixes = NFAPrefixes(NFA, &ret->Scratch);
+    ret->Scratch.Used = 0;
+    if (Prefixes.Length <= Literal->Length || Prefixes.Count == 0) {
+        return Result;
+    }
+    Result.Length = Prefixes.Length;
+    for (uint32_t Prefix = 0; Prefix < Prefixes.Count; ++Prefix) {
+        const uint8_t Bucket = (uint8_t)(1 << (Prefix * TEDDY_BUCKETS / Prefixes.Count));
+        for (uint32_t i = 0; i < Prefixes.Length; ++i) {
+            const uint8_t Byte = (uint8_t)Prefixes.Bytes[Prefix][i];
+            Result.Lo[i][Byte & 0x0F] |= Bucket;
+            Result.Hi[i][Byte >> 4] |= Bucket;
+        }
+    }
+    return Result;
+}
+
+// Bytes of stack GenInstructionsTeddy needs: the nibble mask, the Lo and Hi
+// tables, the last block's matches for each char but the last, and a dword for
+// where the scan started
+inline int32_t TeddyStackBytes(teddy_masks *Teddy) {
+    return (3 * Teddy->Length + 1) * XMM_TO_BYTES;
+}
+
+// Write the tables for GenInstructionsTeddy to the stack at Base
+void GenInstructionsTeddyTables(teddy_masks *Teddy, int32_t Base, GeneratedInstructions *ret) {
+    for (int32_t i = 0; i < XMM_TO_BYTES; i += DWORD_TO_BYTES) {
+        *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, Base + i, 0x0F0F0F0F);
+    }
+    for (uint32_t Char = 0; Char < Teddy->Length; ++Char) {
+        const int32_t Lo = Base + (1 + Char) * XMM_TO_BYTES;
+        const int32_t Hi = Base + (1 + Teddy->Length + Char) * XMM_TO_BYTES;
+        for (int32_t i = 0; i < XMM_TO_BYTES; i += DWORD_TO_BYTES) {
+            uint32_t LoDword = 0;
+            uint32_t HiDword = 0;
+            for (int32_t Byte = 0; Byte < DWORD_TO_BYTES; ++Byte) {
+                LoDword |= (uint32_t)Teddy->Lo[Char][i + Byte] << (8 * Byte);
+                HiDword |= (uint32_t)Teddy->Hi[Char][i + Byte] << (8 * Byte);
+            }
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, Lo + i, LoDword);
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, Hi + i, HiDword);
+        }
+    }
+}
+
+/**
+ * Write code that searches from ebx for any of the prefixes every match starts
+ * with (see NFAPrefixes), 16 bytes at a time. It's the Teddy algorithm from
+ * Hyperscan, with up to 8 buckets of prefixes of up to NFA_MAX_PREFIX chars.
+ *
+ * PSHUFB looks up the low and high nibble of every byte in the block in the
+ * tables for each char of the prefixes, and and-ing them gives the buckets
+ * that could have that char there. Shifting the results for the earlier chars
+ * up to line them up with the last one (bringing in the end of the last block)
+ * and and-ing them all gives the buckets that could end at each byte. Those
+ * are only candidates since the nibbles of different prefixes in a bucket mix,
+ * so the NFA checks them.
+ *
+ * When it finds one it sets the start closure in ActiveStates, moves ebx to
+ * the start of the prefix, and jumps to Top. If there isn't one it moves ebx
+ * to the end of the string and jumps to Top, which stops there.
+ *
+ * The loads are aligned like in GenInstructionsPrefilter. Bytes in the first
+ * block before ebx can't start a candidate, and a NUL there doesn't end the
+ * string. The tables are on the stack at Base (see TeddyStackBytes).
+ *
+ * ecx has to be the end of a Counted string, otherwise it's overwritten. Uses
+ * eax, edx, and xmm1-xmm5.
+ *
+ * Returns where to jump to scan from ebx. The instruction right before it
+ * increments ebx, for scanning after the current char.
+ */
+size_t GenInstructionsTeddy(teddy_masks *Teddy, bool Counted, int32_t Base,
+                            const uint32_t *StartClosure, uint32_t NumStateDwords,
+                            int32_t ActiveStates, size_t Top, GeneratedInstructions *ret) {
+    Assert(Teddy->Length > 0 && Teddy->Length <= NFA_MAX_PREFIX);
+    const uint32_t Length = Teddy->Length;
+    const int32_t Nibbles = Base;
+    const int32_t Prev = Base + (1 + 2*Length) * XMM_TO_BYTES;
+    const int32_t ScanFrom = Base + 3*Length * XMM_TO_BYTES;
+
+    *NextInstr(ret) = R32(INC, REG, EBX, 0);
+    size_t Scan = ret->Count;
+    size_t LastNotFoundJmp = (size_t)-1;
+    if (Counted) {
+        *NextInstr(ret) = RR32(CMP, REG, EBX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RR32(MOV, MEM_DISP32, ESP, EBX, ScanFrom);
+    for (uint32_t i = 0; i + 1 < Length; ++i) {
+        *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, ESP, XMM0, Prev + i*XMM_TO_BYTES);
+    }
+    *NextInstr(ret) = RR32(MOV, REG, EAX, EBX, 0);
+    *NextInstr(ret) = RI32(AND, REG, EAX, 0, ~(XMM_TO_BYTES - 1));
+
+    size_t Block = ret->Count;
+    if (Counted) {
+        *NextInstr(ret) = RR32(CMP, REG, EAX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RX(MOVDQAR, MEM, EAX, XMM1, 0);
+    if (!Counted) {
+        // ecx = offset of the first NUL at or after ScanFrom, or 16 if there
+        // isn't one in this block
+        *NextInstr(ret) = RX(MOVDQAR, REG, XMM1, XMM2, 0);
+        *NextInstr(ret) = RX(PCMPEQB, REG, XMM0, XMM2, 0);
+        *NextInstr(ret) = RX(PMOVMSKB, REG, XMM2, ECX, 0);
+        *NextInstr(ret) = RI32(OR, REG, ECX, 0, 1 << XMM_TO_BYTES);
+        size_t FindNul = ret->Count;
+        *NextInstr(ret) = RR32(BSF, REG, ECX, EDX, 0);
+        *NextInstr(ret) = RR32(ADD, REG, EDX, EAX, 0);
+        *NextInstr(ret) = RR32(CMP, MEM_DISP32, ESP, EDX, ScanFrom);
+        size_t JmpToFoundNul = ret->Count;
+        *NextInstr(ret) = J(JBE);
+        *NextInstr(ret) = RR32(SUB, REG, EDX, EAX, 0);
+        *NextInstr(ret) = RR32(BTR, REG, ECX, EDX, 0);
+        *NextInstr(ret) = JD(JMP, FindNul);
+        ret->Instructions[JmpToFoundNul].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(SUB, REG, EDX, EAX, 0);
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EDX, 0);
+    }
+
+    // xmm1 = the low nibbles, xmm2 = the high nibbles
+    *NextInstr(ret) = RX(MOVDQAR, REG, XMM1, XMM2, 0);
+    *NextInstr(ret) = RXI(PSRLW, XMM2, 4);
+    *NextInstr(ret) = RX(PAND, MEM_DISP32, ESP, XMM1, Nibbles);
+    *NextInstr(ret) = RX(PAND, MEM_DISP32, ESP, XMM2, Nibbles);
+    // xmm3 = the buckets that could end at each byte
+    for (uint32_t Char = 0; Char < Length; ++Char) {
+        const int32_t Lo = Base + (1 + Char) * XMM_TO_BYTES;
+        const int32_t Hi = Base + (1 + Length + Char) * XMM_TO_BYTES;
+        *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM4, Lo);
+        *NextInstr(ret) = RX(PSHUFB, REG, XMM1, XMM4, 0);
+        *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM5, Hi);
+        *NextInstr(ret) = RX(PSHUFB, REG, XMM2, XMM5, 0);
+        *NextInstr(ret) = RX(PAND, REG, XMM5, XMM4, 0);
+        if (Char + 1 < Length) { // Line it up with the last char
+            const uint32_t Shift = Length - 1 - Char;
+            const int32_t PrevChar = Prev + Char * XMM_TO_BYTES;
+            *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM5, PrevChar);
+            *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, ESP, XMM4, PrevChar);
+            *NextInstr(ret) = RXI(PSLLDQ, XMM4, Shift);
+            *NextInstr(ret) = RXI(PSRLDQ, XMM5, XMM_TO_BYTES - Shift);
+            *NextInstr(ret) = RX(POR, REG, XMM5, XMM4, 0);
+        }
+        if (Char == 0) {
+            *NextInstr(ret) = RX(MOVDQAR, REG, XMM4, XMM3, 0);
+        } else {
+            *NextInstr(ret) = RX(PAND, REG, XMM4, XMM3, 0);
+        }
+    }
+    // edx = a bit for each byte where a candidate ends
+    *NextInstr(ret) = RX(PCMPEQB, REG, XMM0, XMM3, 0);
+    *NextInstr(ret) = RX(PMOVMSKB, REG, XMM3, EDX, 0);
+    *NextInstr(ret) = RI32(XOR, REG, EDX, 0, 0xFFFF);
+
+    // Go through the candidates in order
+    size_t Candidate = ret->Count;
+    *NextInstr(ret) = RR32(BSF, REG, EDX, EBX, 0);
+    size_t JmpToNextBlock = ret->Count;
+    *NextInstr(ret) = J(JE);
+    if (!Counted) { // It ends past the NUL, so every later one does too
+        *NextInstr(ret) = RR32(CMP, REG, EBX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RR32(BTR, REG, EDX, EBX, 0);
+    *NextInstr(ret) = RR32(ADD, REG, EBX, EAX, 0);
+    if (Counted) {
+        *NextInstr(ret) = RR32(CMP, REG, EBX, ECX, 0);
+        JumpToList(JAE, &LastNotFoundJmp, ret);
+    }
+    if (Length > 1) {
+        *NextInstr(ret) = RI32(SUB, REG, EBX, 0, Length - 1);
+    }
+    *NextInstr(ret) = RR32(CMP, MEM_DISP32, ESP, EBX, ScanFrom);
+    *NextInstr(ret) = JD(JA, Candidate); // Starts before the scan did
+    size_t JmpToFound = ret->Count;
+    *NextInstr(ret) = J(JMP);
+
+    ret->Instructions[JmpToNextBlock].JumpDestIdx = ret->Count;
+    if (!Counted) {
+        *NextInstr(ret) = RI32(CMP, REG, ECX, 0, XMM_TO_BYTES);
+        JumpToList(JB, &LastNotFoundJmp, ret);
+    }
+    *NextInstr(ret) = RI32(ADD, REG, EAX, 0, XMM_TO_BYTES);
+    *NextInstr(ret) = JD(JMP, Block);
+
+    // Skip to the end. Without Counted it's the NUL at eax + ecx.
+    while (LastNotFoundJmp != (size_t)-1) {
+        size_t NextJmp = ret->Instructions[LastNotFoundJmp].JumpDestIdx;
+        ret->Instructions[LastNotFoundJmp].JumpDestIdx = ret->Count;
+        LastNotFoundJmp = NextJmp;
+    }
+    if (Counted) {
+        *NextInstr(ret) = RR32(MOV, REG, EBX, ECX, 0);
+    } else {
+        *NextInstr(ret) = RR32(MOV, REG, EBX, EAX, 0);
+        *NextInstr(ret) = RR32(ADD, REG, EBX, ECX, 0);
+    }
+    *NextInstr(ret) = JD(JMP, Top);
+
+    // Run the NFA from the start of the prefix. Nothing else is active.
+    ret->Instructions[JmpToFound].JumpDestIdx = ret->Count;
+    for (size_t i = 0; i < NumStateDwords; ++i) {
+        if (StartClosure[i] == 0) {
+            continue;
+        }
+        *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, ActiveStates + i*DWORD_TO_BYTES, StartClosure[i]);
+    }
+    *NextInstr(ret) = JD(JMP, Top);
+    return Scan;
+}
 
 // TODO: Document the overall structure of the assembly code
-GeneratedInstructions GenerateInstructions(nfa *NFA, mem_arena *Arena) {
+GeneratedInstructions GenerateInstructions(nfa *NFA, mem_arena *Arena,
+                                           codegen_options Options = {}) {
+    Assert(!Options.Stream || (!Options.ReturnOffset && !Options.Reverse));
+    Assert(!Options.MatchSet || (!Options.ReturnOffset && !Options.Reverse && !Options.Stream));
+    Assert(!Options.ReturnToken || (!Options.Unanchored && !Options.Reverse &&
+                                    !Options.Stream && !Options.MatchSet));
+    Assert(!Options.Batch || (!Options.ReturnOffset && !Options.Reverse && !Options.Stream &&
+                              !Options.MatchSet && !Options.ReturnToken));
+    if (Options.ReturnToken) {
+        Options.ReturnOffset = true;
+    }
+    if (Options.Stream || Options.Batch) {
+        Options.Counted = true;
+    }
+
     // ebx = char *CurrChar
-    // ebp[0:NumStateBytes] = ActiveStates
-    // ebp[NumStateBytes:2*NumStateBytes] = CurrentEnables
-    // ebp[2*NumStateBytes:3*NumStateBytes] = CurrentDisables
+    // esp[0:NumStateBytes] = ActiveStates
+    // esp[NumStateBytes:2*NumStateBytes] = CurrentEnables
+    // xmm0 = 0
+    //
+    // The stack arrays are 16 byte aligned and padded to a multiple of 16 bytes
+    // so they can be copied and cleared with SSE2. The padding is always 0.
+    //
+    // Epsilon arcs are never followed at runtime. Every activation mask already
+    // contains the epsilon closure of the states it activates (see
+    // NFAEpsilonClosures), so after consuming a character the new active states
+    // are exactly CurrentEnables.
+    //
+    // If there are 32 or fewer states, ActiveStates is kept in ESI and
+    // CurrentEnables in EDI instead of on the stack.
+    //
+    // With CallerScratch the arrays are in the caller's buffer, pointed to by
+    // EDI, instead of on the stack. The caller zeroes it once and we leave it
+    // zeroed when we return, so it doesn't have to be cleared on every call.
+    //
+    // If checking the labels would take enough compares, we jump to a case for
+    // the byte class of each char through a jump table. Its address is kept
+    // in JumpTableReg (EBP when the states are in registers, ESI otherwise).
+    //
+    // For an Unanchored search CurrentEnables starts each char with the start
+    // closure instead of 0, so a new match attempt begins at every position,
+    // and we return as soon as the accept state is active.
+    //
+    // If every match starts with one of a few short prefixes, an Unanchored
+    // search uses GenInstructionsTeddy to skip to the next one instead. Then
+    // the start closure is only or-ed in while something is active, and when
+    // nothing is we go back to scanning. Its tables are on the stack after
+    // CurrentEnables, so the states are too even if they'd fit in registers.
+    //
+    // ecx = where to stop reading: the start of the string when Reverse,
+    // otherwise the end if the string is Counted. With ReturnOffset,
+    // edx = CurrChar the last time the accept state was active, or 0 if it
+    // never was.
+    //
+    // With MatchSet, edx = the bitmap of regexes that matched. For an
+    // Unanchored search the accept states are or-ed into it before each char.
+    //
+    // With ReturnToken, there's one more dword pushed below the callee saved
+    // registers for the index of the regex that matched at edx.
+    //
+    // With Batch, edx = the index of the string we're on, and the extra pushed
+    // dword is the number of matches so far. The code before Top loads the
+    // next string and resets ActiveStates, and the code after the loop writes
+    // the result and goes back there.
+    //
+    // Counter states have a dword each after the state bits, and the rings of
+    // the ones for exactly Min chars go after CurrentEnables (see
+    // GenInstructionsCounter). They're always on the stack, and the counters
+    // need the jump table so their code runs once for each char.
 
     const uint32_t NumStateDwords = DivCeil(NFA->NumStates, 32);
-    const uint32_t NumStateBytes = NumStateDwords * DWORD_TO_BYTES;
-    // EBP byte offsets for these stack arrays arrays
+    const uint32_t NumStateXmms = NFANumStateXmms(NFA);
+    const uint32_t NumStateBytes = NumStateXmms * XMM_TO_BYTES;
+    // StatesBaseReg byte offsets for these arrays
     const int32_t ActiveStates = 0;
-    const int32_t CurrentEnables = -1 * NumStateBytes;
-    const int32_t CurrentDisables = -2 * NumStateBytes;
+    const int32_t CurrentEnables = NumStateBytes;
 
     GeneratedInstructions Result = {};
-    Result.Instructions = (instruction *)(Arena->Base + NumStateBytes);
     Result.Arena = Arena;
+    Result.Scratch = ArenaInit();
     Result.NumStateDwords = NumStateDwords;
-    Result.ActivateMask = (uint32_t *)Alloc(Arena, NumStateBytes);
+    Result.NumStateXmms = NumStateXmms;
+    Result.StatesBaseReg = Options.CallerScratch ? EDI : ESP;
     GeneratedInstructions *ret = &Result; // Just an alias for consistency
+    nfa_literal Literal = PrefilterLiteral(NFA, Options, ret);
+    teddy_masks Teddy = TeddyPrefilter(NFA, Options, &Literal, ret);
+    const bool UseTeddy = (Teddy.Length > 0);
+    if (UseTeddy) {
+        Literal.Length = 0;
+    }
+    // Teddy's tables go on the stack after the state arrays and counter rings
+    Result.StatesInRegisters = (NumStateDwords == 1 && !UseTeddy && NFA->NumCounters == 0);
+    Result.CounterRings = 2*NumStateBytes;
+    const int32_t CounterRingBytes = CounterRingOffset(NFA, NFA->NumCounters);
+    const int32_t TeddyBase = 2*NumStateBytes + CounterRingBytes;
 
-    *NextInstr(ret) = R32(PUSH, REG, EBP, 0); // Callee save
-    *NextInstr(ret) = R32(PUSH, REG, EBX, 0); // Callee save
-    *NextInstr(ret) = R32(PUSH, REG, ESI, 0); // Callee save
-    *NextInstr(ret) = RR32(MOV, REG, EBP, ESP, 0); // save the start of the stack
+    // Epsilon arcs, garunteed to be the first arc list. They're already folded
+    // into the activation masks so we skip over them.
+    nfa_arc_list *EpsilonArcs = NFAFirstArcList(NFA);
+    Assert(EpsilonArcs->Label.Type == EPSILON);
+    nfa_arc_list *StartList = NFANextArcList(EpsilonArcs);
 
-    *NextInstr(ret) = RR32(MOVR, MEM_DISP32, ESP, EBX, 4*DWORD_TO_BYTES); // Get pointer to the search string off the stack
+    // Count how many compares checking each label separately would take
+    size_t NumCompares = 0;
+    size_t NumTransitions = 0;
+    nfa_arc_list *ArcList = StartList;
+    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        if (ArcList->Label.Type == MATCH) {
+            NumCompares += 1;
+        } else if (ArcList->Label.Type == RANGE) {
+            NumCompares += 2;
+        }
+        NumTransitions += ArcList->NumTransitions;
+        ArcList = NFANextArcList(ArcList);
+    }
+    const bool UseJumpTable = (NumCompares >= JUMP_TABLE_MIN_COMPARES || NFA->NumCounters > 0);
 
-    *NextInstr(ret) = RI32(SUB, REG, ESP, 0, 3*NumStateBytes); // Make room for ActiveStates, CurrentEnables, CurrentDisables on the stack
-    // Loop to clear the stack memory we just allocated
-    *NextInstr(ret) = RR32(MOV, REG, ESI, EBP, 0); // We will increment ESI as we loop
-    *NextInstr(ret) = RI32(MOV, REG, ECX, 0, 3*NumStateDwords); // Set the counter for the loop
-    size_t ClearLoop = ret->Count;
-    *NextInstr(ret) = RI32(MOV, MEM, ESI, 0, 0);
-    *NextInstr(ret) = RI32(SUB, REG, ESI, 0, 4/*bytes_per_dword*/);
-    *NextInstr(ret) = R32(DEC, REG, ECX, 0);
-    *NextInstr(ret) = JD(JNE, ClearLoop);
+    // Get the pointers after the last Alloc since the arena can move
+    Alloc(&ret->Scratch, NumStateDwords * DWORD_TO_BYTES);
+    const size_t MergedTransitionsOffset = ret->Scratch.Used;
+    Alloc(&ret->Scratch, NumTransitions * sizeof(nfa_transition));
+    const size_t ByteClassOffset = ret->Scratch.Used;
+    Alloc(&ret->Scratch, 256);
+    const size_t ShiftTargetsOffset = ret->Scratch.Used;
+    Alloc(&ret->Scratch, 2 * NumStateDwords * DWORD_TO_BYTES);
+    ret->EpsilonClosures = NFAEpsilonClosures(NFA, &ret->Scratch);
+    ret->ActivateMask = (uint32_t *)ret->Scratch.Base;
+    ret->MergedTransitions = (nfa_transition *)(ret->Scratch.Base + MergedTransitionsOffset);
+    ret->ByteClass = ret->Scratch.Base + ByteClassOffset;
+    ret->Instructions = (instruction *)(Arena->Base + Arena->Used);
 
-    // Set the start state as active
-    const int32_t StartStateDword = NFA->StartState / 32;
-    const uint8_t StartStateBit = NFA->StartState - (32*StartStateDword);
-    *NextInstr(ret) = RI32(MOV, MEM_DISP32, EBP, ActiveStates - StartStateDword*DWORD_TO_BYTES, 1 << StartStateBit);
+    const uint32_t NumByteClasses = NFAByteClasses(NFA, ret->ByteClass);
+    ret->ShiftAnd = ShiftAndFinalStates(NFA, NumByteClasses, ret);
+    if (!ret->ShiftAnd) { // Otherwise every arc is shifted already
+        uint32_t *ShiftTargets = (uint32_t *)(ret->Scratch.Base + ShiftTargetsOffset);
+        ret->ShiftMask = ShiftTargets + NumStateDwords;
+        NFAShiftTargets(NFA, ShiftTargets, ret);
+        ret->ShiftTargets = ShiftTargets;
+    }
+    const reg JumpTableReg = ret->StatesInRegisters ? EBP : ESI;
+    // Number of registers we push that are above the search string on the stack
+    const bool UseScratch = (!ret->StatesInRegisters && Options.CallerScratch);
+    const int32_t NumPushed = (ret->StatesInRegisters ? 3 : 2) + (UseJumpTable ? 1 : 0) +
+                              (UseScratch ? 1 : 0) + ((Options.ReturnToken || Options.Batch) ? 1 : 0);
+    const reg StatesBaseReg = ret->StatesBaseReg;
 
-    size_t Top = ret->Count;
+    // Stop early when nothing is active, since nothing can be again
+    const bool ExitWhenDead = (Options.ReturnOffset && !Options.Unanchored);
 
-    // Loop following epsilon arcs until following doesn't activate any new states
-    size_t EpsilonLoopStart = ret->Count;
-    // Epsilon arcs, garunteed to be the first arc list
-    // TODO: Is this premature opmtimisation? We could just search for epsilon
-    // like we do below for the dot arc list.
-    nfa_arc_list *EpsilonArcs = NFAFirstArcList(NFA);
-    Assert(EpsilonArcs->Label.Type == EPSILON);
+    // ESP offsets of the arguments after the pushes. Saved in EBP when the
+    // states aren't in registers, otherwise ESP doesn't change.
+    const reg ArgsReg = ret->StatesInRegisters ? ESP : EBP;
+    const int32_t ContextArgDisp = (NumPushed + 1)*DWORD_TO_BYTES; // Only for Stream
+    const int32_t ScratchArgDisp = ContextArgDisp + (Options.Stream ? DWORD_TO_BYTES : 0);
+    // The bitmap for MatchSet or Batch, or the token for ReturnToken
+    const bool HasOutArg = (Options.MatchSet || Options.ReturnToken || Options.Batch);
+    const int32_t OutArgDisp = ScratchArgDisp + (Options.CallerScratch ? DWORD_TO_BYTES : 0);
+    const int32_t StrArgDisp = OutArgDisp + (HasOutArg ? DWORD_TO_BYTES : 0);
+    const int32_t LenArgDisp = StrArgDisp + DWORD_TO_BYTES; // Only for Counted
+    // The Batch arguments take the place of Str and Len
+    const int32_t OffsetsArgDisp = StrArgDisp;
+    const int32_t DataArgDisp = StrArgDisp + DWORD_TO_BYTES;
+    const int32_t NumStringsArgDisp = StrArgDisp + 2*DWORD_TO_BYTES;
+    // The last thing pushed, for the token or the number of matches
+    const int32_t LocalDisp = 0;
 
-    // (Ab)Use the CurrentDisables storage to save the state of the active states (unrolled loop)
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = RR32(MOV, MEM_DISP32, EBP, EAX, CurrentDisables - i*DWORD_TO_BYTES);
-    }
-    GenInstructionsArcList(EpsilonArcs, ret);
+    uint32_t *StartClosure = &ret->EpsilonClosures[NFA->StartState * NumStateDwords];
+    if (ret->StatesInRegisters) {
+        *NextInstr(ret) = R32(PUSH, REG, EBX, 0); // Callee save
+        *NextInstr(ret) = R32(PUSH, REG, ESI, 0); // Callee save
+        *NextInstr(ret) = R32(PUSH, REG, EDI, 0); // Callee save
+        if (UseJumpTable) {
+            *NextInstr(ret) = R32(PUSH, REG, JumpTableReg, 0); // Callee save
+        }
+        if (Options.Batch) {
+            *NextInstr(ret) = RR32(XOR, REG, EAX, EAX, 0);
+            *NextInstr(ret) = R32(PUSH, REG, EAX, 0); // Number of matches
+        } else if (Options.ReturnToken) {
+            *NextInstr(ret) = R32(PUSH, REG, EAX, 0); // Make room for the token
+        }
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, EBX, StrArgDisp); // Get pointer to the search string off the stack
+    } else {
+        *NextInstr(ret) = R32(PUSH, REG, EBP, 0); // Callee save
+        *NextInstr(ret) = R32(PUSH, REG, EBX, 0); // Callee save
+        if (UseScratch) {
+            *NextInstr(ret) = R32(PUSH, REG, StatesBaseReg, 0); // Callee save
+        }
+        if (UseJumpTable) {
+            *NextInstr(ret) = R32(PUSH, REG, JumpTableReg, 0); // Callee save
+        }
+        if (Options.Batch) {
+            *NextInstr(ret) = RR32(XOR, REG, EAX, EAX, 0);
+            *NextInstr(ret) = R32(PUSH, REG, EAX, 0); // Number of matches
+        } else if (Options.ReturnToken) {
+            *NextInstr(ret) = R32(PUSH, REG, EAX, 0); // Make room for the token
+        }
+        *NextInstr(ret) = RR32(MOV, REG, EBP, ESP, 0); // save the start of the stack
 
-    // Unrolled loop to enable the states from the epsilon arcs
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, CurrentEnables - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = RR32(OR, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES);  // Enable the states to enable
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP32, ESP, EBX, StrArgDisp); // Get pointer to the search string off the stack
+
+        *NextInstr(ret) = RX(PXOR, REG, XMM0, XMM0, 0);
+        if (UseScratch) { // Already zeroed, see ScratchSize
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP32, ESP, StatesBaseReg, ScratchArgDisp);
+        } else {
+            // Make room for ActiveStates, CurrentEnables on the stack
+            const int32_t StackBytes = 2*NumStateBytes + CounterRingBytes +
+                                       (UseTeddy ? TeddyStackBytes(&Teddy) : 0);
+            *NextInstr(ret) = RI32(SUB, REG, ESP, 0, StackBytes);
+            *NextInstr(ret) = RI32(AND, REG, ESP, 0, ~(XMM_TO_BYTES - 1)); // Align for MOVDQA
+
+            // Clear the stack memory we just allocated
+            for (size_t i = 0; i < NumStateXmms; ++i) {
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, ESP, XMM0, ActiveStates + i*XMM_TO_BYTES);
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, ESP, XMM0, CurrentEnables + i*XMM_TO_BYTES);
+            }
+            if (UseTeddy) {
+                GenInstructionsTeddyTables(&Teddy, TeddyBase, ret);
+            }
+        }
     }
 
-    // Unrolled loop to check if we're done iterating on the epsilon arcs.
-    //
-    // Stops jumping back to the top when the epsilon arcs did not activate any
-    // new states.
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, CurrentDisables - i*DWORD_TO_BYTES); // Copy the Disable byte to eax
-      *NextInstr(ret) = RR32(CMP, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES); // Check if active states has changed
-      *NextInstr(ret) = JD(JNE, EpsilonLoopStart); // jump to the top if changed
+    // Pick up where the last chunk of the stream left off, unless this is the
+    // first one
+    size_t JmpToStatesLoaded = (size_t)-1;
+    if (Options.Stream) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, ContextArgDisp);
+        *NextInstr(ret) = RI32(CMP, MEM, EAX, 0, 0); // Context->Started
+        size_t JmpToFirstChunk = ret->Count;
+        *NextInstr(ret) = J(JE);
+        if (ret->StatesInRegisters) {
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EAX, ACTIVE_STATES_REG, STREAM_STATES_OFFSET);
+        } else {
+            for (size_t i = 0; i < NumStateXmms; ++i) {
+                *NextInstr(ret) = RX(MOVDQUR, MEM_DISP32, EAX, XMM1, STREAM_STATES_OFFSET + i*XMM_TO_BYTES);
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM1, ActiveStates + i*XMM_TO_BYTES);
+            }
+            for (int32_t Offset = 0; Offset < CounterRingBytes; Offset += XMM_TO_BYTES) {
+                *NextInstr(ret) = RX(MOVDQUR, MEM_DISP32, EAX, XMM1, STREAM_STATES_OFFSET + NumStateBytes + Offset);
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM1, ret->CounterRings + Offset);
+            }
+        }
+        JmpToStatesLoaded = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpToFirstChunk].JumpDestIdx = ret->Count;
     }
 
-    // If we found the end of the string, stop processing now
-    *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, 0);
-    size_t JmpToEnd = ret->Count;
-    *NextInstr(ret) = J(JE);
+    // Set the start state and its epsilon closure as active. Batch does it
+    // for each string instead.
+    if (ret->StatesInRegisters && !Options.Batch) {
+        *NextInstr(ret) = RI32(MOV, REG, ACTIVE_STATES_REG, 0, StartClosure[0]);
+    } else if (!Options.Batch) {
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            if (StartClosure[i] == 0) {
+                continue; // Already cleared
+            }
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, ActiveStates + i*DWORD_TO_BYTES, StartClosure[i]);
+        }
+    }
+    if (JmpToStatesLoaded != (size_t)-1) {
+        ret->Instructions[JmpToStatesLoaded].JumpDestIdx = ret->Count;
+    }
+    if (!ret->StatesInRegisters && Options.Unanchored && !UseTeddy) {
+        // Start matching again at the next char
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            if (StartClosure[i] == 0) {
+                continue; // Already cleared
+            }
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, CurrentEnables + i*DWORD_TO_BYTES, StartClosure[i]);
+        }
+    }
 
-    // Clear states to enable
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RI32(MOV, MEM_DISP32, EBP, CurrentEnables - i*DWORD_TO_BYTES, 0);
+    const bool HasStopPtr = (Options.Reverse || Options.Counted);
+    if (Options.Counted && Options.Reverse) {
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EBX, 0);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, LenArgDisp);
+        *NextInstr(ret) = RR32(ADD, REG, EBX, EAX, 0);
+    } else if (Options.Counted && !Options.Batch) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, ECX, LenArgDisp);
+        *NextInstr(ret) = RR32(ADD, REG, ECX, EBX, 0);
+    } else if (Options.Reverse) {
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EBX, 0);
     }
-    // Set CurrentDisables to disable the active states, before we consume input
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = RR32(MOV, MEM_DISP32, EBP, EAX, CurrentDisables - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = R32(NOT, MEM_DISP32, EBP, CurrentDisables - i*DWORD_TO_BYTES);
+    if (Literal.Length > 0) {
+        GenInstructionsPrefilter(&Literal, Options.Counted, ret);
+    }
+    if (Options.ReturnOffset || Options.Batch) {
+        *NextInstr(ret) = RR32(XOR, REG, EDX, EDX, 0);
+    }
+    const uint32_t NumAcceptDwords = DivCeil(NFA->NumAcceptStates, 32);
+    if (Options.MatchSet) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EDX, OutArgDisp);
+        for (size_t i = 0; Options.Unanchored && i < NumAcceptDwords; ++i) {
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, EDX, i*DWORD_TO_BYTES, 0);
+        }
+    }
+    if (Options.Reverse && !Options.Counted) { // Find the end of the string
+        size_t FindEnd = ret->Count;
+        *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, 0);
+        size_t JmpToFoundEnd = ret->Count;
+        *NextInstr(ret) = J(JE);
+        *NextInstr(ret) = R32(INC, REG, EBX, 0);
+        *NextInstr(ret) = JD(JMP, FindEnd);
+        ret->Instructions[JmpToFoundEnd].JumpDestIdx = ret->Count;
     }
 
-    nfa_arc_list *StartList = NFANextArcList(EpsilonArcs);
+    // The jump table has one entry for each byte value, which is the offset of
+    // the case for that char from the start of the table. We don't know where
+    // the code is going to be loaded, so we call over the table and pop the
+    // return address to get its address.
+    size_t JumpTable = 0;
+    if (UseJumpTable) {
+        size_t CallOverTable = ret->Count;
+        *NextInstr(ret) = J(CALL);
+        JumpTable = ret->Count;
+        for (size_t Byte = 0; Byte < 256; ++Byte) {
+            *NextInstr(ret) = DATA32((size_t)-1, JumpTable); // Filled in later
+        }
+        ret->Instructions[CallOverTable].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = R32(POP, REG, JumpTableReg, 0);
+    }
+
+    // Start the next string: Data[Offsets[edx]] up to Data[Offsets[edx + 1]]
+    size_t BatchTop = ret->Count;
+    size_t JmpToBatchDone = (size_t)-1;
+    if (Options.Batch) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, NumStringsArgDisp);
+        *NextInstr(ret) = RR32(CMP, REG, EDX, EAX, 0);
+        JmpToBatchDone = ret->Count;
+        *NextInstr(ret) = J(JAE);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, OffsetsArgDisp);
+        *NextInstr(ret) = RRS32(MOVR, MEM, EAX, EBX, EDX, DWORD_TO_BYTES, 0);
+        *NextInstr(ret) = RRS32(MOVR, MEM_DISP8, EAX, ECX, EDX, DWORD_TO_BYTES, DWORD_TO_BYTES);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, DataArgDisp);
+        *NextInstr(ret) = RR32(ADD, REG, EBX, EAX, 0);
+        *NextInstr(ret) = RR32(ADD, REG, ECX, EAX, 0);
 
-    // Dot arcs (only one possible)
-    nfa_arc_list *DotArcs = StartList;
-    for (size_t Idx = 0; Idx < NFA->NumArcLists; ++Idx) {
-        if (DotArcs->Label.Type == DOT) {
-            break;
+        // The last string left ActiveStates dirty. CurrentEnables is always
+        // back to how it started when we exit the loop.
+        if (ret->StatesInRegisters) {
+            *NextInstr(ret) = RI32(MOV, REG, ACTIVE_STATES_REG, 0, StartClosure[0]);
+        } else {
+            for (size_t i = 0; i < NumStateDwords; ++i) {
+                *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, ActiveStates + i*DWORD_TO_BYTES, StartClosure[i]);
+            }
+            for (size_t i = 0; i < NFA->NumCounters; ++i) {
+                *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, ActiveStates + (NumStateDwords + i)*DWORD_TO_BYTES, 0);
+            }
         }
-        DotArcs = NFANextArcList(DotArcs);
     }
-    GenInstructionsArcList(DotArcs, ret);
 
-    // Range arcs
-    nfa_arc_list *ArcList = StartList;
-    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
-        if (ArcList->Label.Type == RANGE) {
-            *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.A);
-            size_t Jump1 = ret->Count;
-            *NextInstr(ret) = J(JL);
+    // Skip ahead to the first place a match could start
+    size_t JmpToTeddy = (size_t)-1;
+    if (UseTeddy) {
+        JmpToTeddy = ret->Count;
+        *NextInstr(ret) = J(JMP);
+    }
 
-            *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.B);
-            size_t Jump2 = ret->Count;
-            *NextInstr(ret) = J(JG);
+    size_t Top = ret->Count;
 
-            GenInstructionsArcList(ArcList, ret);
+    size_t JmpToAccept = (size_t)-1;
+    if (Options.MatchSet && Options.Unanchored) {
+        // Remember which regexes matched, we keep going for the others
+        for (size_t i = 0; i < NumAcceptDwords; ++i) {
+            if (ret->StatesInRegisters) {
+                *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+            } else {
+                *NextInstr(ret) = RR32(MOVR, MEM_DISP32, StatesBaseReg, EAX, ActiveStates + i*DWORD_TO_BYTES);
+            }
+            *NextInstr(ret) = RI32(AND, REG, EAX, 0, AcceptStatesMask(NFA, i));
+            *NextInstr(ret) = RR32(OR, MEM_DISP32, EDX, EAX, i*DWORD_TO_BYTES);
+        }
+    } else if (Options.ReturnToken) {
+        // Remember where any of the accept states were active, and the lowest
+        // one since the earlier regexes win
+        size_t LastFoundJmp = (size_t)-1;
+        size_t JmpNotAccepted = (size_t)-1;
+        for (size_t i = 0; i < NumAcceptDwords; ++i) {
+            if (JmpNotAccepted != (size_t)-1) {
+                ret->Instructions[JmpNotAccepted].JumpDestIdx = ret->Count;
+            }
+            if (ret->StatesInRegisters) {
+                *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+            } else {
+                *NextInstr(ret) = RR32(MOVR, MEM_DISP32, StatesBaseReg, EAX, ActiveStates + i*DWORD_TO_BYTES);
+            }
+            *NextInstr(ret) = RI32(AND, REG, EAX, 0, AcceptStatesMask(NFA, i));
+            JmpNotAccepted = ret->Count;
+            *NextInstr(ret) = J(JE);
+            *NextInstr(ret) = RR32(BSF, REG, EAX, EAX, 0);
+            if (i != 0) {
+                *NextInstr(ret) = RI32(ADD, REG, EAX, 0, i*32);
+            }
+            if (i != NumAcceptDwords - 1) {
+                // do a linked list so we can fill in the jump dests
+                size_t NextFoundJmp = ret->Count;
+                *NextInstr(ret) = J(JMP);
+                ret->Instructions[NextFoundJmp].JumpDestIdx = LastFoundJmp;
+                LastFoundJmp = NextFoundJmp;
+            }
+        }
+        while (LastFoundJmp != (size_t)-1) {
+            size_t NextFoundJmp = ret->Instructions[LastFoundJmp].JumpDestIdx;
+            ret->Instructions[LastFoundJmp].JumpDestIdx = ret->Count;
+            LastFoundJmp = NextFoundJmp;
+        }
+        *NextInstr(ret) = RR32(MOV, REG, EDX, EBX, 0);
+        *NextInstr(ret) = RR32(MOV, MEM_DISP8, ArgsReg, EAX, LocalDisp);
+        ret->Instructions[JmpNotAccepted].JumpDestIdx = ret->Count;
+    } else if (Options.Unanchored || Options.ReturnOffset) {
+        if (ret->StatesInRegisters) {
+            *NextInstr(ret) = RI8(BT, REG, ACTIVE_STATES_REG, 0, NFA_ACCEPTSTATE);
+        } else {
+            *NextInstr(ret) = RI8(BT, MEM_DISP32, StatesBaseReg, ActiveStates, NFA_ACCEPTSTATE);
+        }
+        if (Options.ReturnOffset) { // Remember where it was active
+            size_t JmpNotAccepted = ret->Count;
+            *NextInstr(ret) = J(JAE);
+            *NextInstr(ret) = RR32(MOV, REG, EDX, EBX, 0);
+            ret->Instructions[JmpNotAccepted].JumpDestIdx = ret->Count;
+        } else { // Something already matched, we don't care what comes after it
+            JmpToAccept = ret->Count;
+            *NextInstr(ret) = J(JB);
+        }
+    }
 
-            ret->Instructions[Jump1].JumpDestIdx = ret->Count;
-            ret->Instructions[Jump2].JumpDestIdx = ret->Count;
+    // If we found the end of the string, stop processing now
+    size_t JmpToEnd;
+    if (HasStopPtr) {
+        *NextInstr(ret) = RR32(CMP, REG, EBX, ECX, 0);
+        JmpToEnd = ret->Count;
+        *NextInstr(ret) = J(JE);
+        if (Options.Reverse) {
+            *NextInstr(ret) = R32(DEC, REG, EBX, 0); // Next char in string
         }
-        ArcList = NFANextArcList(ArcList);
+    } else {
+        *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, 0);
+        JmpToEnd = ret->Count;
+        *NextInstr(ret) = J(JE);
     }
 
-    // Match Arcs
+    // Clear states to enable. The stack version is cleared when it's copied
+    // into ActiveStates at the end of the loop.
+    if (ret->StatesInRegisters) {
+        if (Options.Unanchored) {
+            *NextInstr(ret) = RI32(MOV, REG, CURRENT_ENABLES_REG, 0, StartClosure[0]);
+        } else {
+            *NextInstr(ret) = RR32(XOR, REG, CURRENT_ENABLES_REG, CURRENT_ENABLES_REG, 0);
+        }
+    }
 
     // Used for building a linked list to store which instructions need JumpDest filled in
-    size_t StartMatchCharJmp = (size_t)-1;
-    size_t LastMatchCharJmp = (size_t)-1;
     size_t LastMatchEndJmp = (size_t)-1;
 
-    // Write test and jump for each letter to match. The cases of a switch statement
-    ArcList = StartList;
-    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
-        if (ArcList->Label.Type == MATCH) {
-            *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.A);
-            size_t NextMatchCharJmp = ret->Count;
-            *NextInstr(ret) = J(JE);
-            // do a linked list so we can find where to fill in the jump dests
-            if (LastMatchCharJmp != (size_t)-1) {
-                ret->Instructions[LastMatchCharJmp].JumpDestIdx = NextMatchCharJmp;
-            } else {
-                StartMatchCharJmp = NextMatchCharJmp;
+    if (UseJumpTable) {
+        // Jump to JumpTableReg + JumpTable[*CurrChar]. Chars that aren't
+        // consumed by any arc go to the end of the switch statement.
+        *NextInstr(ret) = RR32(MOVZX, MEM, EBX, EAX, 0);
+        *NextInstr(ret) = RRS32(MOVR, MEM, JumpTableReg, EAX, EAX, DWORD_TO_BYTES, 0);
+        *NextInstr(ret) = RR32(ADD, REG, EAX, JumpTableReg, 0);
+        *NextInstr(ret) = R32(JMPI, REG, EAX, 0);
+
+        // One case for each byte class, covering every DOT, RANGE, and MATCH
+        // arc that consumes the chars in the class. Class 0 is just NUL, which
+        // is the end of the string unless it's Counted.
+        for (uint32_t Class = Options.Counted ? 0 : 1; Class < NumByteClasses; ++Class) {
+            size_t FirstByte = 0;
+            while (ret->ByteClass[FirstByte] != Class) {
+                FirstByte += 1;
+            }
+
+            size_t CaseStart = ret->Count;
+            GenInstructionsByteClass(NFA, (char)FirstByte, ret);
+            if (ret->Count == CaseStart) {
+                continue; // No arcs, leave the table pointing at the end
+            }
+            for (size_t Byte = FirstByte; Byte < 256; ++Byte) {
+                if (ret->ByteClass[Byte] == Class) {
+                    ret->Instructions[JumpTable + Byte].JumpDestIdx = CaseStart;
+                }
+            }
+
+            // again, do a linked list so we can fill in the jump dests
+            size_t NextMatchEndJmp = ret->Count;
+            *NextInstr(ret) = J(JMP);
+            ret->Instructions[NextMatchEndJmp].JumpDestIdx = LastMatchEndJmp;
+            LastMatchEndJmp = NextMatchEndJmp;
+        }
+    } else {
+        // Dot arcs (only one possible)
+        nfa_arc_list *DotArcs = StartList;
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (DotArcs->Label.Type == DOT) {
+                GenInstructionsArcList(DotArcs, ret);
+                break;
             }
-            LastMatchCharJmp = NextMatchCharJmp;
+            DotArcs = NFANextArcList(DotArcs);
         }
-        ArcList = NFANextArcList(ArcList);
-    }
 
-    // jump to the end if it's not a character we want to match
-    {
-        // again, do a linked list so we can fill in the jump dests
-        size_t NextMatchEndJmp = ret->Count;
-        *NextInstr(ret) = J(JMP);
-        ret->Instructions[NextMatchEndJmp].JumpDestIdx = LastMatchEndJmp;
-        LastMatchEndJmp = NextMatchEndJmp;
-    }
+        // Range arcs
+        ArcList = StartList;
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (ArcList->Label.Type == RANGE) {
+                *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.A);
+                size_t Jump1 = ret->Count;
+                *NextInstr(ret) = J(JL);
 
-    // Write the body of the switch statement for each char
-    ArcList = StartList;
-    for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
-        if (ArcList->Label.Type == MATCH) {
-            // Fill the last jump dest in the linked list with this location,
-            // then advance the linked list
-            size_t NextMatchCharJmp = ret->Instructions[StartMatchCharJmp].JumpDestIdx;
-            ret->Instructions[StartMatchCharJmp].JumpDestIdx = ret->Count;
-            StartMatchCharJmp = NextMatchCharJmp;
+                *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.B);
+                size_t Jump2 = ret->Count;
+                *NextInstr(ret) = J(JG);
 
-            GenInstructionsArcList(ArcList, ret);
+                GenInstructionsArcList(ArcList, ret);
 
+                ret->Instructions[Jump1].JumpDestIdx = ret->Count;
+                ret->Instructions[Jump2].JumpDestIdx = ret->Count;
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+
+        // Match Arcs
+
+        // Used for building a linked list to store which instructions need JumpDest filled in
+        size_t StartMatchCharJmp = (size_t)-1;
+        size_t LastMatchCharJmp = (size_t)-1;
+
+        // Write test and jump for each letter to match. The cases of a switch statement
+        ArcList = StartList;
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (ArcList->Label.Type == MATCH) {
+                *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, ArcList->Label.A);
+                size_t NextMatchCharJmp = ret->Count;
+                *NextInstr(ret) = J(JE);
+                // do a linked list so we can find where to fill in the jump dests
+                if (LastMatchCharJmp != (size_t)-1) {
+                    ret->Instructions[LastMatchCharJmp].JumpDestIdx = NextMatchCharJmp;
+                } else {
+                    StartMatchCharJmp = NextMatchCharJmp;
+                }
+                LastMatchCharJmp = NextMatchCharJmp;
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+
+        // jump to the end if it's not a character we want to match
+        {
             // again, do a linked list so we can fill in the jump dests
             size_t NextMatchEndJmp = ret->Count;
             *NextInstr(ret) = J(JMP);
             ret->Instructions[NextMatchEndJmp].JumpDestIdx = LastMatchEndJmp;
             LastMatchEndJmp = NextMatchEndJmp;
         }
-        ArcList = NFANextArcList(ArcList);
+
+        // Write the body of the switch statement for each char
+        ArcList = StartList;
+        for (size_t ArcListIdx = 1; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (ArcList->Label.Type == MATCH) {
+                // Fill the last jump dest in the linked list with this location,
+                // then advance the linked list
+                size_t NextMatchCharJmp = ret->Instructions[StartMatchCharJmp].JumpDestIdx;
+                ret->Instructions[StartMatchCharJmp].JumpDestIdx = ret->Count;
+                StartMatchCharJmp = NextMatchCharJmp;
+
+                GenInstructionsArcList(ArcList, ret);
+
+                // again, do a linked list so we can fill in the jump dests
+                size_t NextMatchEndJmp = ret->Count;
+                *NextInstr(ret) = J(JMP);
+                ret->Instructions[NextMatchEndJmp].JumpDestIdx = LastMatchEndJmp;
+                LastMatchEndJmp = NextMatchEndJmp;
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
     }
 
     // Fill in the break jump locations
@@ -289,28 +1656,315 @@ GeneratedInstructions GenerateInstructions(nfa *NFA, mem_arena *Arena) {
         ret->Instructions[LastMatchEndJmp].JumpDestIdx = MatchEnd;
         LastMatchEndJmp = NextMatchEndJmp;
     }
+    for (size_t Byte = 0; UseJumpTable && Byte < 256; ++Byte) {
+        if (ret->Instructions[JumpTable + Byte].JumpDestIdx == (size_t)-1) {
+            ret->Instructions[JumpTable + Byte].JumpDestIdx = MatchEnd;
+        }
+    }
 
-    // Disable the states to disable, and enable the states to enable (unrolled)
-    for (size_t i = 0; i < NumStateDwords; ++i) {
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, CurrentDisables - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = RR32(AND, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES); // Disable the states to disable
-      *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, CurrentEnables - i*DWORD_TO_BYTES);
-      *NextInstr(ret) = RR32(OR, MEM_DISP32, EBP, EAX, ActiveStates - i*DWORD_TO_BYTES); // Enable the states to enable
+    // Consuming a character disables every active state, so the new active
+    // states are just the states to enable (unrolled)
+    // With Teddy, when nothing is active skip ahead to the next place a match
+    // could start instead of running the NFA on every char
+    const bool CheckDead = (ExitWhenDead || UseTeddy);
+    size_t JmpWhenDead = (size_t)-1;
+    if (ret->StatesInRegisters) {
+        *NextInstr(ret) = RR32(MOV, REG, ACTIVE_STATES_REG, CURRENT_ENABLES_REG, 0);
+        if (ExitWhenDead) {
+            *NextInstr(ret) = RI32(CMP, REG, ACTIVE_STATES_REG, 0, 0);
+            JmpWhenDead = ret->Count;
+            *NextInstr(ret) = J(JE);
+        }
+    } else {
+        // 4 dwords at a time, clearing CurrentEnables for the next character
+        if (CheckDead) {
+            *NextInstr(ret) = RX(PXOR, REG, XMM2, XMM2, 0);
+        }
+        for (size_t i = 0; i < NumStateXmms; ++i) {
+          *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, StatesBaseReg, XMM1, CurrentEnables + i*XMM_TO_BYTES);
+          *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM1, ActiveStates + i*XMM_TO_BYTES);
+          *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM0, CurrentEnables + i*XMM_TO_BYTES);
+          if (CheckDead) {
+              *NextInstr(ret) = RX(POR, REG, XMM1, XMM2, 0); // xmm2 |= xmm1
+          }
+        }
+        if (CheckDead) { // Every byte of xmm2 is 0
+            *NextInstr(ret) = RX(PCMPEQB, REG, XMM0, XMM2, 0);
+            *NextInstr(ret) = RX(PMOVMSKB, REG, XMM2, EAX, 0);
+            *NextInstr(ret) = RI32(CMP, REG, EAX, 0, 0xFFFF);
+            JmpWhenDead = ret->Count;
+            *NextInstr(ret) = J(JE);
+        }
+    }
+    if (UseTeddy) {
+        // Something is still going, so keep starting matches at every char
+        // until it dies
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            if (StartClosure[i] == 0) {
+                continue;
+            }
+            *NextInstr(ret) = RI32(OR, MEM_DISP32, StatesBaseReg, ActiveStates + i*DWORD_TO_BYTES, StartClosure[i]);
+        }
+    } else if (!ret->StatesInRegisters && Options.Unanchored) {
+        // Start matching again at the next char
+        for (size_t i = 0; i < NumStateDwords; ++i) {
+            if (StartClosure[i] == 0) {
+                continue; // Already cleared
+            }
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, CurrentEnables + i*DWORD_TO_BYTES, StartClosure[i]);
+        }
     }
 
-    *NextInstr(ret) = R32(INC, REG, EBX, 0); // Next char in string
+    if (!Options.Reverse) {
+        *NextInstr(ret) = R32(INC, REG, EBX, 0); // Next char in string
+    }
     *NextInstr(ret) = JD(JMP, Top);
 
     ret->Instructions[JmpToEnd].JumpDestIdx = ret->Count;
-    // Return != 0 in eax if accept state was active, 0 otherwise
-    *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EBP, EAX, ActiveStates);
-    *NextInstr(ret) = RI32(AND, REG, EAX, 0, 1 << NFA_ACCEPTSTATE);
-
-    *NextInstr(ret) = RR32(MOV, REG, ESP, EBP, 0); // restore the stack
-    *NextInstr(ret) = R32(POP, REG, ESI, 0); // Callee save
-    *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
-    *NextInstr(ret) = R32(POP, REG, EBP, 0); // Callee save
+    if (JmpToAccept != (size_t)-1) {
+        ret->Instructions[JmpToAccept].JumpDestIdx = ret->Count;
+    }
+    if (JmpWhenDead != (size_t)-1 && !UseTeddy) {
+        ret->Instructions[JmpWhenDead].JumpDestIdx = ret->Count;
+    }
+    if (Options.Batch) {
+        // Set or clear the bit for this string, then go on to the next one
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, OutArgDisp);
+        if (ret->StatesInRegisters) {
+            *NextInstr(ret) = RI8(BT, REG, ACTIVE_STATES_REG, 0, NFA_ACCEPTSTATE);
+        } else {
+            *NextInstr(ret) = RI8(BT, MEM_DISP32, StatesBaseReg, ActiveStates, NFA_ACCEPTSTATE);
+        }
+        size_t JmpNotMatched = ret->Count;
+        *NextInstr(ret) = J(JNC);
+        *NextInstr(ret) = RR32(BTS, MEM, EAX, EDX, 0);
+        *NextInstr(ret) = R32(INC, MEM_DISP8, ArgsReg, LocalDisp);
+        size_t JmpToNextString = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpNotMatched].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(BTR, MEM, EAX, EDX, 0);
+        ret->Instructions[JmpToNextString].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = R32(INC, REG, EDX, 0);
+        *NextInstr(ret) = JD(JMP, BatchTop);
+
+        ret->Instructions[JmpToBatchDone].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, LocalDisp);
+    }
+    if (Options.Stream) { // Save the states for the next chunk
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EAX, ContextArgDisp);
+        *NextInstr(ret) = RI32(MOV, MEM, EAX, 0, 1); // Context->Started
+        if (ret->StatesInRegisters) {
+            *NextInstr(ret) = RR32(MOV, MEM_DISP8, EAX, ACTIVE_STATES_REG, STREAM_STATES_OFFSET);
+        } else {
+            for (size_t i = 0; i < NumStateXmms; ++i) {
+                *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, StatesBaseReg, XMM1, ActiveStates + i*XMM_TO_BYTES);
+                *NextInstr(ret) = RX(MOVDQU, MEM_DISP32, EAX, XMM1, STREAM_STATES_OFFSET + i*XMM_TO_BYTES);
+            }
+            for (int32_t Offset = 0; Offset < CounterRingBytes; Offset += XMM_TO_BYTES) {
+                *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, StatesBaseReg, XMM1, ret->CounterRings + Offset);
+                *NextInstr(ret) = RX(MOVDQU, MEM_DISP32, EAX, XMM1, STREAM_STATES_OFFSET + NumStateBytes + Offset);
+            }
+        }
+    }
+    if (Options.ReturnOffset) {
+        // Return edx - Ptr, or DFRE_NO_MATCH if edx is 0
+        if (!Options.Reverse) { // Otherwise it's already in ecx
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, ECX, StrArgDisp);
+        }
+        *NextInstr(ret) = RR32(MOV, REG, EAX, EDX, 0);
+        *NextInstr(ret) = RR32(SUB, REG, EAX, ECX, 0);
+        *NextInstr(ret) = RI32(CMP, REG, EDX, 0, 0);
+        size_t JmpFoundMatch = ret->Count;
+        *NextInstr(ret) = J(JNE);
+        *NextInstr(ret) = RI32(MOV, REG, EAX, 0, DFRE_NO_MATCH);
+        size_t JmpNoToken = (size_t)-1;
+        if (Options.ReturnToken) {
+            JmpNoToken = ret->Count;
+            *NextInstr(ret) = J(JMP);
+        }
+        ret->Instructions[JmpFoundMatch].JumpDestIdx = ret->Count;
+        if (Options.ReturnToken) {
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, ECX, OutArgDisp);
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ArgsReg, EDX, LocalDisp);
+            *NextInstr(ret) = RR32(MOV, MEM, ECX, EDX, 0);
+            ret->Instructions[JmpNoToken].JumpDestIdx = ret->Count;
+        }
+    }
+    if (Options.MatchSet) {
+        // Fill in the bitmap, unless it already was, and return != 0 in eax if
+        // any regex matched
+        *NextInstr(ret) = RR32(XOR, REG, ECX, ECX, 0);
+        for (size_t i = 0; i < NumAcceptDwords; ++i) {
+            if (Options.Unanchored) {
+                *NextInstr(ret) = RR32(MOVR, MEM_DISP32, EDX, EAX, i*DWORD_TO_BYTES);
+            } else {
+                if (ret->StatesInRegisters) {
+                    *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+                } else {
+                    *NextInstr(ret) = RR32(MOVR, MEM_DISP32, StatesBaseReg, EAX, ActiveStates + i*DWORD_TO_BYTES);
+                }
+                *NextInstr(ret) = RI32(AND, REG, EAX, 0, AcceptStatesMask(NFA, i));
+                *NextInstr(ret) = RR32(MOV, MEM_DISP32, EDX, EAX, i*DWORD_TO_BYTES);
+            }
+            *NextInstr(ret) = RR32(OR, REG, ECX, EAX, 0);
+        }
+        *NextInstr(ret) = RR32(MOV, REG, EAX, ECX, 0);
+    }
+    // Otherwise return != 0 in eax if accept state was active, 0 otherwise
+    if (ret->StatesInRegisters) {
+        if (!Options.ReturnOffset && !Options.MatchSet && !Options.Batch) {
+            *NextInstr(ret) = RR32(MOV, REG, EAX, ACTIVE_STATES_REG, 0);
+            *NextInstr(ret) = RI32(AND, REG, EAX, 0, 1 << NFA_ACCEPTSTATE);
+        }
+
+        if (Options.ReturnToken || Options.Batch) {
+            *NextInstr(ret) = R32(POP, REG, ECX, 0); // The token or number of matches
+        }
+        if (UseJumpTable) {
+            *NextInstr(ret) = R32(POP, REG, JumpTableReg, 0); // Callee save
+        }
+        *NextInstr(ret) = R32(POP, REG, EDI, 0); // Callee save
+        *NextInstr(ret) = R32(POP, REG, ESI, 0); // Callee save
+        *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+    } else {
+        if (!Options.ReturnOffset && !Options.MatchSet && !Options.Batch) {
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP32, StatesBaseReg, EAX, ActiveStates);
+            *NextInstr(ret) = RI32(AND, REG, EAX, 0, 1 << NFA_ACCEPTSTATE);
+        }
+        if (UseScratch) {
+            // Leave the buffer zeroed for the next call. CurrentEnables was
+            // cleared when it was copied, except for the start closure.
+            for (size_t i = 0; i < NumStateXmms; ++i) {
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM0, ActiveStates + i*XMM_TO_BYTES);
+            }
+            for (int32_t Offset = 0; Offset < CounterRingBytes; Offset += XMM_TO_BYTES) {
+                *NextInstr(ret) = RX(MOVDQA, MEM_DISP32, StatesBaseReg, XMM0, ret->CounterRings + Offset);
+            }
+            for (size_t i = 0; Options.Unanchored && i < NumStateDwords; ++i) {
+                if (StartClosure[i] == 0) {
+                    continue; // Already cleared
+                }
+                *NextInstr(ret) = RI32(MOV, MEM_DISP32, StatesBaseReg, CurrentEnables + i*DWORD_TO_BYTES, 0);
+            }
+        }
+
+        *NextInstr(ret) = RR32(MOV, REG, ESP, EBP, 0); // restore the stack
+        if (Options.ReturnToken || Options.Batch) {
+            *NextInstr(ret) = R32(POP, REG, ECX, 0); // The token or number of matches
+        }
+        if (UseJumpTable) {
+            *NextInstr(ret) = R32(POP, REG, JumpTableReg, 0); // Callee save
+        }
+        if (UseScratch) {
+            *NextInstr(ret) = R32(POP, REG, StatesBaseReg, 0); // Callee save
+        }
+        *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+        *NextInstr(ret) = R32(POP, REG, EBP, 0); // Callee save
+    }
     *NextInstr(ret) = RET;
 
+    if (UseTeddy) {
+        size_t TeddyScan = GenInstructionsTeddy(&Teddy, Options.Counted, TeddyBase, StartClosure,
+                                                NumStateDwords, ActiveStates, Top, ret);
+        ret->Instructions[JmpToTeddy].JumpDestIdx = TeddyScan;
+        // Past the char that killed the last match attempt
+        ret->Instructions[JmpWhenDead].JumpDestIdx = TeddyScan - 1;
+    }
+
+    ArenaFree(&ret->Scratch);
     return Result;
 }
+
+// Where a match is in the search string: Str[Start] up to but not including
+// Str[End]
+struct match_offsets {
+    uint32_t Start;
+    uint32_t End;
+};
+
+// Function pointer type for calling code generated with ReturnOffset
+extern "C" typedef uint32_t (*dfreOffset)(const char *Str);
+
+// Function pointer type for calling code generated with Counted
+extern "C" typedef uint32_t (*dfreMatchCounted)(const uint8_t *Ptr, size_t Len);
+
+/**
+ * Find the leftmost longest match in Str with two pieces of generated code:
+ *
+ *  - FindStart is for the NFA after NFAReverse, generated with Reverse,
+ *    Unanchored, and ReturnOffset. It runs from the end of the string back to
+ *    the start and returns where the leftmost match begins.
+ *  - FindEnd is for the original NFA, generated with just ReturnOffset. It
+ *    runs forward from there and returns the length of the longest match.
+ *
+ * Returns false and leaves Match alone if nothing matched.
+ */
+bool FindMatchOffsets(dfreOffset FindStart, dfreOffset FindEnd,
+                      const char *Str, match_offsets *Match) {
+    uint32_t Start = FindStart(Str);
+    if (Start == DFRE_NO_MATCH) {
+        return false;
+    }
+    uint32_t Length = FindEnd(Str + Start);
+    // A match starts here, so the forward pass has to find it
+    Assert(Length != DFRE_NO_MATCH);
+    Match->Start = Start;
+    Match->End = Start + Length;
+    return true;
+}
+
+// Function pointer type for calling code generated with Stream. Feed it each
+// chunk of the stream in order. Returns != 0 if the stream so far matches (or
+// contains a match, when Unanchored).
+extern "C" typedef uint32_t (*dfreStreamFeed)(stream_context *Context,
+                                              const uint8_t *Ptr, size_t Len);
+
+// Bytes needed for a stream_context for code generated from the NFA
+size_t StreamContextSize(nfa *NFA) {
+    return STREAM_STATES_OFFSET + NFANumStateXmms(NFA) * XMM_TO_BYTES +
+           CounterRingOffset(NFA, NFA->NumCounters);
+}
+
+// Function pointer type for calling code generated with MatchSet. Matched needs
+// a bit for each regex, it's filled in on every call.
+extern "C" typedef uint32_t (*dfreMatchSet)(uint32_t *Matched, const char *Str);
+
+// Function pointer type for calling code generated with ReturnToken and
+// Counted. Returns the length of the token at the start of Ptr and writes which
+// regex it's for to Token, or returns DFRE_NO_MATCH and leaves Token alone.
+// Call it again at Ptr + the length for the next token.
+extern "C" typedef uint32_t (*dfreScan)(uint32_t *Token, const uint8_t *Ptr, size_t Len);
+
+// Function pointer type for calling code generated with Batch. String i is
+// Data[Offsets[i]] up to Data[Offsets[i + 1]], so Offsets has NumStrings + 1
+// entries. Sets bit i of Results if string i matched and clears it otherwise.
+// Returns the number that matched.
+extern "C" typedef uint32_t (*dfreMatchBatch)(uint32_t *Results, const uint32_t *Offsets,
+                                              const uint8_t *Data, size_t NumStrings);
+
+// Function pointer type for calling code generated with CallerScratch. Scratch
+// is reused between calls, so only one thread can use it at a time.
+extern "C" typedef uint32_t (*dfreMatchScratch)(void *Scratch, const char *Str);
+
+/**
+ * Bytes needed for the Scratch argument of code generated from the NFA with
+ * CallerScratch.
+ *
+ * It has to be 16 byte aligned and zeroed before the first call. The generated
+ * code leaves it zeroed when it returns so it can be reused without clearing.
+ * When the states fit in registers the code never touches it.
+ */
+size_t ScratchSize(nfa *NFA) {
+    return 2 * NFANumStateXmms(NFA) * XMM_TO_BYTES + CounterRingOffset(NFA, NFA->NumCounters);
+}
+
+// Start a new stream, the next chunk fed in begins at the start state
+void StreamBegin(stream_context *Context) {
+    Context->Started = 0;
+}
+
+// Returns true if the whole stream matched (or any part of it, when
+// Unanchored). The context can be reused after another StreamBegin.
+bool StreamEnd(dfreStreamFeed Feed, stream_context *Context) {
+    return Feed(Context, (const uint8_t *)0, 0) != 0;
+}
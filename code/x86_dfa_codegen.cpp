@@ -0,0 +1,243 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// Full DFA code generator
+//
+// For small patterns we can determinize the NFA ahead of time and generate one
+// block of code per DFA state. The current state is then just which block the
+// CPU is executing (the instruction pointer) so there's no state bitset at all.
+// Each character costs a load, a few compares, and a jump to the next block.
+//
+// Uses the same instruction list and assembler as x86_codegen.cpp, and the
+// generated function has the same dfreMatch signature. Include it after
+// x86_codegen.cpp since it uses GeneratedInstructions and NextInstr from there.
+
+#include "dfa.h"
+#include "x86_opcode.h"
+#include "mem_arena.h"
+
+// Past this we use GenerateInstructions. Each state can take up to 256
+// compares, and the DFA can be exponentially larger than the NFA.
+#define DFA_MAX_JIT_STATES 256
+
+// Where the code for a DFA state goes after reading a byte. Either a DFA state
+// number or one of these exits.
+inline uint32_t DFAByteTarget(dfa *DFA, uint32_t State, uint32_t Byte,
+                              bool StopAtAccept, bool NulIsEnd) {
+    const uint32_t ExitAccept = DFA->NumStates;
+    const uint32_t ExitReject = DFA->NumStates + 1;
+    if (StopAtAccept && DFA->Accept[State]) { // Found a match, stop searching
+        return ExitAccept;
+    }
+    if (Byte == 0 && NulIsEnd) { // End of the string
+        return DFA->Accept[State] ? ExitAccept : ExitReject;
+    }
+    uint32_t Next = DFA->Next[State * 256 + Byte];
+    return DFA->Dead[Next] ? ExitReject : Next;
+}
+
+// Number of runs of consecutive bytes that go to the same place from the state
+uint32_t DFACountByteRuns(dfa *DFA, uint32_t State, bool StopAtAccept, bool NulIsEnd) {
+    uint32_t Runs = 1;
+    for (uint32_t Byte = 1; Byte < 256; ++Byte) {
+        if (DFAByteTarget(DFA, State, Byte, StopAtAccept, NulIsEnd) !=
+            DFAByteTarget(DFA, State, Byte - 1, StopAtAccept, NulIsEnd))
+        {
+            Runs += 1;
+        }
+    }
+    return Runs;
+}
+
+/**
+ * Generate code for the determinized NFA with one block per DFA state.
+ *
+ * Returns a result with Count == 0 if the DFA would have more than
+ * DFA_MAX_JIT_STATES states, or for a Stream since the DFA state is only the
+ * instruction pointer so there's nothing to save between chunks. MatchSet,
+ * ReturnToken, and Batch aren't supported either, and neither are NFAs with
+ * counters. Use GenerateInstructions in those cases.
+ *
+ * For an Unanchored search the blocks for accepting states just jump to
+ * Accept, without reading the next char.
+ *
+ * Structure of the generated code:
+ *
+ *     ebx = char *CurrChar
+ *
+ *     State_N:
+ *       mov al, [ebx]
+ *       inc ebx
+ *       ; One compare per run of bytes with the same next state, in
+ *       ; increasing order. Byte 0 (the end) is always its own run.
+ *       cmp al, LastByteOfRun1
+ *       jbe Run1Target
+ *       cmp al, LastByteOfRun2
+ *       jbe Run2Target
+ *       ...
+ *       jmp LastRunTarget
+ *
+ *     Accept: return 1
+ *     Reject: return 0
+ *
+ * With ReturnOffset, accepting blocks start with mov edx, ebx and both exits
+ * return the offset of edx (see codegen_options). When Reverse or Counted,
+ * blocks first compare ebx to the place to stop in ecx, and Reverse reads the
+ * char before ebx instead.
+ */
+GeneratedInstructions GenerateDFAInstructions(nfa *NFA, mem_arena *Arena,
+                                              codegen_options Options = {}) {
+    GeneratedInstructions Result = {};
+    if (Options.Stream || Options.MatchSet || Options.ReturnToken || Options.Batch ||
+        NFA->NumCounters > 0)
+    {
+        return Result;
+    }
+    Result.Arena = Arena;
+    Result.Scratch = ArenaInit();
+    GeneratedInstructions *ret = &Result; // Just an alias for consistency
+    nfa_literal Literal = PrefilterLiteral(NFA, Options, ret);
+
+    const bool StopAtAccept = Options.Unanchored && !Options.ReturnOffset;
+    const bool HasStopPtr = (Options.Reverse || Options.Counted);
+    const bool NulIsEnd = !Options.Counted;
+    dfa DFA = NFAToDFA(NFA, &ret->Scratch, DFA_MAX_JIT_STATES,
+                       Options.Unanchored, StopAtAccept);
+    if (DFA.NumStates == 0) {
+        ArenaFree(&ret->Scratch);
+        return Result;
+    }
+    const uint32_t ExitAccept = DFA.NumStates;
+    const uint32_t ExitReject = DFA.NumStates + 1;
+
+    Result.Instructions = (instruction *)(Arena->Base + Arena->Used);
+
+    // Where the string arguments are on the stack. There are no state bitsets
+    // so the CallerScratch buffer isn't used.
+    const int32_t ArgsDisp = (Options.CallerScratch ? 3 : 2)*DWORD_TO_BYTES;
+    *NextInstr(ret) = R32(PUSH, REG, EBX, 0); // Callee save
+    *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, EBX, ArgsDisp); // Get pointer to the search string off the stack
+    if (Options.Counted && Options.Reverse) {
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EBX, 0);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, EAX, ArgsDisp + DWORD_TO_BYTES); // Len
+        *NextInstr(ret) = RR32(ADD, REG, EBX, EAX, 0);
+    } else if (Options.Counted) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, ECX, ArgsDisp + DWORD_TO_BYTES); // Len
+        *NextInstr(ret) = RR32(ADD, REG, ECX, EBX, 0);
+    } else if (Options.Reverse) {
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EBX, 0);
+        // Find the end of the string
+        size_t FindEnd = ret->Count;
+        *NextInstr(ret) = RI8(CMP, MEM, EBX, 0, 0);
+        *NextInstr(ret) = JD(JE, FindEnd + 4);
+        *NextInstr(ret) = R32(INC, REG, EBX, 0);
+        *NextInstr(ret) = JD(JMP, FindEnd);
+    }
+    if (Literal.Length > 0) {
+        GenInstructionsPrefilter(&Literal, Options.Counted, ret);
+    }
+    if (Options.ReturnOffset) {
+        *NextInstr(ret) = RR32(XOR, REG, EDX, EDX, 0);
+    }
+    size_t JmpToReject = (size_t)-1;
+    if (DFA.Dead[0]) { // Nothing matches, not even the empty string
+        JmpToReject = ret->Count;
+        *NextInstr(ret) = J(JMP);
+    }
+    // Otherwise fall through into the start state
+
+    // Find the instruction index where each block starts so we can jump
+    // forwards. The two exits go at the end.
+    uint32_t *BlockStart = (uint32_t *)Alloc(&ret->Scratch, (DFA.NumStates + 2) * sizeof(uint32_t));
+    size_t NextBlock = ret->Count;
+    for (uint32_t State = 0; State < DFA.NumStates; ++State) {
+        BlockStart[State] = NextBlock;
+        if (DFA.Dead[State]) {
+            continue;
+        }
+        if (StopAtAccept && DFA.Accept[State]) {
+            NextBlock += 1;
+            continue;
+        }
+        if (Options.ReturnOffset && DFA.Accept[State]) {
+            NextBlock += 1;
+        }
+        NextBlock += HasStopPtr ? 4 : 2;
+        NextBlock += 2 * (DFACountByteRuns(&DFA, State, StopAtAccept, NulIsEnd) - 1) + 1;
+    }
+    BlockStart[ExitAccept] = NextBlock;
+    BlockStart[ExitReject] = Options.ReturnOffset ? NextBlock : NextBlock + 3;
+    if (JmpToReject != (size_t)-1) {
+        ret->Instructions[JmpToReject].JumpDestIdx = BlockStart[ExitReject];
+    }
+
+    for (uint32_t State = 0; State < DFA.NumStates; ++State) {
+        if (DFA.Dead[State]) {
+            continue;
+        }
+        Assert(ret->Count == BlockStart[State]);
+        if (StopAtAccept && DFA.Accept[State]) { // Found a match, stop searching
+            *NextInstr(ret) = JD(JMP, BlockStart[ExitAccept]);
+            continue;
+        }
+
+        if (Options.ReturnOffset && DFA.Accept[State]) {
+            *NextInstr(ret) = RR32(MOV, REG, EDX, EBX, 0); // Remember where it was active
+        }
+        if (HasStopPtr) {
+            // Go where the NUL at the end of the string would
+            const uint32_t EndTarget = DFA.Accept[State] ? ExitAccept : ExitReject;
+            *NextInstr(ret) = RR32(CMP, REG, EBX, ECX, 0);
+            *NextInstr(ret) = JD(JE, BlockStart[EndTarget]);
+        }
+        if (Options.Reverse) {
+            *NextInstr(ret) = R32(DEC, REG, EBX, 0); // Next char in string
+            *NextInstr(ret) = RR8(MOVR, MEM, EBX, EAX, 0); // Load the current char
+        } else {
+            *NextInstr(ret) = RR8(MOVR, MEM, EBX, EAX, 0); // Load the current char
+            *NextInstr(ret) = R32(INC, REG, EBX, 0); // Next char in string
+        }
+
+        uint32_t RunTarget = DFAByteTarget(&DFA, State, 0, StopAtAccept, NulIsEnd);
+        for (uint32_t Byte = 1; Byte < 256; ++Byte) {
+            uint32_t Target = DFAByteTarget(&DFA, State, Byte, StopAtAccept, NulIsEnd);
+            if (Target != RunTarget) {
+                // The run ended on the last byte, everything below it has
+                // already been handled
+                *NextInstr(ret) = RI8(CMP, REG, EAX, 0, Byte - 1);
+                *NextInstr(ret) = JD(JBE, BlockStart[RunTarget]);
+                RunTarget = Target;
+            }
+        }
+        *NextInstr(ret) = JD(JMP, BlockStart[RunTarget]);
+    }
+
+    Assert(ret->Count == BlockStart[ExitAccept]);
+    if (Options.ReturnOffset) {
+        // Return edx - Ptr, or DFRE_NO_MATCH if edx is 0
+        if (!Options.Reverse) { // Otherwise it's already in ecx
+            *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, ECX, ArgsDisp);
+        }
+        *NextInstr(ret) = RR32(MOV, REG, EAX, EDX, 0);
+        *NextInstr(ret) = RR32(SUB, REG, EAX, ECX, 0);
+        *NextInstr(ret) = RI32(CMP, REG, EDX, 0, 0);
+        size_t JmpFoundMatch = ret->Count;
+        *NextInstr(ret) = J(JNE);
+        *NextInstr(ret) = RI32(MOV, REG, EAX, 0, DFRE_NO_MATCH);
+        ret->Instructions[JmpFoundMatch].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+        *NextInstr(ret) = RET;
+    } else {
+        *NextInstr(ret) = RI32(MOV, REG, EAX, 0, 1);
+        *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+        *NextInstr(ret) = RET;
+
+        Assert(ret->Count == BlockStart[ExitReject]);
+        *NextInstr(ret) = RR32(XOR, REG, EAX, EAX, 0);
+        *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+        *NextInstr(ret) = RET;
+    }
+
+    ArenaFree(&ret->Scratch);
+    return Result;
+}
@@ -0,0 +1,341 @@
+// Copyright (c) 2016-2019 Andrew Kallmeyer <fsmv@sapium.net>
+// Provided under the MIT License: https://mit-license.org
+
+// SIMD lanes code generator
+//
+// For a Batch of strings and an NFA small enough that the states fit in one
+// dword, we can run the same bitset simulation as GenerateInstructions on 4
+// strings at once, one in each dword of an SSE2 register. Instead of jumping
+// to the code for each char we compute a mask of the lanes the code applies
+// to, so every lane runs the same instructions.
+//
+// Uses the same instruction list and assembler as x86_codegen.cpp, and the
+// generated function has the same dfreMatchBatch signature. Include it after
+// x86_codegen.cpp since it uses GeneratedInstructions and NextInstr from there.
+
+#include "nfa.h"
+#include "nfa_passes.h"
+#include "x86_opcode.h"
+#include "mem_arena.h"
+
+#define LANES_PER_XMM 4
+
+// Class of a lane that's past the end of its string. No arcs consume it.
+#define LANE_END_CLASS ((uint32_t) -1)
+
+// Values we need in every lane of an xmm register. They're written to the
+// stack once per call, since there's no instruction to splat an immediate.
+struct lane_constants {
+    uint32_t *Values;
+    uint32_t Count;
+    int32_t BaseDisp; // ESP offset of the first one
+};
+
+// ESP offset of the constant, adding it if it's new
+int32_t LaneConstant(lane_constants *Constants, uint32_t Value) {
+    uint32_t Idx = 0;
+    for (; Idx < Constants->Count; ++Idx) {
+        if (Constants->Values[Idx] == Value) {
+            break;
+        }
+    }
+    if (Idx == Constants->Count) {
+        Constants->Values[Constants->Count++] = Value;
+    }
+    return Constants->BaseDisp + Idx * XMM_TO_BYTES;
+}
+
+/**
+ * Generate code for a Batch that matches 4 strings at a time.
+ *
+ * Returns a result with Count == 0 if the NFA has more than 32 states or any
+ * counters, or without Batch. Use GenerateInstructions in that case.
+ * CallerScratch is accepted but the buffer isn't used.
+ *
+ * Structure of the generated code:
+ *
+ *     ebp = the stack before it's aligned, for the arguments
+ *     edx = the index of the first string of the group of 4
+ *     esp[] = the lane arrays, byte class table, then the lane constants
+ *     xmm0 = ActiveStates, xmm1 = CurrentEnables, xmm2 = the class of each
+ *     lane's char, xmm6 = the lanes that matched
+ *
+ *     Group:
+ *       if edx >= NumStrings: return the number matched
+ *       load the pointer and end of each lane's string (empty past the end)
+ *       xmm0 = StartClosure, xmm6 = 0
+ *     Step:
+ *       for each lane: xmm2[lane] = ByteClass[*Ptr++], or LANE_END_CLASS
+ *       xmm6 |= the lanes with the accept state active that are at the end
+ *       if every lane is at the end: write the results, edx += 4, goto Group
+ *       xmm1 = 0
+ *       for each byte class with arcs:
+ *         xmm3 = the lanes with a char in the class
+ *         for each state with arcs consuming the class:
+ *           xmm1 |= ActivateMask in the lanes in xmm3 where the state is active
+ *       xmm0 = xmm1
+ *       goto Step
+ *
+ * Unanchored works the same way as in GenerateInstructions, except every lane
+ * runs to the end of its string.
+ */
+GeneratedInstructions GenerateLanesInstructions(nfa *NFA, mem_arena *Arena,
+                                                codegen_options Options = {}) {
+    GeneratedInstructions Result = {};
+    if (!Options.Batch || NFANumStateDwords(NFA) != 1 || NFA->NumCounters > 0) {
+        return Result;
+    }
+    Result.Arena = Arena;
+    Result.Scratch = ArenaInit();
+    Result.NumStateDwords = 1;
+    Result.NumStateXmms = 1;
+    GeneratedInstructions *ret = &Result; // Just an alias for consistency
+
+    // ESP offsets of the stack arrays
+    const int32_t LaneClasses = 0;
+    const int32_t LanePtrs = LaneClasses + XMM_TO_BYTES;
+    const int32_t LaneEnds = LanePtrs + XMM_TO_BYTES;
+    const int32_t ByteClassTable = LaneEnds + XMM_TO_BYTES;
+
+    // Get the pointers after the last Alloc since the arena can move. There's
+    // at most one ActivateMask for each state and class, plus a constant for
+    // each state and class, the start closure, and LANE_END_CLASS.
+    const size_t MaxConstants = (32 + 1) * 256 + 32 + 2;
+    Alloc(&ret->Scratch, MaxConstants * sizeof(uint32_t));
+    const size_t MergedTransitionsOffset = ret->Scratch.Used;
+    size_t NumTransitions = 0;
+    nfa_arc_list *ArcList = NFAFirstArcList(NFA);
+    for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+        NumTransitions += ArcList->NumTransitions;
+        ArcList = NFANextArcList(ArcList);
+    }
+    Alloc(&ret->Scratch, NumTransitions * sizeof(nfa_transition));
+    const size_t ByteClassOffset = ret->Scratch.Used;
+    Alloc(&ret->Scratch, 256);
+    ret->EpsilonClosures = NFAEpsilonClosures(NFA, &ret->Scratch);
+    lane_constants Constants = {};
+    Constants.Values = (uint32_t *)ret->Scratch.Base;
+    Constants.BaseDisp = ByteClassTable + 256;
+    ret->MergedTransitions = (nfa_transition *)(ret->Scratch.Base + MergedTransitionsOffset);
+    ret->ByteClass = ret->Scratch.Base + ByteClassOffset;
+    ret->Instructions = (instruction *)(Arena->Base + Arena->Used);
+
+    const uint32_t NumByteClasses = NFAByteClasses(NFA, ret->ByteClass);
+    const uint32_t StartClosure = ret->EpsilonClosures[NFA->StartState];
+
+    // The arguments after pushing ebp, ebx, and the number of matches
+    const int32_t ResultsArgDisp = (3 + 1 + (Options.CallerScratch ? 1 : 0))*DWORD_TO_BYTES;
+    const int32_t OffsetsArgDisp = ResultsArgDisp + DWORD_TO_BYTES;
+    const int32_t DataArgDisp = OffsetsArgDisp + DWORD_TO_BYTES;
+    const int32_t NumStringsArgDisp = DataArgDisp + DWORD_TO_BYTES;
+    const int32_t NumMatchedDisp = 0;
+
+    *NextInstr(ret) = R32(PUSH, REG, EBP, 0); // Callee save
+    *NextInstr(ret) = R32(PUSH, REG, EBX, 0); // Callee save
+    *NextInstr(ret) = RR32(XOR, REG, EAX, EAX, 0);
+    *NextInstr(ret) = R32(PUSH, REG, EAX, 0); // Number of matches
+    *NextInstr(ret) = RR32(MOV, REG, EBP, ESP, 0); // save the start of the stack
+    size_t MakeRoom = ret->Count;
+    *NextInstr(ret) = RI32(SUB, REG, ESP, 0, 0); // Filled in when we know how many constants there are
+    *NextInstr(ret) = RI32(AND, REG, ESP, 0, ~(XMM_TO_BYTES - 1)); // Align for MOVDQA
+
+    // The byte class table, 4 bytes at a time
+    for (size_t Byte = 0; Byte < 256; Byte += DWORD_TO_BYTES) {
+        uint32_t Packed = 0;
+        for (size_t i = 0; i < DWORD_TO_BYTES; ++i) {
+            Packed |= (uint32_t)ret->ByteClass[Byte + i] << (8*i);
+        }
+        *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, ByteClassTable + Byte, Packed);
+    }
+    // We don't know all of the constants until the end
+    size_t JmpToWriteConstants = ret->Count;
+    *NextInstr(ret) = J(JMP);
+    size_t ConstantsWritten = ret->Count;
+    *NextInstr(ret) = RR32(XOR, REG, EDX, EDX, 0);
+
+    // Start the next group of strings
+    size_t GroupTop = ret->Count;
+    *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EAX, NumStringsArgDisp);
+    *NextInstr(ret) = RR32(CMP, REG, EDX, EAX, 0);
+    size_t JmpToDone = ret->Count;
+    *NextInstr(ret) = J(JAE);
+    for (uint32_t Lane = 0; Lane < LANES_PER_XMM; ++Lane) {
+        // Data[Offsets[edx + Lane]] up to Data[Offsets[edx + Lane + 1]]
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EDX, 0);
+        if (Lane != 0) {
+            *NextInstr(ret) = RI32(ADD, REG, ECX, 0, Lane);
+        }
+        *NextInstr(ret) = RR32(CMP, REG, ECX, EAX, 0);
+        size_t JmpPastTheEnd = ret->Count;
+        *NextInstr(ret) = J(JAE);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EAX, OffsetsArgDisp);
+        *NextInstr(ret) = RRS32(MOVR, MEM, EAX, EBX, ECX, DWORD_TO_BYTES, 0);
+        *NextInstr(ret) = RRS32(MOVR, MEM_DISP8, EAX, ECX, ECX, DWORD_TO_BYTES, DWORD_TO_BYTES);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EAX, DataArgDisp);
+        *NextInstr(ret) = RR32(ADD, REG, EBX, EAX, 0);
+        *NextInstr(ret) = RR32(ADD, REG, ECX, EAX, 0);
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EAX, NumStringsArgDisp);
+        size_t JmpToStore = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpPastTheEnd].JumpDestIdx = ret->Count;
+        // An empty string, the lane is ignored
+        *NextInstr(ret) = RR32(XOR, REG, EBX, EBX, 0);
+        *NextInstr(ret) = RR32(XOR, REG, ECX, ECX, 0);
+        ret->Instructions[JmpToStore].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(MOV, MEM_DISP8, ESP, EBX, LanePtrs + Lane*DWORD_TO_BYTES);
+        *NextInstr(ret) = RR32(MOV, MEM_DISP8, ESP, ECX, LaneEnds + Lane*DWORD_TO_BYTES);
+    }
+    *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM0, LaneConstant(&Constants, StartClosure));
+    *NextInstr(ret) = RX(PXOR, REG, XMM6, XMM6, 0);
+
+    size_t StepTop = ret->Count;
+    for (uint32_t Lane = 0; Lane < LANES_PER_XMM; ++Lane) {
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, ESP, EAX, LanePtrs + Lane*DWORD_TO_BYTES);
+        *NextInstr(ret) = RI32(MOV, REG, ECX, 0, LANE_END_CLASS);
+        *NextInstr(ret) = RR32(CMP, MEM_DISP8, ESP, EAX, LaneEnds + Lane*DWORD_TO_BYTES);
+        size_t JmpAtEnd = ret->Count;
+        *NextInstr(ret) = J(JE);
+        *NextInstr(ret) = RR32(MOVZX, MEM, EAX, ECX, 0);
+        *NextInstr(ret) = RRS32(MOVZX, MEM_DISP32, ESP, ECX, ECX, 1, ByteClassTable);
+        *NextInstr(ret) = R32(INC, REG, EAX, 0); // Next char in string
+        *NextInstr(ret) = RR32(MOV, MEM_DISP8, ESP, EAX, LanePtrs + Lane*DWORD_TO_BYTES);
+        ret->Instructions[JmpAtEnd].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(MOV, MEM_DISP8, ESP, ECX, LaneClasses + Lane*DWORD_TO_BYTES);
+    }
+    *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM2, LaneClasses);
+
+    // Remember which lanes matched, then stop when they're all done
+    const int32_t EndClass = LaneConstant(&Constants, LANE_END_CLASS);
+    const int32_t AcceptBit = LaneConstant(&Constants, 1 << NFA_ACCEPTSTATE);
+    *NextInstr(ret) = RX(MOVDQAR, REG, XMM2, XMM3, 0);
+    *NextInstr(ret) = RX(PCMPEQD, MEM_DISP32, ESP, XMM3, EndClass);
+    *NextInstr(ret) = RX(MOVDQAR, REG, XMM0, XMM4, 0);
+    *NextInstr(ret) = RX(PAND, MEM_DISP32, ESP, XMM4, AcceptBit);
+    *NextInstr(ret) = RX(PCMPEQD, MEM_DISP32, ESP, XMM4, AcceptBit);
+    if (!Options.Unanchored) {
+        *NextInstr(ret) = RX(PAND, REG, XMM3, XMM4, 0);
+    }
+    *NextInstr(ret) = RX(POR, REG, XMM4, XMM6, 0);
+    *NextInstr(ret) = RX(PMOVMSKB, REG, XMM3, EAX, 0);
+    *NextInstr(ret) = RI32(CMP, REG, EAX, 0, 0xFFFF);
+    size_t JmpToGroupDone = ret->Count;
+    *NextInstr(ret) = J(JE);
+
+    if (Options.Unanchored) {
+        *NextInstr(ret) = RX(MOVDQAR, MEM_DISP32, ESP, XMM1, LaneConstant(&Constants, StartClosure));
+    } else {
+        *NextInstr(ret) = RX(PXOR, REG, XMM1, XMM1, 0);
+    }
+    for (uint32_t Class = 0; Class < NumByteClasses; ++Class) {
+        size_t FirstByte = 0;
+        while (ret->ByteClass[FirstByte] != Class) {
+            FirstByte += 1;
+        }
+
+        // Every arc that consumes the chars in the class, sorted by From
+        size_t NumClassTransitions = 0;
+        ArcList = NFAFirstArcList(NFA);
+        for (size_t ArcListIdx = 0; ArcListIdx < NFA->NumArcLists; ++ArcListIdx) {
+            if (LabelMatches(ArcList->Label, (char)FirstByte)) {
+                for (size_t TransitionIdx = 0;
+                     TransitionIdx < ArcList->NumTransitions;
+                     ++TransitionIdx)
+                {
+                    ret->MergedTransitions[NumClassTransitions++] = ArcList->Transitions[TransitionIdx];
+                }
+            }
+            ArcList = NFANextArcList(ArcList);
+        }
+        if (NumClassTransitions == 0) {
+            continue;
+        }
+        NFASortTransitions(ret->MergedTransitions, NumClassTransitions);
+
+        *NextInstr(ret) = RX(MOVDQAR, REG, XMM2, XMM3, 0);
+        *NextInstr(ret) = RX(PCMPEQD, MEM_DISP32, ESP, XMM3, LaneConstant(&Constants, Class));
+
+        size_t GroupStart = 0;
+        while (GroupStart < NumClassTransitions) {
+            const uint32_t From = ret->MergedTransitions[GroupStart].From;
+            uint32_t ActivateMask = 0;
+            size_t GroupEnd = GroupStart;
+            for (; GroupEnd < NumClassTransitions &&
+                   ret->MergedTransitions[GroupEnd].From == From; ++GroupEnd)
+            {
+                ActivateMask |= ret->EpsilonClosures[ret->MergedTransitions[GroupEnd].To];
+            }
+            GroupStart = GroupEnd;
+
+            // xmm4 = all ones in the lanes where From is active and the char
+            // is in the class
+            const int32_t FromBit = LaneConstant(&Constants, 1u << From);
+            *NextInstr(ret) = RX(MOVDQAR, REG, XMM0, XMM4, 0);
+            *NextInstr(ret) = RX(PAND, MEM_DISP32, ESP, XMM4, FromBit);
+            *NextInstr(ret) = RX(PCMPEQD, MEM_DISP32, ESP, XMM4, FromBit);
+            *NextInstr(ret) = RX(PAND, REG, XMM3, XMM4, 0);
+            *NextInstr(ret) = RX(PAND, MEM_DISP32, ESP, XMM4, LaneConstant(&Constants, ActivateMask));
+            *NextInstr(ret) = RX(POR, REG, XMM4, XMM1, 0);
+        }
+    }
+    *NextInstr(ret) = RX(MOVDQAR, REG, XMM1, XMM0, 0);
+    *NextInstr(ret) = JD(JMP, StepTop);
+
+    // Set or clear the bit for each string in the group, then go on to the
+    // next one
+    ret->Instructions[JmpToGroupDone].JumpDestIdx = ret->Count;
+    *NextInstr(ret) = RX(PMOVMSKB, REG, XMM6, EAX, 0);
+    size_t LastGroupWrittenJmp = (size_t)-1;
+    for (uint32_t Lane = 0; Lane < LANES_PER_XMM; ++Lane) {
+        *NextInstr(ret) = RR32(MOV, REG, ECX, EDX, 0);
+        if (Lane != 0) {
+            *NextInstr(ret) = RI32(ADD, REG, ECX, 0, Lane);
+        }
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EBX, NumStringsArgDisp);
+        *NextInstr(ret) = RR32(CMP, REG, ECX, EBX, 0);
+        // do a linked list so we can fill in the jump dests
+        size_t NextGroupWrittenJmp = ret->Count;
+        *NextInstr(ret) = J(JAE);
+        ret->Instructions[NextGroupWrittenJmp].JumpDestIdx = LastGroupWrittenJmp;
+        LastGroupWrittenJmp = NextGroupWrittenJmp;
+
+        *NextInstr(ret) = RR32(MOVR, MEM_DISP8, EBP, EBX, ResultsArgDisp);
+        *NextInstr(ret) = RI8(BT, REG, EAX, 0, Lane*DWORD_TO_BYTES); // One bit per byte of the lane
+        size_t JmpNotMatched = ret->Count;
+        *NextInstr(ret) = J(JNC);
+        *NextInstr(ret) = RR32(BTS, MEM, EBX, ECX, 0);
+        *NextInstr(ret) = R32(INC, MEM_DISP8, EBP, NumMatchedDisp);
+        size_t JmpToNextLane = ret->Count;
+        *NextInstr(ret) = J(JMP);
+        ret->Instructions[JmpNotMatched].JumpDestIdx = ret->Count;
+        *NextInstr(ret) = RR32(BTR, MEM, EBX, ECX, 0);
+        ret->Instructions[JmpToNextLane].JumpDestIdx = ret->Count;
+    }
+    while (LastGroupWrittenJmp != (size_t)-1) {
+        size_t NextGroupWrittenJmp = ret->Instructions[LastGroupWrittenJmp].JumpDestIdx;
+        ret->Instructions[LastGroupWrittenJmp].JumpDestIdx = ret->Count;
+        LastGroupWrittenJmp = NextGroupWrittenJmp;
+    }
+    *NextInstr(ret) = RI32(ADD, REG, EDX, 0, LANES_PER_XMM);
+    *NextInstr(ret) = JD(JMP, GroupTop);
+
+    ret->Instructions[JmpToDone].JumpDestIdx = ret->Count;
+    *NextInstr(ret) = RR32(MOV, REG, ESP, EBP, 0); // restore the stack
+    *NextInstr(ret) = R32(POP, REG, EAX, 0); // Number of matches
+    *NextInstr(ret) = R32(POP, REG, EBX, 0); // Callee save
+    *NextInstr(ret) = R32(POP, REG, EBP, 0); // Callee save
+    *NextInstr(ret) = RET;
+
+    // Put the value of each constant in every lane
+    ret->Instructions[JmpToWriteConstants].JumpDestIdx = ret->Count;
+    for (uint32_t Idx = 0; Idx < Constants.Count; ++Idx) {
+        for (uint32_t Lane = 0; Lane < LANES_PER_XMM; ++Lane) {
+            *NextInstr(ret) = RI32(MOV, MEM_DISP32, ESP, Constants.BaseDisp + Idx*XMM_TO_BYTES + Lane*DWORD_TO_BYTES,
+                                   Constants.Values[Idx]);
+        }
+    }
+    *NextInstr(ret) = JD(JMP, ConstantsWritten);
+    ret->Instructions[MakeRoom].Imm = Constants.BaseDisp + Constants.Count*XMM_TO_BYTES + XMM_TO_BYTES;
+
+    ArenaFree(&ret->Scratch);
+    return Result;
+}
@@ -30,8 +30,10 @@
 #endif
 
 struct opcode_unpacked {
-    // uint8_t Prefixes[4]; // not used
+    uint8_t Prefix; // Mandatory prefix for SSE instructions, 0 if none
+    bool IsData; // Not an instruction, just write the Immediate bytes
     uint8_t Opcode[2]; // 6 bits last two are direction and operand length
+    uint8_t Escape; // Middle byte of three byte opcodes (0F 38 xx), 0 if none
     bool HasModRM;
     uint8_t ModRM; // set operands: mod 2 bit, reg/opcode 3 bits, R/M 3 bits
     uint8_t SIB; // addressing modes: scale 2 bits, index 4 bits, base 3 bits
@@ -71,6 +73,23 @@ const char *reg_strings[] = {
     "EAX", "ECX", "EDX", "EBX", "ESP", "EBP", "ESI", "EDI"
 };
 
+// SSE registers use the same ModRM encoding as the general registers. Only the
+// op decides which kind of register it is.
+enum xmm_reg {
+    XMM0 = 0x00,
+    XMM1 = 0x01,
+    XMM2 = 0x02,
+    XMM3 = 0x03,
+    XMM4 = 0x04,
+    XMM5 = 0x05,
+    XMM6 = 0x06,
+    XMM7 = 0x07,
+};
+
+const char *xmm_strings[] = {
+    "XMM0", "XMM1", "XMM2", "XMM3", "XMM4", "XMM5", "XMM6", "XMM7"
+};
+
 // Instruction operation constants to use when using this lib to generate code
 //
 // Order matters, values are indices into constant arrays below.
@@ -81,6 +100,10 @@ const char *reg_strings[] = {
 //  - RI8, RI32 - Register and 8 or 32 bit immediate
 //  - M, R      - Register dereference or small register only instruction
 //  - SRI32     - Small register only Dest plus 32 bit immediate Src
+//  - RRS       - MR or RM but Dest is dereferenced with a scaled index register
+//  - MX        - Dest is a dereferenced register, Src is an XMM register
+//  - XM        - Like RM, writes to XMM register Src. Dest is an XMM
+//                register or a dereferenced register
 enum op {
     // Non-Jump ops
     // Values are indices into op_strings and opcode_* (except opcode_Jmp*)
@@ -100,24 +123,51 @@ enum op {
     // Memory
     MOV,      // MR, SRI32, RI8, RI32
     MOVR,     // RM, Dest and Src are reversed
+    MOVZX,    // RM, Dest is a byte, zero extended into 32 bit register Src (is16 == true only)
+    BSF,      // RM, Src = index of the lowest set bit of Dest (is16 == true only)
+    BTS,      // MR, Set bit Src of Dest. It can be past the dword in memory. (is16 == true only)
+    BTR,      // MR, Like BTS but clears the bit (is16 == true only)
     PUSH,     // M, R (is16 == true only)
     POP,      // M, R (is16 == true only)
+    JMPI,     // M, R (is16 == true only) Indirect jump to the address in Dest
     // No args
     RET,
+    // SSE2
+    // Values minus MOVDQA are indices into opcode_SSE*
+    MOVDQA,   // MX, Dest must be 16 byte aligned
+    MOVDQAR,  // XM, Dest must be 16 byte aligned
+    MOVDQU,   // MX
+    MOVDQUR,  // XM
+    PAND,     // XM
+    POR,      // XM
+    PXOR,     // XM
+    PCMPEQB,  // XM
+    PCMPEQD,  // XM
+    PSHUFB,   // XM (SSSE3) Byte i of Src = byte (Dest[i] & 15) of Src, or 0 if Dest[i] & 0x80
+    PSRLW,    // XMM register Dest and an 8 bit immediate, shifts each word right
+    PSRLDQ,   // XMM register Dest and an 8 bit immediate, shifts the bytes to lower addresses
+    PSLLDQ,   // XMM register Dest and an 8 bit immediate, shifts the bytes to higher addresses
+    PMOVMSKB, // Dest is an XMM register, writes a bit per byte to register Src
 
     // Jumps
     // Values are indices into jmp_strings and opcode_Jmp*
 
     // Jump enums start at zero again because the jump opcodes don't have the
     // same encoding options as the non-jump ops. See: opcode_Jmp8, opcode_jmp16
-    JMP = 0, JNC, JE, JNE, JL, JG
+    //
+    // JL, JG are signed comparisons. JB, JBE, JA, JAE are unsigned.
+    // CALL only has a 32 bit offset form.
+    JMP = 0, JNC, JE, JNE, JL, JG, JB, JBE, JA, JAE, CALL
 };
 
 const char *op_strings[] = {
     "AND ", "OR  ", "XOR ", "ADD ", "SUB ", "INC ", "DEC ", "NOT ",
     "BT  ", "CMP ",
-    "MOV ", "MOVR", "PUSH", "POP ",
+    "MOV ", "MOVR", "MOVZX", "BSF ", "BTS ", "BTR ", "PUSH", "POP ", "JMPI",
     "RET ",
+    "MOVDQA", "MOVDQAR", "MOVDQU", "MOVDQUR",
+    "PAND", "POR ", "PXOR", "PCMPEQB", "PCMPEQD", "PSHUFB", "PSRLW", "PSRLDQ", "PSLLDQ",
+    "PMOVMSKB",
 };
 
 // TODO: Combine jmp_strings with op_strings and make the enum not restart at 0
@@ -126,7 +176,8 @@ const char *op_strings[] = {
 
 // Strings separated because the jmp enums (in op) start at 0.
 const char *jmp_strings[] = {
-    "JMP ", "JNC ", "JE  ", "JNE ", "JL  ", "JG  "
+    "JMP ", "JNC ", "JE  ", "JNE ", "JL  ", "JG  ", "JB  ", "JBE ", "JA  ", "JAE ",
+    "CALL"
 };
 
 enum op_type {
@@ -135,6 +186,8 @@ enum op_type {
     TWO_REG,
     REG_IMM,
     NOARG,
+    XMM_REG, // Two registers where at least one is an XMM register
+    DATA,    // Not an instruction, a 32 bit offset between two instructions
 };
 
 struct instruction {
@@ -150,6 +203,10 @@ struct instruction {
     uint32_t Imm;
     int32_t Disp;
     size_t JumpDestIdx;
+    // Optional for memory modes: Dest + Index*Scale. Scale is 1, 2, 4, or 8,
+    // or 0 for no index
+    reg Index;
+    uint8_t Scale;
 };
 
 // Non jump opcode constants in order of the op enum
@@ -160,22 +217,22 @@ struct instruction {
 
 // Opcodes for args (reg, reg/mem), (reg/mem)
 const uint8_t opcode_MemReg[] =
-{ 0x20, 0x08, 0x30, 0x00, 0x80, 0xFE, 0xFE, 0xF6,
+{ 0x20, 0x08, 0x30, 0x00, 0x28, 0xFE, 0xFE, 0xF6,
   0x00, 0x38,
-  0x88, 0x8A, 0xFE, 0x8E,
+  0x88, 0x8A, 0xB6, 0xBC, 0xAB, 0xB3, 0xFE, 0x8E, 0xFE,
   0xC3};
 // Opcodes for (reg/mem, imm), (imm)
 const uint16_t opcode_Imm[] =
 { 0x0080, 0x0080, 0x0080, 0x0080, 0x0080, 0x0000, 0x0000, 0x0000,
   0x0FBA, 0x0080,
-  0x00C6, 0x0000, 0x0000, 0x0000,
+  0x00C6, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000, 0x0000,
   0x0000};
 // Used for (reg/mem, imm), (reg/mem) instructions.
 // It's the "/digit" in the Opcode column in the intel manual
 const uint8_t opcode_Extra[] = 
 { 0x04, 0x01, 0x06, 0x00, 0x05, 0x00, 0x01, 0x02,
   0x04, 0x07,
-  0x00, 0x00, 0x06, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x06, 0x00, 0x04,
   0x00};
 // Opcodes for encoding the register in the opcode to save a byte.
 // Available for some (reg) and (reg, imm) instructions
@@ -184,16 +241,31 @@ const uint8_t opcode_Extra[] =
 const uint8_t opcode_ShortReg[] =
 { 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x48, 0x00,
   0x00, 0x00,
-  0xB8, 0x00, 0x50, 0x58,
+  0xB8, 0x00, 0x00, 0x00, 0x00, 0x00, 0x50, 0x58, 0x00,
   0x00};
 
 // Has separate index space from the other arrays because they are encoded
 // differently.
 // The two arrays are: 8 bit offset, or 16/32 bit offset
-const uint8_t  opcode_Jmp8[] =  {   0xEB,   0x73,   0x74,   0x75,   0x7C,   0x7F};
-const uint16_t opcode_Jmp32[] = { 0x00E9, 0x0F83, 0x0F84, 0x0F85, 0x0F8C, 0x0F8F};
+const uint8_t  opcode_Jmp8[] =  {   0xEB,   0x73,   0x74,   0x75,   0x7C,   0x7F,
+                                    0x72,   0x76,   0x77,   0x73,   0x00};
+const uint16_t opcode_Jmp32[] = { 0x00E9, 0x0F83, 0x0F84, 0x0F85, 0x0F8C, 0x0F8F,
+                                  0x0F82, 0x0F86, 0x0F87, 0x0F83, 0x00E8};
+
+// SSE2 opcodes in order of the op enum starting from MOVDQA. They are all
+// encoded as: Prefix 0x0F Opcode ModRM, except PSHUFB is Prefix 0x0F 0x38
+// Opcode ModRM and the shifts have an 8 bit immediate after ModRM.
+const uint8_t opcode_SSEPrefix[] = { 0x66, 0x66, 0xF3, 0xF3, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+                                     0x66, 0x66, 0x66, 0x66 };
+const uint8_t opcode_SSE[]       = { 0x7F, 0x6F, 0x7F, 0x6F, 0xDB, 0xEB, 0xEF, 0x74, 0x76, 0x00,
+                                     0x71, 0x73, 0x73, 0xD7 };
+// For the shifts by an immediate, the reg field of ModRM is this opcode
+// extension instead of a register
+const uint8_t opcode_SSEExtra[]  = { 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+                                     0x02, 0x03, 0x07, 0x00 };
 
 opcode_unpacked OpJump8(op Op, int8_t Offs) {
+    Assert(opcode_Jmp8[Op] != 0);
     opcode_unpacked Result = {};
 
     Result.Opcode[1] = opcode_Jmp8[Op];
@@ -239,7 +311,7 @@ opcode_unpacked OpNoarg(op Op) {
 // TODO: Consolidate this code, very similar things are being done in all of
 // the Opcode encoders
 opcode_unpacked OpReg(op Op, addressing_mode Mode, reg Reg, int32_t Displacement, bool is16) {
-    Assert(Op == INC || Op == DEC || Op == NOT || (Op == PUSH && is16) || (Op == POP && is16));
+    Assert(Op == INC || Op == DEC || Op == NOT || ((Op == PUSH || Op == POP || Op == JMPI) && is16));
     opcode_unpacked Result = {};
 
     if (is16 && Mode == REG && opcode_ShortReg[Op] != 0) {
@@ -288,8 +360,10 @@ opcode_unpacked OpReg(op Op, addressing_mode Mode, reg Reg, int32_t Displacement
     return Result;
 }
 
-opcode_unpacked OpRegReg(op Op, addressing_mode Mode, reg DestReg, int32_t Displacement, reg SrcReg, bool is16) {
-    Assert(Op == AND || Op == OR || Op == XOR || Op == ADD || Op == SUB || Op == CMP || Op == MOV || Op == MOVR);
+opcode_unpacked OpRegReg(op Op, addressing_mode Mode, reg DestReg, int32_t Displacement, reg SrcReg, bool is16,
+                         reg IndexReg = R_NONE, uint8_t Scale = 0) {
+    Assert(Op == AND || Op == OR || Op == XOR || Op == ADD || Op == SUB || Op == CMP || Op == MOV || Op == MOVR ||
+           ((Op == MOVZX || Op == BSF || Op == BTS || Op == BTR) && is16));
 
     opcode_unpacked Result = {};
 
@@ -301,23 +375,39 @@ opcode_unpacked OpRegReg(op Op, addressing_mode Mode, reg DestReg, int32_t Displ
             Assert(DestReg != ESP && DestReg != EBP && DestReg != ESI && DestReg != EDI);
         }
     }
+    reg RMReg = DestReg;
     if (Mode == MEM || Mode == MEM_DISP8 || Mode == MEM_DISP32) {
-        // See Section 2.1.5 Table 2-3
-        if (DestReg == ESP) {
-            Result.SIB = 0x24;
-        } else if (Mode == MEM && DestReg == EBP) {
+        if (Mode == MEM && DestReg == EBP) {
             // [EBX] is not encodable without a 0 displacement
             // See Table 2-2
             Mode = MEM_DISP8;
             Displacement = 0;
         }
+        // See Section 2.1.5 Table 2-3
+        if (Scale != 0) {
+            // ESP in the R/M field means use the SIB byte
+            Assert(IndexReg != ESP); // That encoding means no index
+            uint8_t ScaleBits = (Scale == 8) ? 3 : (Scale == 4) ? 2 : (Scale == 2) ? 1 : 0;
+            Assert((1 << ScaleBits) == Scale);
+            RMReg = ESP;
+            Result.SIB = (uint8_t)((ScaleBits << 6) | (IndexReg << 3) | DestReg);
+        } else if (DestReg == ESP) {
+            Result.SIB = 0x24;
+        }
+    } else {
+        Assert(Scale == 0);
     }
 
-    Result.Opcode[1] = opcode_MemReg[Op] + (is16 ? 1 : 0);
+    if (Op == MOVZX || Op == BSF || Op == BTS || Op == BTR) { // The only two byte opcodes here
+        Result.Opcode[0] = 0x0F;
+        Result.Opcode[1] = opcode_MemReg[Op];
+    } else {
+        Result.Opcode[1] = opcode_MemReg[Op] + (is16 ? 1 : 0);
+    }
 
     Result.ModRM |= Mode;
     Result.ModRM |= SrcReg << 3;
-    Result.ModRM |= DestReg;
+    Result.ModRM |= RMReg;
     Result.HasModRM = true;
 
     if (Mode == MEM_DISP8) {
@@ -345,9 +435,10 @@ opcode_unpacked OpRegImm(op Op, addressing_mode Mode, reg DestReg, int32_t Displ
         Result.Opcode[1] = opcode_ShortReg[Op] + (uint8_t)DestReg;
         Result.HasModRM = false;
     } else {
-        if (Mode == REG && !is16) {
+        if (Mode == REG && !is16 && Op != BT) {
             // These would encode AH, CD, DH, BH respectively
             // See Section 2.1.5 Table 2-2, top row, this is an r8 argument
+            // (BT's register is always r/m32, only the immediate is 8 bits)
             Assert(DestReg != ESP && DestReg != EBP && DestReg != ESI && DestReg != EDI);
         } else if (Mode == MEM || Mode == MEM_DISP8 || Mode == MEM_DISP32) {
             // See Section 2.1.5 Table 2-3
@@ -399,12 +490,97 @@ opcode_unpacked OpRegImm(op Op, addressing_mode Mode, reg DestReg, int32_t Displ
     return Result;
 }
 
+opcode_unpacked OpXmm(op Op, addressing_mode Mode, reg DestReg, int32_t Displacement, reg SrcReg,
+                      uint32_t Imm = 0) {
+    Assert(Op >= MOVDQA && Op <= PMOVMSKB);
+    const bool IsShift = (Op == PSRLW || Op == PSRLDQ || Op == PSLLDQ);
+    // PMOVMSKB and the shifts only work on registers
+    Assert((Op != PMOVMSKB && !IsShift) || Mode == REG);
+    opcode_unpacked Result = {};
+
+    if (Mode == MEM || Mode == MEM_DISP8 || Mode == MEM_DISP32) {
+        // See Section 2.1.5 Table 2-3
+        if (DestReg == ESP) {
+            Result.SIB = 0x24;
+        } else if (Mode == MEM && DestReg == EBP) {
+            // [EBX] is not encodable without a 0 displacement
+            // See Table 2-2
+            Mode = MEM_DISP8;
+            Displacement = 0;
+        }
+    } else {
+        // The stores only have a memory form
+        Assert(Op != MOVDQA && Op != MOVDQU);
+    }
+
+    Result.Prefix = opcode_SSEPrefix[Op - MOVDQA];
+    Result.Opcode[0] = 0x0F;
+    Result.Opcode[1] = opcode_SSE[Op - MOVDQA];
+    if (Op == PSHUFB) { // The only three byte opcode
+        Result.Escape = 0x38;
+    }
+
+    Result.ModRM |= Mode;
+    if (IsShift) {
+        Result.ModRM |= opcode_SSEExtra[Op - MOVDQA] << 3;
+        Result.ImmCount = 1;
+        Result.Immediate[0] = (uint8_t) (Imm & 0xFF);
+        Assert((Imm & 0xFFFFFF00) == 0);
+    } else {
+        Result.ModRM |= SrcReg << 3;
+    }
+    Result.ModRM |= DestReg;
+    Result.HasModRM = true;
+
+    if (Mode == MEM_DISP8) {
+        Result.DispCount = 1;
+        Result.Displacement[0] = (uint8_t) (Displacement & 0xFF);
+        Assert((Displacement & 0xFFFFFF00) == 0);
+    } else if (Mode == MEM_DISP32) {
+        Result.DispCount = 4;
+        Result.Displacement[0] = (uint8_t) (Displacement &       0xFF);
+        Result.Displacement[1] = (uint8_t)((Displacement &     0xFF00) >>  8);
+        Result.Displacement[2] = (uint8_t)((Displacement &   0xFF0000) >> 16);
+        Result.Displacement[3] = (uint8_t)((Displacement & 0xFF000000) >> 24);
+    } else {
+        Assert(Displacement == 0);
+    }
+
+    return Result;
+}
+
+// Offset from the start of one instruction to another, filled in by
+// AssembleInstructions like a jump offset
+opcode_unpacked OpData32(int32_t Offs) {
+    opcode_unpacked Result = {};
+    Result.IsData = true;
+
+    Result.Immediate[0] = (uint8_t) (Offs &       0xFF);
+    Result.Immediate[1] = (uint8_t)((Offs &     0xFF00) >>  8);
+    Result.Immediate[2] = (uint8_t)((Offs &   0xFF0000) >> 16);
+    Result.Immediate[3] = (uint8_t)((Offs & 0xFF000000) >> 24);
+    Result.ImmCount = 4;
+
+    return Result;
+}
+
 // See SizeOpcode(..). It is: 2 + 1 + 1 + 4 + 4 = 12
+// SSE instructions have a prefix and can have 3 opcode bytes, but the only
+// ones with an immediate don't have a displacement so they're shorter.
 #define MAX_OPCODE_LEN 12
 
 size_t SizeOpcode(opcode_unpacked Opcode) {
+    if (Opcode.IsData) {
+        return Opcode.ImmCount;
+    }
     size_t Result = 0;
+    if (Opcode.Prefix) {
+        Result += 1;
+    }
     Result += (Opcode.Opcode[0] == 0) ? 1 : 2;
+    if (Opcode.Escape) {
+        Result += 1;
+    }
 
     if (Opcode.HasModRM) {
         Result += 1;
@@ -454,7 +630,9 @@ void AssembleInstructions(instruction *Instructions, size_t NumInstructions, opc
                 // We don't know how big the ops between here and the dest are yet
                 int32_t JumpOffsetUpperBound = JumpDist * MAX_OPCODE_LEN;
 
-                if (JumpOffsetUpperBound < -128 || JumpOffsetUpperBound > 127) {
+                if (Inst->Op == CALL ||
+                    JumpOffsetUpperBound < -128 || JumpOffsetUpperBound > 127)
+                {
                     *(NextOpcode++) = OpJump32(Inst->Op, 0);
                 } else {
                     *(NextOpcode++) = OpJump8(Inst->Op, 0);
@@ -464,7 +642,8 @@ void AssembleInstructions(instruction *Instructions, size_t NumInstructions, opc
                 *(NextOpcode++) = OpReg(Inst->Op, Inst->Mode, Inst->Dest, Inst->Disp, Inst->Is16);
                 break;
             case TWO_REG:
-                *(NextOpcode++) = OpRegReg(Inst->Op, Inst->Mode, Inst->Dest, Inst->Disp, Inst->Src, Inst->Is16);
+                *(NextOpcode++) = OpRegReg(Inst->Op, Inst->Mode, Inst->Dest, Inst->Disp, Inst->Src, Inst->Is16,
+                                           Inst->Index, Inst->Scale);
                 break;
             case REG_IMM:
                 *(NextOpcode++) = OpRegImm(Inst->Op, Inst->Mode, Inst->Dest, Inst->Disp, Inst->Imm, Inst->Is16);
@@ -472,6 +651,12 @@ void AssembleInstructions(instruction *Instructions, size_t NumInstructions, opc
             case NOARG:
                 *(NextOpcode++) = OpNoarg(Inst->Op);
                 break;
+            case XMM_REG:
+                *(NextOpcode++) = OpXmm(Inst->Op, Inst->Mode, Inst->Dest, Inst->Disp, Inst->Src, Inst->Imm);
+                break;
+            case DATA:
+                *(NextOpcode++) = OpData32(0);
+                break;
         }
     }
 
@@ -488,6 +673,13 @@ void AssembleInstructions(instruction *Instructions, size_t NumInstructions, opc
             } else if (UnpackedOpcodes[Idx].ImmCount == 4) {
                 UnpackedOpcodes[Idx] = OpJump32(Inst->Op, JumpOffset);
             }
+        } else if (Inst->Type == DATA) {
+            // Relative to the start of instruction Imm instead of the end of
+            // this one
+            Assert(Inst->JumpDestIdx < NumInstructions);
+            Assert(Inst->Imm > 0 && Inst->Imm < NumInstructions);
+            int32_t Offset = ComputeJumpOffset(UnpackedOpcodes, Inst->Imm - 1, Inst->JumpDestIdx);
+            UnpackedOpcodes[Idx] = OpData32(Offset);
         }
     }
 }
@@ -517,8 +709,19 @@ inline uint8_t Copy32(uint8_t *Dest, uint8_t *Src, uint8_t Count) {
 size_t PackCode(opcode_unpacked *Opcodes, size_t NumOpcodes, uint8_t *Dest) {
     uint8_t *DestStart = Dest;
     for (size_t Idx = 0; Idx < NumOpcodes; ++Idx, ++Opcodes) {
+        if (Opcodes->IsData) {
+            Dest += Copy32(Dest, Opcodes->Immediate, Opcodes->ImmCount);
+            continue;
+        }
+        if (Opcodes->Prefix) {
+            *Dest++ = Opcodes->Prefix;
+        }
         if (Opcodes->Opcode[0] == 0) { // size is 1
             Dest += Copy32(Dest, Opcodes->Opcode + 1, 1);
+        } else if (Opcodes->Escape) { // size is 3
+            *Dest++ = Opcodes->Opcode[0];
+            *Dest++ = Opcodes->Escape;
+            *Dest++ = Opcodes->Opcode[1];
         } else { // size is 2
             Dest += Copy32(Dest, Opcodes->Opcode, 2);
         }
@@ -538,20 +741,30 @@ size_t PackCode(opcode_unpacked *Opcodes, size_t NumOpcodes, uint8_t *Dest) {
 }
 
 // Declare single register argument instructions
-#define R8(op, mode, reg, disp) (instruction{(mode), (op), ONE_REG, (reg),  R_NONE, false, 0, (int32_t)(disp), 0})
-#define R32(op, mode, reg, disp) (instruction{(mode), (op), ONE_REG, (reg), R_NONE, true, 0, (int32_t)(disp), 0})
+#define R8(op, mode, reg, disp) (instruction{(mode), (op), ONE_REG, (reg),  R_NONE, false, 0, (int32_t)(disp), 0, R_NONE, 0})
+#define R32(op, mode, reg, disp) (instruction{(mode), (op), ONE_REG, (reg), R_NONE, true, 0, (int32_t)(disp), 0, R_NONE, 0})
 // Declare two register argument instructions
-#define RR8(op, mode, dest, src, disp) (instruction{(mode), (op), TWO_REG, (dest), (src), false, 0, (int32_t)(disp), 0})
-#define RR32(op, mode, dest, src, disp) (instruction{(mode), (op), TWO_REG, (dest), (src), true, 0, (int32_t)(disp), 0})
+#define RR8(op, mode, dest, src, disp) (instruction{(mode), (op), TWO_REG, (dest), (src), false, 0, (int32_t)(disp), 0, R_NONE, 0})
+#define RR32(op, mode, dest, src, disp) (instruction{(mode), (op), TWO_REG, (dest), (src), true, 0, (int32_t)(disp), 0, R_NONE, 0})
+// Declare two register argument instructions where Dest is dereferenced as
+// [dest + index*scale + disp]
+#define RRS32(op, mode, dest, src, index, scale, disp) (instruction{(mode), (op), TWO_REG, (dest), (src), true, 0, (int32_t)(disp), 0, (index), (scale)})
 // Declare register and an immediate value argument instructions
-#define RI8(op, mode, dest, disp, imm) (instruction{(mode), (op), REG_IMM, (dest), R_NONE, false, (uint32_t)(imm), (int32_t)(disp), 0})
-#define RI32(op, mode, dest, disp, imm) (instruction{(mode), (op), REG_IMM, (dest), R_NONE, true, (uint32_t)(imm), (int32_t)(disp), 0})
+#define RI8(op, mode, dest, disp, imm) (instruction{(mode), (op), REG_IMM, (dest), R_NONE, false, (uint32_t)(imm), (int32_t)(disp), 0, R_NONE, 0})
+#define RI32(op, mode, dest, disp, imm) (instruction{(mode), (op), REG_IMM, (dest), R_NONE, true, (uint32_t)(imm), (int32_t)(disp), 0, R_NONE, 0})
 // Declare a jump to an instruction index in the innstructions array
-#define JD(op, instrIdx) (instruction{MODE_NONE, (op), JUMP, R_NONE, R_NONE, false, 0, 0, (instrIdx)})
+#define JD(op, instrIdx) (instruction{MODE_NONE, (op), JUMP, R_NONE, R_NONE, false, 0, 0, (instrIdx), R_NONE, 0})
 // Declare a jump with destination to be filled later (Use PeekIdx())
 #define J(op) JD((op), 0)
+// Declare an SSE instruction. See the op enum for which args are XMM registers
+#define RX(op, mode, dest, src, disp) (instruction{(mode), (op), XMM_REG, (reg)(dest), (reg)(src), true, 0, (int32_t)(disp), 0, R_NONE, 0})
+// Declare an SSE shift of an XMM register by an immediate
+#define RXI(op, dest, imm) (instruction{REG, (op), XMM_REG, (reg)(dest), R_NONE, true, (uint32_t)(imm), 0, 0, R_NONE, 0})
+// Declare a 32 bit offset from the start of instruction baseIdx to instruction
+// destIdx, for building jump tables. baseIdx must be > 0.
+#define DATA32(destIdx, baseIdx) (instruction{MODE_NONE, (op)0, DATA, R_NONE, R_NONE, true, (uint32_t)(baseIdx), 0, (destIdx), R_NONE, 0})
 // Declare ret, the only instruction we support with no args
-#define RET (instruction{MODE_NONE, RET, NOARG, R_NONE, R_NONE, false, 0, 0, 0})
+#define RET (instruction{MODE_NONE, RET, NOARG, R_NONE, R_NONE, false, 0, 0, 0, R_NONE, 0})
 
 #define X86_OPCODE_H_
 #endif